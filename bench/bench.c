@@ -0,0 +1,480 @@
+/*
+ *  bench.c
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "bench.h"
+
+#define MIN_ITERATIONS 3
+#define DEFAULT_SECONDS 0.5
+
+#define FORMAT_TEXT 0
+#define FORMAT_CSV 1
+#define FORMAT_JSON 2
+
+#ifndef MCNBT_BENCH_VERSION
+#define MCNBT_BENCH_VERSION "unknown"
+#endif
+
+/* allocations the library made, in every category, since counting began */
+static uint64_t _alloc_count(void) {
+    nbt_alloc_stats_t stats;
+    uint64_t ret = 0;
+
+    nbt_alloc_stats_get(&stats);
+    for (int i = 0; i < MCNBT_ALLOC_CATEGORIES; i++) {
+        ret += stats.calls[i];
+    }
+    return ret;
+}
+
+typedef struct _bench_input_t {
+    char name[64];
+    char *raw;
+    size_t raw_len;
+    char *gz;
+    size_t gz_len;
+    size_t gz_cap;
+    size_t tags;
+    nbt_node_t *tree;
+} _bench_input_t;
+
+typedef struct _bench_phase_t {
+    const char *name;
+    /* untimed, before every iteration */
+    int (*setup)(_bench_input_t *in, void **state);
+    /* the measured operation */
+    int (*run)(_bench_input_t *in, void **state);
+    /* untimed, after every iteration */
+    void (*teardown)(_bench_input_t *in, void **state);
+} _bench_phase_t;
+
+typedef struct _bench_opts_t {
+    int format;
+    unsigned long iterations;
+    double seconds;
+    const char *corpus;
+    const char *phase;
+} _bench_opts_t;
+
+static double _now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/* Linux can reset the high water mark, so each phase reports its own
+ * peak; elsewhere this is the peak of the whole process so far */
+static void _peak_rss_reset(void) {
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (f != NULL) {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+static long _peak_rss_kb(void) {
+    struct rusage ru;
+    char line[128];
+    long ret = -1;
+    FILE *f = fopen("/proc/self/status", "r");
+
+    if (f != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (strncmp(line, "VmHWM:", 6) == 0) {
+                ret = strtol(line + 6, NULL, 10);
+                break;
+            }
+        }
+        fclose(f);
+    }
+
+    if (ret < 0 && getrusage(RUSAGE_SELF, &ru) == 0) {
+        ret = ru.ru_maxrss;
+    }
+    return ret;
+}
+
+static int _count_value(void *userdata) {
+    (*(size_t *) userdata)++;
+    return MCNBT_EVENT_CONTINUE;
+}
+
+static int _count_compound(void *userdata, const char *name, size_t name_len) {
+    (void) name;
+    (void) name_len;
+    return _count_value(userdata);
+}
+
+static int _count_list(void *userdata, const char *name, size_t name_len, nbt_tag_type_t type, size_t count) {
+    (void) name;
+    (void) name_len;
+    (void) type;
+    (void) count;
+    return _count_value(userdata);
+}
+
+#define COUNTER(fn, type) \
+    static int fn(void *userdata, const char *name, size_t name_len, type value) { \
+        (void) name; \
+        (void) name_len; \
+        (void) value; \
+        return _count_value(userdata); \
+    }
+COUNTER(_count_byte, char)
+COUNTER(_count_short, short)
+COUNTER(_count_int, int)
+COUNTER(_count_long, long)
+COUNTER(_count_float, float)
+COUNTER(_count_double, double)
+
+static int _count_bytes(void *userdata, const char *name, size_t name_len, const char *data, size_t len) {
+    (void) name;
+    (void) name_len;
+    (void) data;
+    (void) len;
+    return _count_value(userdata);
+}
+
+static int _count_array(void *userdata, const char *name, size_t name_len, const void *data, size_t count) {
+    (void) name;
+    (void) name_len;
+    (void) data;
+    (void) count;
+    return _count_value(userdata);
+}
+
+static const nbt_event_callbacks_t _counters = {
+    .begin_compound = _count_compound,
+    .begin_list = _count_list,
+    .byte_value = _count_byte,
+    .short_value = _count_short,
+    .int_value = _count_int,
+    .long_value = _count_long,
+    .float_value = _count_float,
+    .double_value = _count_double,
+    .string_value = _count_bytes,
+    .byte_array = _count_bytes,
+    .int_array = _count_array,
+    .long_array = _count_array,
+};
+
+static int _sink(void *userdata, const void *buf, size_t len) {
+    _bench_input_t *in = userdata;
+
+    /* the buffer is sized up front so the sink never shows up in the allocation count */
+    if (in->gz_cap - in->gz_len < len) {
+        return -1;
+    }
+    memcpy(in->gz + in->gz_len, buf, len);
+    in->gz_len += len;
+    return 0;
+}
+
+static int _parse(_bench_input_t *in, void **state) {
+    *state = nbt_initialize_raw(in->raw, in->raw_len, NULL, 0);
+    return *state != NULL ? 0 : -1;
+}
+
+static void _free_tree(_bench_input_t *in, void **state) {
+    (void) in;
+    nbt_node_free(*state);
+    *state = NULL;
+}
+
+/* a tree remembers its last encoding, so every round serializes a fresh parse */
+static int _serialize(_bench_input_t *in, void **state) {
+    size_t len;
+    char *out = nbt_node_serialize(*state, &len);
+
+    if (out == NULL || len != in->raw_len) {
+        nbt_free(out);
+        return -1;
+    }
+    nbt_free(out);
+    return 0;
+}
+
+static int _compress(_bench_input_t *in, void **state) {
+    (void) state;
+    in->gz_len = 0;
+    return nbt_write_sink(in->tree, _sink, in, MCNBT_COMPRESS_GZIP);
+}
+
+/* there is no entry point that only inflates, so this includes the parse */
+static int _decompress(_bench_input_t *in, void **state) {
+    *state = nbt_initialize(in->gz, in->gz_len);
+    return *state != NULL ? 0 : -1;
+}
+
+static const _bench_phase_t _phases[] = {
+    {"parse", NULL, _parse, _free_tree},
+    {"serialize", _parse, _serialize, _free_tree},
+    {"compress", NULL, _compress, NULL},
+    {"decompress", NULL, _decompress, _free_tree},
+};
+
+#define PHASE_COUNT (sizeof(_phases) / sizeof(_phases[0]))
+
+static void _print_header(const _bench_opts_t *opts) {
+    if (opts->format == FORMAT_TEXT) {
+        printf("libmcnbt %s\n", MCNBT_BENCH_VERSION);
+        printf("%-16s %-10s %12s %10s %7s %10s %10s %11s %10s\n", "corpus", "phase", "bytes", "tags", "iters",
+               "MB/s", "Mtags/s", "allocs/tag", "peak KiB");
+    } else if (opts->format == FORMAT_CSV) {
+        printf("version,corpus,phase,bytes,tags,iterations,seconds,mb_per_s,tags_per_s,allocs_per_tag,"
+               "peak_rss_kb\n");
+    }
+}
+
+static void _print_result(const _bench_opts_t *opts, const _bench_input_t *in, const char *phase,
+                          unsigned long iters, double secs, uint64_t allocs, long rss) {
+    double mbps = (double) in->raw_len * (double) iters / secs / 1e6;
+    double tps = (double) in->tags * (double) iters / secs;
+    double apt = in->tags ? (double) allocs / (double) iters / (double) in->tags : 0.0;
+
+    switch (opts->format) {
+        case FORMAT_CSV:
+            printf("%s,%s,%s,%zu,%zu,%lu,%.6f,%.2f,%.0f,%.4f,%ld\n", MCNBT_BENCH_VERSION, in->name, phase,
+                   in->raw_len, in->tags, iters, secs, mbps, tps, apt, rss);
+            break;
+        case FORMAT_JSON:
+            printf("{\"version\":\"%s\",\"corpus\":\"%s\",\"phase\":\"%s\",\"bytes\":%zu,\"tags\":%zu,"
+                   "\"iterations\":%lu,\"seconds\":%.6f,\"mb_per_s\":%.2f,\"tags_per_s\":%.0f,"
+                   "\"allocs_per_tag\":%.4f,\"peak_rss_kb\":%ld}\n",
+                   MCNBT_BENCH_VERSION, in->name, phase, in->raw_len, in->tags, iters, secs, mbps, tps, apt, rss);
+            break;
+        default:
+            printf("%-16s %-10s %12zu %10zu %7lu %10.1f %10.2f %11.3f %10ld\n", in->name, phase, in->raw_len,
+                   in->tags, iters, mbps, tps / 1e6, apt, rss);
+            break;
+    }
+    fflush(stdout);
+}
+
+static int _run_phase(const _bench_opts_t *opts, _bench_input_t *in, const _bench_phase_t *phase) {
+    unsigned long iters = 0;
+    uint64_t allocs = 0, a;
+    double secs = 0.0, t;
+    void *state = NULL;
+
+    _peak_rss_reset();
+
+    for (;;) {
+        if (opts->iterations ? iters >= opts->iterations : iters >= MIN_ITERATIONS && secs >= opts->seconds) {
+            break;
+        }
+
+        if (phase->setup != NULL && phase->setup(in, &state) != 0) {
+            return -1;
+        }
+
+        a = _alloc_count();
+        t = _now();
+        if (phase->run(in, &state) != 0) {
+            if (phase->teardown != NULL) {
+                phase->teardown(in, &state);
+            }
+            return -1;
+        }
+        secs += _now() - t;
+        allocs += _alloc_count() - a;
+        iters++;
+
+        if (phase->teardown != NULL) {
+            phase->teardown(in, &state);
+        }
+    }
+
+    _print_result(opts, in, phase->name, iters, secs, allocs, _peak_rss_kb());
+    return 0;
+}
+
+/** Prepares a tree for benchmarking: its encoding, tag count and compressed form
+ * @param in Input to fill in; name must already be set
+ * @param tree Tree to take the encoding from; it is freed
+ * @return 0 on success, -1 on failure
+ */
+static int _prepare(_bench_input_t *in, nbt_node_t *tree) {
+    size_t len;
+
+    in->raw = nbt_node_serialize(tree, &len);
+    nbt_node_free(tree);
+    if (in->raw == NULL) {
+        return -1;
+    }
+    in->raw_len = len;
+
+    in->tags = 0;
+    if (nbt_parse_events(in->raw, in->raw_len, &_counters, &in->tags) != 0) {
+        return -1;
+    }
+
+    in->tree = nbt_initialize_raw(in->raw, in->raw_len, NULL, 0);
+    if (in->tree == NULL) {
+        return -1;
+    }
+
+    /* deflate never grows its input by more than a few bytes per 16K block */
+    in->gz_cap = in->raw_len + in->raw_len / 1000 + 1024;
+    in->gz = malloc(in->gz_cap);
+    if (in->gz == NULL) {
+        return -1;
+    }
+    return _compress(in, NULL);
+}
+
+static void _release(_bench_input_t *in) {
+    nbt_node_free(in->tree);
+    nbt_free(in->raw);
+    free(in->gz);
+    memset(in, 0, sizeof(*in));
+}
+
+static char *_read_file(const char *filename, size_t *len) {
+    FILE *f = fopen(filename, "rb");
+    char *ret = NULL;
+    long size;
+
+    if (f == NULL) {
+        return NULL;
+    }
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+        ret = malloc((size_t) size);
+        if (ret != NULL && fread(ret, 1, (size_t) size, f) != (size_t) size) {
+            free(ret);
+            ret = NULL;
+        }
+        *len = (size_t) size;
+    }
+    fclose(f);
+    return ret;
+}
+
+static int _bench_input(const _bench_opts_t *opts, _bench_input_t *in, nbt_node_t *tree) {
+    int ret = 0;
+
+    if (tree == NULL || _prepare(in, tree) != 0) {
+        fprintf(stderr, "%s: could not prepare input\n", in->name);
+        _release(in);
+        return -1;
+    }
+
+    for (size_t i = 0; i < PHASE_COUNT; i++) {
+        if (opts->phase != NULL && strcmp(opts->phase, _phases[i].name) != 0) {
+            continue;
+        }
+        if (_run_phase(opts, in, &_phases[i]) != 0) {
+            fprintf(stderr, "%s: %s failed\n", in->name, _phases[i].name);
+            ret = -1;
+        }
+    }
+
+    _release(in);
+    return ret;
+}
+
+static void _usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-f text|csv|json] [-n iterations] [-t seconds] [-c corpus] [-p phase] "
+                    "[-l] [file...]\n\n"
+                    "Measures parse, serialize, compress and decompress on the built-in corpora and on\n"
+                    "any NBT files given, compressed or not. With files and no -c only the files run.\n",
+            argv0);
+}
+
+int main(int argc, char **argv) {
+    _bench_opts_t opts = {FORMAT_TEXT, 0, DEFAULT_SECONDS, NULL, NULL};
+    _bench_input_t in;
+    int ret = 0, c;
+
+    memset(&in, 0, sizeof(in));
+
+    while ((c = getopt(argc, argv, "f:n:t:c:p:lh")) != -1) {
+        switch (c) {
+            case 'f':
+                if (strcmp(optarg, "text") == 0) {
+                    opts.format = FORMAT_TEXT;
+                } else if (strcmp(optarg, "csv") == 0) {
+                    opts.format = FORMAT_CSV;
+                } else if (strcmp(optarg, "json") == 0) {
+                    opts.format = FORMAT_JSON;
+                } else {
+                    _usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'n':
+                opts.iterations = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                opts.seconds = strtod(optarg, NULL);
+                break;
+            case 'c':
+                opts.corpus = optarg;
+                break;
+            case 'p':
+                opts.phase = optarg;
+                break;
+            case 'l':
+                for (size_t i = 0; i < bench_corpus_count(); i++) {
+                    printf("%s\n", bench_corpus_name(i));
+                }
+                return 0;
+            default:
+                _usage(argv[0]);
+                return c == 'h' ? 0 : 2;
+        }
+    }
+
+    nbt_alloc_stats_enable(1);
+    _print_header(&opts);
+
+    if (optind == argc || opts.corpus != NULL) {
+        for (size_t i = 0; i < bench_corpus_count(); i++) {
+            if (opts.corpus != NULL && strcmp(opts.corpus, bench_corpus_name(i)) != 0) {
+                continue;
+            }
+            snprintf(in.name, sizeof(in.name), "%s", bench_corpus_name(i));
+            if (_bench_input(&opts, &in, bench_corpus_build(i)) != 0) {
+                ret = 1;
+            }
+        }
+    }
+
+    for (int i = optind; i < argc; i++) {
+        const char *base = strrchr(argv[i], '/');
+        size_t len = 0;
+        char *data = _read_file(argv[i], &len);
+        nbt_node_t *tree = data != NULL ? nbt_initialize(data, len) : NULL;
+
+        free(data);
+        snprintf(in.name, sizeof(in.name), "%s", base != NULL ? base + 1 : argv[i]);
+        if (_bench_input(&opts, &in, tree) != 0) {
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,32 @@
+/*
+ *  bench.h
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBMCNBT_BENCH_H
+#define LIBMCNBT_BENCH_H
+
+#include <stddef.h>
+
+#include "mcnbt.h"
+
+/* Synthetic inputs for mcnbt_bench. Every corpus is built from a fixed
+ * seed, so two runs of the same build always measure the same bytes. */
+size_t bench_corpus_count(void);
+const char *bench_corpus_name(size_t i);
+nbt_node_t *bench_corpus_build(size_t i);
+
+#endif //LIBMCNBT_BENCH_H
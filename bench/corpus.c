@@ -0,0 +1,445 @@
+/*
+ *  corpus.c
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+#define CHUNK_SECTIONS 24
+#define CHUNK_BLOCK_ENTITIES 64
+#define ENTITY_COUNT 4096
+#define DEEP_CHAINS 64
+#define DEEP_DEPTH 400
+#define STRING_COUNT 128
+
+static const char *const _blocks[] = {
+    "minecraft:air", "minecraft:stone", "minecraft:granite", "minecraft:diorite", "minecraft:andesite",
+    "minecraft:deepslate", "minecraft:dirt", "minecraft:grass_block", "minecraft:gravel", "minecraft:sand",
+    "minecraft:water", "minecraft:lava", "minecraft:coal_ore", "minecraft:iron_ore", "minecraft:copper_ore",
+    "minecraft:gold_ore", "minecraft:redstone_ore", "minecraft:diamond_ore", "minecraft:oak_log",
+    "minecraft:oak_leaves", "minecraft:tuff", "minecraft:bedrock",
+};
+
+static const char *const _entities[] = {
+    "minecraft:zombie", "minecraft:skeleton", "minecraft:creeper", "minecraft:cow", "minecraft:sheep",
+    "minecraft:pig", "minecraft:chicken", "minecraft:item", "minecraft:villager", "minecraft:bat",
+};
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+/* xorshift64*, seeded again by every generator */
+static uint64_t _seed;
+
+static uint64_t _rand(void) {
+    _seed ^= _seed >> 12;
+    _seed ^= _seed << 25;
+    _seed ^= _seed >> 27;
+    return _seed * 0x2545f4914f6cdd1dULL;
+}
+
+static int _rand_int(int n) {
+    return (int) (_rand() % (uint64_t) n);
+}
+
+static double _rand_double(double max) {
+    return (double) (_rand() >> 11) / 9007199254740992.0 * max;
+}
+
+static nbt_node_t *_add(nbt_node_t *parent, nbt_node_t *child) {
+    nbt_node_append_child(parent, child);
+    return child;
+}
+
+static nbt_node_t *_compound(nbt_node_t *parent, const char *name) {
+    nbt_node_t *ret = nbt_node_initialize(MCNBT_TAG_COMPOUND, name, NULL);
+    return parent != NULL ? _add(parent, ret) : ret;
+}
+
+static nbt_node_t *_list(nbt_node_t *parent, const char *name, nbt_tag_type_t type) {
+    return _add(parent, nbt_node_initialize_list(MCNBT_TAG_LIST, name, NULL, type));
+}
+
+static void _byte(nbt_node_t *parent, const char *name, char value) {
+    _add(parent, nbt_node_initialize(MCNBT_TAG_BYTE, name, &value));
+}
+
+static void _short(nbt_node_t *parent, const char *name, short value) {
+    _add(parent, nbt_node_initialize(MCNBT_TAG_SHORT, name, &value));
+}
+
+static void _int(nbt_node_t *parent, const char *name, int value) {
+    _add(parent, nbt_node_initialize(MCNBT_TAG_INT, name, &value));
+}
+
+static void _long(nbt_node_t *parent, const char *name, long value) {
+    _add(parent, nbt_node_initialize(MCNBT_TAG_LONG, name, &value));
+}
+
+static void _float(nbt_node_t *parent, const char *name, float value) {
+    _add(parent, nbt_node_initialize(MCNBT_TAG_FLOAT, name, &value));
+}
+
+static void _double(nbt_node_t *parent, const char *name, double value) {
+    _add(parent, nbt_node_initialize(MCNBT_TAG_DOUBLE, name, &value));
+}
+
+static void _string(nbt_node_t *parent, const char *name, const char *value) {
+    _add(parent, nbt_node_initialize(MCNBT_TAG_STRING, name, (void *) value));
+}
+
+static void _doubles(nbt_node_t *parent, const char *name, double a, double b, double c) {
+    double v[3] = {a, b, c};
+    nbt_list_set_doubles(_list(parent, name, MCNBT_TAG_DOUBLE), v, 3);
+}
+
+static void _floats(nbt_node_t *parent, const char *name, float a, float b) {
+    float v[2] = {a, b};
+    nbt_list_set_floats(_list(parent, name, MCNBT_TAG_FLOAT), v, 2);
+}
+
+static void _uuid(nbt_node_t *parent) {
+    int v[4];
+    for (int i = 0; i < 4; i++) {
+        v[i] = (int) _rand();
+    }
+    _add(parent, nbt_node_initialize_len(MCNBT_TAG_INT_ARRAY, "UUID", v, sizeof(v)));
+}
+
+static void _item(nbt_node_t *parent, const char *id, int count, int slot) {
+    nbt_node_t *item = _compound(parent, NULL);
+    if (slot >= 0) {
+        _byte(item, "Slot", (char) slot);
+    }
+    _string(item, "id", id);
+    _byte(item, "Count", (char) count);
+}
+
+/* the fields of a level.dat, a few kilobytes of mostly scalars and short strings */
+static nbt_node_t *_gen_level(void) {
+    static const char *const rules[] = {
+        "doFireTick", "doMobLoot", "doMobSpawning", "doTileDrops", "keepInventory", "mobGriefing",
+        "naturalRegeneration", "doDaylightCycle", "commandBlockOutput", "doWeatherCycle", "doInsomnia",
+        "doImmediateRespawn", "drowningDamage", "fallDamage", "fireDamage", "freezeDamage", "doPatrolSpawning",
+        "doTraderSpawning", "forgiveDeadPlayers", "universalAnger", "announceAdvancements", "disableRaids",
+        "showDeathMessages", "spectatorsGenerateChunks", "reducedDebugInfo", "sendCommandFeedback",
+        "logAdminCommands", "disableElytraMovementCheck", "doLimitedCrafting", "doEntityDrops",
+    };
+    nbt_node_t *root = _compound(NULL, "");
+    nbt_node_t *data = _compound(root, "Data");
+    nbt_node_t *rules_tag, *player, *inv, *gen, *dims;
+
+    _int(data, "DataVersion", 3465);
+    _int(data, "version", 19133);
+    _string(data, "LevelName", "New World");
+    _long(data, "RandomSeed", (long) _rand());
+    _long(data, "Time", 1734521);
+    _long(data, "DayTime", 6000);
+    _long(data, "LastPlayed", 1690000000000L);
+    _int(data, "SpawnX", 16);
+    _int(data, "SpawnY", 72);
+    _int(data, "SpawnZ", -48);
+    _float(data, "SpawnAngle", 0.0f);
+    _int(data, "GameType", 0);
+    _byte(data, "hardcore", 0);
+    _byte(data, "allowCommands", 1);
+    _byte(data, "Difficulty", 2);
+    _byte(data, "raining", 0);
+    _int(data, "rainTime", 45012);
+    _byte(data, "thundering", 0);
+    _int(data, "thunderTime", 95011);
+    _int(data, "clearWeatherTime", 0);
+    _double(data, "BorderCenterX", 0.0);
+    _double(data, "BorderCenterZ", 0.0);
+    _double(data, "BorderSize", 59999968.0);
+    _double(data, "BorderDamagePerBlock", 0.2);
+    _double(data, "BorderSafeZone", 5.0);
+    _double(data, "BorderWarningBlocks", 5.0);
+    _double(data, "BorderWarningTime", 15.0);
+
+    rules_tag = _compound(data, "GameRules");
+    for (size_t i = 0; i < COUNT(rules); i++) {
+        _string(rules_tag, rules[i], _rand_int(4) ? "true" : "false");
+    }
+    _string(rules_tag, "randomTickSpeed", "3");
+    _string(rules_tag, "spawnRadius", "10");
+    _string(rules_tag, "maxEntityCramming", "24");
+
+    gen = _compound(data, "WorldGenSettings");
+    _byte(gen, "bonus_chest", 0);
+    _long(gen, "seed", (long) _rand());
+    _byte(gen, "generate_features", 1);
+    dims = _compound(gen, "dimensions");
+    for (int i = 0; i < 3; i++) {
+        static const char *const names[] = {"minecraft:overworld", "minecraft:the_nether", "minecraft:the_end"};
+        nbt_node_t *dim = _compound(dims, names[i]);
+        nbt_node_t *g = _compound(dim, "generator");
+        _string(dim, "type", names[i]);
+        _string(g, "type", "minecraft:noise");
+        _string(g, "settings", names[i]);
+        _string(_compound(g, "biome_source"), "type", "minecraft:multi_noise");
+    }
+
+    player = _compound(data, "Player");
+    _doubles(player, "Pos", 16.5, 72.0, -47.5);
+    _doubles(player, "Motion", 0.0, -0.0784, 0.0);
+    _floats(player, "Rotation", 90.0f, 12.5f);
+    _float(player, "Health", 20.0f);
+    _int(player, "foodLevel", 20);
+    _float(player, "foodSaturationLevel", 5.0f);
+    _int(player, "XpLevel", 30);
+    _float(player, "XpP", 0.25f);
+    _int(player, "XpTotal", 1395);
+    _short(player, "Air", 300);
+    _short(player, "Fire", -20);
+    _byte(player, "OnGround", 1);
+    _string(player, "Dimension", "minecraft:overworld");
+    _uuid(player);
+
+    inv = _list(player, "Inventory", MCNBT_TAG_COMPOUND);
+    for (int i = 0; i < 36; i++) {
+        _item(inv, _blocks[_rand_int((int) COUNT(_blocks))], 1 + _rand_int(64), i);
+    }
+    _list(player, "EnderItems", MCNBT_TAG_END);
+
+    return root;
+}
+
+/* an Anvil chunk: block states packed into long arrays, light, heightmaps and block entities */
+static nbt_node_t *_gen_chunk(void) {
+    nbt_node_t *root = _compound(NULL, "");
+    nbt_node_t *sections, *heightmaps, *entities;
+    long longs[1024];
+    char light[2048];
+
+    _int(root, "DataVersion", 3465);
+    _int(root, "xPos", 12);
+    _int(root, "yPos", -4);
+    _int(root, "zPos", -7);
+    _string(root, "Status", "minecraft:full");
+    _long(root, "LastUpdate", 1734000);
+    _long(root, "InhabitedTime", 86000);
+
+    sections = _list(root, "sections", MCNBT_TAG_COMPOUND);
+    for (int y = -4; y < CHUNK_SECTIONS - 4; y++) {
+        nbt_node_t *section = _compound(sections, NULL);
+        nbt_node_t *states, *palette, *biomes;
+        int size = 1 + _rand_int((int) COUNT(_blocks));
+        int bits = 4, per;
+        size_t n;
+
+        while ((1 << bits) < size) {
+            bits++;
+        }
+        per = 64 / bits;
+        n = (4096 + per - 1) / per;
+
+        _byte(section, "Y", (char) y);
+        states = _compound(section, "block_states");
+        palette = _list(states, "palette", MCNBT_TAG_COMPOUND);
+        for (int i = 0; i < size; i++) {
+            nbt_node_t *entry = _compound(palette, NULL);
+            _string(entry, "Name", _blocks[i]);
+            if (i % 5 == 4) {
+                nbt_node_t *props = _compound(entry, "Properties");
+                _string(props, "axis", "y");
+                _string(props, "waterlogged", "false");
+            }
+        }
+        for (size_t i = 0; i < n; i++) {
+            longs[i] = (long) _rand();
+        }
+        _add(states, nbt_node_initialize_len(MCNBT_TAG_LONG_ARRAY, "data", longs, n * sizeof(long)));
+
+        biomes = _compound(section, "biomes");
+        palette = _list(biomes, "palette", MCNBT_TAG_STRING);
+        _string(palette, NULL, "minecraft:plains");
+        _string(palette, NULL, "minecraft:forest");
+        for (size_t i = 0; i < 4; i++) {
+            longs[i] = (long) _rand();
+        }
+        _add(biomes, nbt_node_initialize_len(MCNBT_TAG_LONG_ARRAY, "data", longs, 4 * sizeof(long)));
+
+        for (size_t i = 0; i < sizeof(light); i++) {
+            light[i] = (char) _rand();
+        }
+        _add(section, nbt_node_initialize_len(MCNBT_TAG_BYTE_ARRAY, "BlockLight", light, sizeof(light)));
+        _add(section, nbt_node_initialize_len(MCNBT_TAG_BYTE_ARRAY, "SkyLight", light, sizeof(light)));
+    }
+
+    heightmaps = _compound(root, "Heightmaps");
+    for (int i = 0; i < 4; i++) {
+        static const char *const names[] = {"MOTION_BLOCKING", "MOTION_BLOCKING_NO_LEAVES", "OCEAN_FLOOR",
+                                            "WORLD_SURFACE"};
+        for (size_t j = 0; j < 37; j++) {
+            longs[j] = (long) _rand();
+        }
+        _add(heightmaps, nbt_node_initialize_len(MCNBT_TAG_LONG_ARRAY, names[i], longs, 37 * sizeof(long)));
+    }
+
+    entities = _list(root, "block_entities", MCNBT_TAG_COMPOUND);
+    for (int i = 0; i < CHUNK_BLOCK_ENTITIES; i++) {
+        nbt_node_t *be = _compound(entities, NULL);
+        nbt_node_t *items;
+        _string(be, "id", "minecraft:chest");
+        _int(be, "x", 192 + _rand_int(16));
+        _int(be, "y", -64 + _rand_int(384));
+        _int(be, "z", -112 + _rand_int(16));
+        _byte(be, "keepPacked", 0);
+        items = _list(be, "Items", MCNBT_TAG_COMPOUND);
+        for (int j = _rand_int(8); j > 0; j--) {
+            _item(items, _blocks[_rand_int((int) COUNT(_blocks))], 1 + _rand_int(64), _rand_int(27));
+        }
+    }
+
+    _list(root, "fluid_ticks", MCNBT_TAG_END);
+    _list(root, "block_ticks", MCNBT_TAG_END);
+    return root;
+}
+
+/* an entity file: thousands of small compounds with the same shape */
+static nbt_node_t *_gen_entities(void) {
+    nbt_node_t *root = _compound(NULL, "");
+    nbt_node_t *list;
+
+    _int(root, "DataVersion", 3465);
+    _add(root, nbt_node_initialize_len(MCNBT_TAG_INT_ARRAY, "Position", (int[]) {12, -7}, 2 * sizeof(int)));
+
+    list = _list(root, "Entities", MCNBT_TAG_COMPOUND);
+    for (int i = 0; i < ENTITY_COUNT; i++) {
+        nbt_node_t *e = _compound(list, NULL);
+        nbt_node_t *attrs, *armor, *tags;
+
+        _string(e, "id", _entities[_rand_int((int) COUNT(_entities))]);
+        _doubles(e, "Pos", 192.0 + _rand_double(16.0), -64.0 + _rand_double(384.0), -112.0 + _rand_double(16.0));
+        _doubles(e, "Motion", 0.0, -0.0784, 0.0);
+        _floats(e, "Rotation", (float) _rand_double(360.0), 0.0f);
+        _uuid(e);
+        _float(e, "Health", (float) (1 + _rand_int(20)));
+        _float(e, "FallDistance", 0.0f);
+        _short(e, "Air", 300);
+        _short(e, "Fire", -1);
+        _short(e, "HurtTime", 0);
+        _int(e, "HurtByTimestamp", 0);
+        _short(e, "DeathTime", 0);
+        _byte(e, "OnGround", 1);
+        _byte(e, "Invulnerable", 0);
+        _byte(e, "PersistenceRequired", 0);
+        _byte(e, "CanPickUpLoot", (char) _rand_int(2));
+        _byte(e, "LeftHanded", 0);
+        _int(e, "PortalCooldown", 0);
+
+        attrs = _list(e, "Attributes", MCNBT_TAG_COMPOUND);
+        for (int j = 0; j < 3; j++) {
+            static const char *const names[] = {"minecraft:generic.max_health", "minecraft:generic.movement_speed",
+                                                "minecraft:generic.follow_range"};
+            nbt_node_t *a = _compound(attrs, NULL);
+            _string(a, "Name", names[j]);
+            _double(a, "Base", _rand_double(32.0));
+        }
+
+        armor = _list(e, "ArmorItems", MCNBT_TAG_COMPOUND);
+        for (int j = 0; j < 4; j++) {
+            _compound(armor, NULL);
+        }
+
+        tags = _list(e, "Tags", MCNBT_TAG_STRING);
+        if (_rand_int(4) == 0) {
+            _string(tags, NULL, "spawned_by_bench");
+        }
+    }
+
+    return root;
+}
+
+/* chains of compounds nested close to the parser's depth limit */
+static nbt_node_t *_gen_deep(void) {
+    nbt_node_t *root = _compound(NULL, "");
+    nbt_node_t *list = _list(root, "chains", MCNBT_TAG_COMPOUND);
+
+    for (int i = 0; i < DEEP_CHAINS; i++) {
+        nbt_node_t *node = _compound(list, NULL);
+        for (int d = 0; d < DEEP_DEPTH; d++) {
+            _int(node, "depth", d);
+            node = _compound(node, "next");
+        }
+        _string(node, "leaf", "bottom");
+    }
+
+    return root;
+}
+
+/* long strings at the format's 65535 byte limit, as written by books and command blocks */
+static nbt_node_t *_gen_strings(void) {
+    nbt_node_t *root = _compound(NULL, "");
+    nbt_node_t *list = _list(root, "pages", MCNBT_TAG_STRING);
+    char *buf = malloc(65536);
+    char name[32];
+
+    if (buf == NULL) {
+        return root;
+    }
+
+    for (int i = 0; i < STRING_COUNT; i++) {
+        size_t len = 32768 + (size_t) _rand_int(32768);
+        for (size_t j = 0; j < len; j++) {
+            buf[j] = (char) (' ' + _rand_int(95));
+        }
+        buf[len] = '\0';
+
+        if (i % 2 == 0) {
+            _string(list, NULL, buf);
+        } else {
+            snprintf(name, sizeof(name), "text%d", i);
+            _string(root, name, buf);
+        }
+    }
+
+    free(buf);
+    return root;
+}
+
+static const struct {
+    const char *name;
+    nbt_node_t *(*build)(void);
+} _corpora[] = {
+    {"level", _gen_level},
+    {"chunk", _gen_chunk},
+    {"entities", _gen_entities},
+    {"deep", _gen_deep},
+    {"strings", _gen_strings},
+};
+
+size_t bench_corpus_count(void) {
+    return COUNT(_corpora);
+}
+
+const char *bench_corpus_name(size_t i) {
+    return i < COUNT(_corpora) ? _corpora[i].name : NULL;
+}
+
+nbt_node_t *bench_corpus_build(size_t i) {
+    if (i >= COUNT(_corpora)) {
+        return NULL;
+    }
+
+    _seed = 0x9e3779b97f4a7c15ULL ^ (uint64_t) i;
+    return _corpora[i].build();
+}
@@ -0,0 +1,226 @@
+/*
+ *  arena.c
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "mcnbt.h"
+#include "arena.h"
+#include "util.h"
+
+#define HUGEPAGE_SIZE 2097152
+
+struct _nbt_arena_block_t {
+    struct _nbt_arena_block_t *next;
+    size_t size;
+    size_t used;
+
+    /* non-zero when the block was obtained with mmap */
+    size_t mapped;
+};
+
+#define BLOCK_HEADER ((sizeof(struct _nbt_arena_block_t) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+#define BLOCK_DATA(b) ((char *) (b) + BLOCK_HEADER)
+
+struct _nbt_arena_t {
+    struct _nbt_arena_block_t *first;
+    struct _nbt_arena_block_t *current;
+    size_t block_size;
+    int flags;
+
+    /* malloc is NULL while blocks come from the process-wide allocator;
+     * MCNBT_ARENA_HUGEPAGES blocks are mapped regardless */
+    nbt_allocator_t allocator;
+};
+
+#define BLOCK_ALLOCATOR(a) ((a)->allocator.malloc != NULL ? &(a)->allocator : NULL)
+
+static struct _nbt_arena_block_t *_block_new(nbt_arena_t *arena, size_t min_size) {
+    struct _nbt_arena_block_t *ret = NULL;
+    size_t size = arena->block_size;
+
+    if (size < min_size) {
+        size = min_size;
+    }
+    size += BLOCK_HEADER;
+
+#ifdef MAP_ANONYMOUS
+    if (arena->flags & MCNBT_ARENA_HUGEPAGES) {
+        void *p = MAP_FAILED;
+        size = (size + HUGEPAGE_SIZE - 1) & ~((size_t) HUGEPAGE_SIZE - 1);
+
+#ifdef MAP_HUGETLB
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (p == MAP_FAILED) {
+            p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+            if (p != MAP_FAILED) {
+                madvise(p, size, MADV_HUGEPAGE);
+            }
+#endif
+        }
+
+        if (p != MAP_FAILED) {
+            ret = p;
+            ret->mapped = size;
+        }
+    }
+#endif
+
+    if (ret == NULL) {
+        ret = _nbt_malloc(BLOCK_ALLOCATOR(arena), size);
+        ASSERT(ret != NULL, _mcnbt_alloc_fail(size); return NULL);
+        ret->mapped = 0;
+    }
+
+    ret->next = NULL;
+    ret->size = size - BLOCK_HEADER;
+    ret->used = 0;
+    return ret;
+}
+
+static void _block_free(nbt_arena_t *arena, struct _nbt_arena_block_t *block) {
+#ifdef MAP_ANONYMOUS
+    if (block->mapped) {
+        munmap(block, block->mapped);
+        return;
+    }
+#endif
+    _nbt_free(BLOCK_ALLOCATOR(arena), block);
+}
+
+nbt_arena_t *nbt_arena_new(size_t block_size, int flags) {
+    nbt_arena_t *ret;
+    MALLOC(ret, sizeof(nbt_arena_t), return NULL);
+
+    ret->first = NULL;
+    ret->current = NULL;
+    ret->block_size = block_size ? block_size : ARENA_DEFAULT_BLOCK;
+    ret->flags = flags;
+    memset(&ret->allocator, 0, sizeof(ret->allocator));
+    return ret;
+}
+
+int nbt_arena_set_allocator(nbt_arena_t *arena, const nbt_allocator_t *allocator) {
+    ASSERT(arena != NULL, return -1);
+
+    /* blocks already taken have to go back where they came from */
+    ASSERT(arena->first == NULL, return -1);
+
+    if (allocator == NULL) {
+        memset(&arena->allocator, 0, sizeof(arena->allocator));
+        return 0;
+    }
+
+    ASSERT(allocator->malloc != NULL && allocator->realloc != NULL && allocator->free != NULL, return -1);
+    arena->allocator = *allocator;
+    return 0;
+}
+
+void nbt_arena_reset(nbt_arena_t *arena) {
+    ASSERT(arena != NULL, return);
+
+    for (struct _nbt_arena_block_t *b = arena->first; b; b = b->next) {
+        b->used = 0;
+    }
+    arena->current = arena->first;
+}
+
+void nbt_arena_free(nbt_arena_t *arena) {
+    struct _nbt_arena_block_t *b;
+    ASSERT(arena != NULL, return);
+
+    b = arena->first;
+    while (b != NULL) {
+        struct _nbt_arena_block_t *tmp = b->next;
+        _block_free(arena, b);
+        b = tmp;
+    }
+    FREE(arena);
+}
+
+/** Moves to a block with at least size bytes free
+ * @param arena Arena to advance
+ * @param size Bytes needed, already aligned
+ * @return The new current block, or NULL on failure
+ */
+static struct _nbt_arena_block_t *_advance(nbt_arena_t *arena, size_t size) {
+    struct _nbt_arena_block_t *b = arena->current;
+
+    /* blocks kept across a reset are reused before allocating new ones */
+    if (b != NULL && b->next != NULL && b->next->size >= size) {
+        b = b->next;
+    } else {
+        struct _nbt_arena_block_t *n = _block_new(arena, size);
+        ASSERT(n != NULL, return NULL);
+
+        if (b == NULL) {
+            n->next = arena->first;
+            arena->first = n;
+        } else {
+            n->next = b->next;
+            b->next = n;
+        }
+        b = n;
+    }
+
+    arena->current = b;
+    return b;
+}
+
+void *_nbt_arena_alloc(nbt_arena_t *arena, size_t size) {
+    struct _nbt_arena_block_t *b = arena->current;
+    void *ret;
+
+    size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+
+    if (b == NULL || b->used + size > b->size) {
+        b = _advance(arena, size);
+        ASSERT(b != NULL, return NULL);
+    }
+
+    ret = BLOCK_DATA(b) + b->used;
+    b->used += size;
+    return ret;
+}
+
+/** Makes sure the next size bytes of allocations come from a single block
+ * @param arena Arena to prepare
+ * @param size Total size of the allocations, including alignment
+ * @return 0 on success, -1 on failure
+ */
+int _nbt_arena_reserve(nbt_arena_t *arena, size_t size) {
+    struct _nbt_arena_block_t *b = arena->current;
+
+    size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    if (b != NULL && b->used + size <= b->size) {
+        return 0;
+    }
+    return _advance(arena, size) != NULL ? 0 : -1;
+}
+
+char *_nbt_arena_strndup(nbt_arena_t *arena, const char *s, size_t len) {
+    char *ret = _nbt_arena_alloc(arena, len + 1);
+    ASSERT(ret != NULL, return NULL);
+
+    memcpy(ret, s, len);
+    ret[len] = '\0';
+    return ret;
+}
@@ -0,0 +1,31 @@
+/*
+ *  arena.h
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBMCNBT_ARENA_H
+#define LIBMCNBT_ARENA_H
+
+#include "mcnbt.h"
+
+#define ARENA_DEFAULT_BLOCK 65536
+#define ARENA_ALIGN 16
+
+void *_nbt_arena_alloc(nbt_arena_t *arena, size_t size);
+char *_nbt_arena_strndup(nbt_arena_t *arena, const char *s, size_t len);
+int _nbt_arena_reserve(nbt_arena_t *arena, size_t size);
+
+#endif //LIBMCNBT_ARENA_H
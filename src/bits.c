@@ -0,0 +1,235 @@
+/*
+ *  bits.c
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "mcnbt.h"
+#include "util.h"
+
+#define MAX_BITS 16
+
+#if defined(__GNUC__) || defined(__clang__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/* expands X once per supported width so each copy sees a constant */
+#define EACH_WIDTH(X) \
+    X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15) X(16)
+
+/** Unpacks entries that never cross a long; the top bits of each long are unused
+ * @param src Packed longs
+ * @param dst Entries
+ * @param count Number of entries
+ * @param bits Bits per entry
+ */
+static ALWAYS_INLINE void _unpack_padded(const long *src, unsigned short *dst, size_t count, unsigned int bits) {
+    const unsigned int per = 64 / bits;
+    const uint64_t mask = ((uint64_t) 1 << bits) - 1;
+    size_t full = count / per;
+    uint64_t v;
+
+    for (size_t k = 0; k < full; k++) {
+        v = (uint64_t) src[k];
+        for (unsigned int j = 0; j < per; j++) {
+            dst[k * per + j] = (unsigned short) ((v >> (j * bits)) & mask);
+        }
+    }
+
+    v = full * per < count ? (uint64_t) src[full] : 0;
+    for (size_t i = full * per; i < count; i++) {
+        dst[i] = (unsigned short) (v & mask);
+        v >>= bits;
+    }
+}
+
+/** Unpacks entries stored back to back, where an entry may cross into the next long
+ * @param src Packed longs
+ * @param dst Entries
+ * @param count Number of entries
+ * @param bits Bits per entry
+ */
+static ALWAYS_INLINE void _unpack_spanning(const long *src, unsigned short *dst, size_t count, unsigned int bits) {
+    const uint64_t mask = ((uint64_t) 1 << bits) - 1;
+    uint64_t acc = 0, w;
+    unsigned int avail = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (avail >= bits) {
+            dst[i] = (unsigned short) (acc & mask);
+            acc >>= bits;
+            avail -= bits;
+        } else {
+            w = (uint64_t) *src++;
+            dst[i] = (unsigned short) ((acc | (w << avail)) & mask);
+            acc = w >> (bits - avail);
+            avail += 64 - bits;
+        }
+    }
+}
+
+static ALWAYS_INLINE void _pack_padded(const unsigned short *src, long *dst, size_t count, unsigned int bits) {
+    const unsigned int per = 64 / bits;
+    const uint64_t mask = ((uint64_t) 1 << bits) - 1;
+    size_t full = count / per;
+    uint64_t v;
+
+    for (size_t k = 0; k < full; k++) {
+        v = 0;
+        for (unsigned int j = 0; j < per; j++) {
+            v |= (src[k * per + j] & mask) << (j * bits);
+        }
+        dst[k] = (long) v;
+    }
+
+    if (full * per < count) {
+        v = 0;
+        for (size_t i = full * per; i < count; i++) {
+            v |= (src[i] & mask) << ((i - full * per) * bits);
+        }
+        dst[full] = (long) v;
+    }
+}
+
+static ALWAYS_INLINE void _pack_spanning(const unsigned short *src, long *dst, size_t count, unsigned int bits) {
+    const uint64_t mask = ((uint64_t) 1 << bits) - 1;
+    uint64_t acc = 0, v;
+    unsigned int fill = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        v = src[i] & mask;
+        acc |= v << fill;
+        fill += bits;
+        if (fill >= 64) {
+            *dst++ = (long) acc;
+            fill -= 64;
+            acc = v >> (bits - fill);
+        }
+    }
+
+    if (fill > 0) {
+        *dst = (long) acc;
+    }
+}
+
+size_t nbt_bits_packed_len(size_t count, unsigned int bits, int flags) {
+    ASSERT(bits >= 1 && bits <= MAX_BITS, return 0);
+
+    if (flags & MCNBT_BITS_PADDED) {
+        return (count + 64 / bits - 1) / (64 / bits);
+    }
+    return (count / 64) * bits + ((count % 64) * bits + 63) / 64;
+}
+
+int nbt_unpack_bits(const long *src, size_t src_len, unsigned short *dst, size_t count, unsigned int bits, int flags) {
+    ASSERT(bits >= 1 && bits <= MAX_BITS, return -1);
+    ASSERT(src_len >= nbt_bits_packed_len(count, bits, flags), return -1);
+    ASSERT(count == 0 || (src != NULL && dst != NULL), return -1);
+
+#define UNPACK(n) \
+    case n: \
+        if (flags & MCNBT_BITS_PADDED) { \
+            _unpack_padded(src, dst, count, n); \
+        } else { \
+            _unpack_spanning(src, dst, count, n); \
+        } \
+        break;
+
+    switch (bits) {
+        EACH_WIDTH(UNPACK)
+        default:
+            return -1;
+    }
+#undef UNPACK
+    return 0;
+}
+
+int nbt_pack_bits(const unsigned short *src, size_t count, long *dst, size_t dst_len, unsigned int bits, int flags) {
+    ASSERT(bits >= 1 && bits <= MAX_BITS, return -1);
+    ASSERT(dst_len >= nbt_bits_packed_len(count, bits, flags), return -1);
+    ASSERT(count == 0 || (src != NULL && dst != NULL), return -1);
+
+#define PACK(n) \
+    case n: \
+        if (flags & MCNBT_BITS_PADDED) { \
+            _pack_padded(src, dst, count, n); \
+        } else { \
+            _pack_spanning(src, dst, count, n); \
+        } \
+        break;
+
+    switch (bits) {
+        EACH_WIDTH(PACK)
+        default:
+            return -1;
+    }
+#undef PACK
+    return 0;
+}
+
+void nbt_unpack_nibbles(const void *src, unsigned char *dst, size_t count) {
+    const unsigned char *s = src;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i low = _mm_set1_epi8(0x0f);
+
+    for (; i + 32 <= count; i += 32) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + i / 2));
+        __m128i lo = _mm_and_si128(v, low);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), low);
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_unpacklo_epi8(lo, hi));
+        _mm_storeu_si128((__m128i *) (dst + i + 16), _mm_unpackhi_epi8(lo, hi));
+    }
+#endif
+
+    /* even entries sit in the low nibble */
+    for (; i < count; i++) {
+        dst[i] = (unsigned char) ((s[i / 2] >> ((i & 1) * 4)) & 0x0f);
+    }
+}
+
+void nbt_pack_nibbles(const unsigned char *src, void *dst, size_t count) {
+    unsigned char *d = dst;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i low = _mm_set1_epi16(0x000f);
+    const __m128i high = _mm_set1_epi16(0x00f0);
+
+    for (; i + 32 <= count; i += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (src + i + 16));
+        a = _mm_or_si128(_mm_and_si128(a, low), _mm_and_si128(_mm_srli_epi16(a, 4), high));
+        b = _mm_or_si128(_mm_and_si128(b, low), _mm_and_si128(_mm_srli_epi16(b, 4), high));
+        _mm_storeu_si128((__m128i *) (d + i / 2), _mm_packus_epi16(a, b));
+    }
+#endif
+
+    for (; i + 1 < count; i += 2) {
+        d[i / 2] = (unsigned char) ((src[i] & 0x0f) | (src[i + 1] << 4));
+    }
+    if (i < count) {
+        d[i / 2] = (unsigned char) (src[i] & 0x0f);
+    }
+}
@@ -0,0 +1,174 @@
+/*
+ *  dedup.c
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mcnbt.h"
+#include "tree.h"
+#include "util.h"
+
+/* smaller payloads cost more in a block header than they save */
+#define DEDUP_MIN_SIZE 16
+#define DEDUP_MIN_CAP 64
+
+struct _nbt_dedup_slot_t {
+    uint64_t hash;
+    _nbt_shared_t *block;
+};
+
+/* every payload seen so far, by content; open addressing with linear probing, cap is a power of two */
+struct _nbt_dedup_t {
+    size_t cap;
+    size_t count;
+    struct _nbt_dedup_slot_t *slots;
+};
+
+/** Finds the slot holding a payload, or the empty slot where it belongs
+ * @param dedup Table to search
+ * @param hash Hash of the payload
+ * @param data Payload
+ * @param size Size of the payload in bytes
+ * @param key Size of a block holding the payload, one more than size for strings
+ * @return The slot
+ */
+static struct _nbt_dedup_slot_t *_probe(nbt_dedup_t *dedup, uint64_t hash, const void *data, size_t size,
+                                        size_t key) {
+    size_t mask = dedup->cap - 1;
+    struct _nbt_dedup_slot_t *slot;
+
+    for (size_t i = (size_t) hash & mask;; i = (i + 1) & mask) {
+        slot = &dedup->slots[i];
+        if (slot->block == NULL) {
+            return slot;
+        }
+
+        if (slot->hash == hash && slot->block->size == key && memcmp(slot->block->data, data, size) == 0 &&
+            (key == size || slot->block->data[size] == '\0')) {
+            return slot;
+        }
+    }
+}
+
+static int _grow(nbt_dedup_t *dedup) {
+    struct _nbt_dedup_slot_t *old = dedup->slots;
+    size_t old_cap = dedup->cap;
+    size_t mask;
+
+    dedup->cap = old_cap ? old_cap * 2 : DEDUP_MIN_CAP;
+    CALLOC(dedup->slots, dedup->cap, sizeof(struct _nbt_dedup_slot_t),
+           dedup->slots = old; dedup->cap = old_cap; return -1);
+
+    /* blocks in the table are all different, so a rehash needs no comparisons */
+    mask = dedup->cap - 1;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].block != NULL) {
+            size_t j = (size_t) old[i].hash & mask;
+            while (dedup->slots[j].block != NULL) {
+                j = (j + 1) & mask;
+            }
+            dedup->slots[j] = old[i];
+        }
+    }
+
+    FREE(old);
+    return 0;
+}
+
+/** Shares the payload of a node with an equal one seen before, or remembers it
+ * @param dedup Table of payloads seen so far
+ * @param node Node with a payload buffer
+ * @param data The payload
+ * @param size Size of the payload in bytes
+ * @return The number of bytes freed
+ */
+static size_t _dedup_payload(nbt_dedup_t *dedup, nbt_node_t *node, const void *data, size_t size) {
+    size_t key = size + (nbt_node_get_type(node) == MCNBT_TAG_STRING);
+    struct _nbt_dedup_slot_t *slot;
+    _nbt_shared_t *block;
+    uint64_t hash;
+
+    if (size < DEDUP_MIN_SIZE || _nbt_node_get_arena(node) != NULL) {
+        return 0;
+    }
+
+    if ((dedup->count + 1) * 4 > dedup->cap * 3) {
+        ASSERT(_grow(dedup) == 0, return 0);
+    }
+
+    hash = _nbt_hash_payload(data, size);
+    slot = _probe(dedup, hash, data, size, key);
+    if (slot->block != NULL) {
+        return _nbt_node_adopt_data(node, slot->block);
+    }
+
+    block = _nbt_node_share_data(node);
+    if (block == NULL) {
+        return 0;
+    }
+
+    /* the table keeps its own reference so that the payload outlives the node */
+    REF_INC(block->refs);
+    slot->hash = hash;
+    slot->block = block;
+    dedup->count++;
+    return 0;
+}
+
+static size_t _dedup(nbt_dedup_t *dedup, nbt_node_t *node) {
+    const void *data;
+    size_t size, saved = 0;
+
+    if ((data = _nbt_node_get_payload(node, &size)) != NULL) {
+        return _dedup_payload(dedup, node, data, size);
+    }
+
+    if (nbt_node_get_type(node) == MCNBT_TAG_COMPOUND || nbt_node_get_type(node) == MCNBT_TAG_LIST) {
+        for (nbt_node_t *c = nbt_node_get_first_child(node); c != NULL; c = nbt_node_get_next_child(c)) {
+            saved += _dedup(dedup, c);
+        }
+    }
+    return saved;
+}
+
+nbt_dedup_t *nbt_dedup_new(void) {
+    nbt_dedup_t *ret;
+    CALLOC(ret, 1, sizeof(nbt_dedup_t), return NULL);
+    return ret;
+}
+
+size_t nbt_dedup_tree(nbt_dedup_t *dedup, nbt_node_t *tree) {
+    ASSERT(dedup != NULL, return 0);
+    ASSERT(tree != NULL, return 0);
+    return _dedup(dedup, tree);
+}
+
+void nbt_dedup_free(nbt_dedup_t *dedup) {
+    ASSERT(dedup != NULL, return);
+
+    /* nodes keep their payloads; only the table's references go */
+    for (size_t i = 0; i < dedup->cap; i++) {
+        if (dedup->slots[i].block != NULL) {
+            _nbt_shared_unref(dedup->slots[i].block);
+        }
+    }
+
+    FREE(dedup->slots);
+    FREE(dedup);
+}
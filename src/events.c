@@ -0,0 +1,203 @@
+/*
+ *  events.c
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "mcnbt.h"
+#include "scan.h"
+#include "swap.h"
+#include "util.h"
+
+typedef struct _nbt_events_t {
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+    const nbt_event_callbacks_t *cb;
+    void *userdata;
+} _nbt_events_t;
+
+#define CALL(e, fn, ...) ((e)->cb->fn != NULL ? (e)->cb->fn((e)->userdata, __VA_ARGS__) : MCNBT_EVENT_CONTINUE)
+#define CALL0(e, fn) ((e)->cb->fn != NULL ? (e)->cb->fn((e)->userdata) : MCNBT_EVENT_CONTINUE)
+
+static int _emit_payload(_nbt_events_t *e, nbt_tag_type_t type, const char *name, size_t name_len, int depth);
+
+static int _emit_compound(_nbt_events_t *e, int depth) {
+    nbt_tag_type_t type;
+    size_t name_len;
+    const char *name;
+    int r;
+
+    for (;;) {
+        ASSERT(e->size - e->pos >= 1, return -1);
+        type = (nbt_tag_type_t) e->data[e->pos++];
+        if (type == MCNBT_TAG_END) {
+            return CALL0(e, end_compound) == MCNBT_EVENT_STOP ? MCNBT_EVENT_STOP : 0;
+        }
+
+        ASSERT(e->size - e->pos >= 2, return -1);
+        name_len = _nbt_be16(e->data + e->pos);
+        ASSERT(e->size - e->pos - 2 >= name_len, return -1);
+        name = (const char *) e->data + e->pos + 2;
+        e->pos += 2 + name_len;
+
+        if ((r = _emit_payload(e, type, name, name_len, depth + 1)) != 0) {
+            return r;
+        }
+    }
+}
+
+static int _emit_list(_nbt_events_t *e, nbt_tag_type_t type, uint32_t count, int depth) {
+    int r;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if ((r = _emit_payload(e, type, NULL, 0, depth + 1)) != 0) {
+            return r;
+        }
+    }
+
+    return CALL0(e, end_list) == MCNBT_EVENT_STOP ? MCNBT_EVENT_STOP : 0;
+}
+
+static int _emit_payload(_nbt_events_t *e, nbt_tag_type_t type, const char *name, size_t name_len, int depth) {
+    const unsigned char *b = e->data + e->pos;
+    size_t avail = e->size - e->pos;
+    uint32_t len;
+    int r;
+    union {
+        uint32_t u32;
+        uint64_t u64;
+        float f;
+        double d;
+    } v;
+
+    ASSERT(depth < MAX_DEPTH, return -1);
+
+    switch (type) {
+        case MCNBT_TAG_BYTE:
+            ASSERT(avail >= 1, return -1);
+            e->pos += 1;
+            r = CALL(e, byte_value, name, name_len, (char) b[0]);
+            break;
+        case MCNBT_TAG_SHORT:
+            ASSERT(avail >= 2, return -1);
+            e->pos += 2;
+            r = CALL(e, short_value, name, name_len, (short) _nbt_be16(b));
+            break;
+        case MCNBT_TAG_INT:
+            ASSERT(avail >= 4, return -1);
+            e->pos += 4;
+            r = CALL(e, int_value, name, name_len, (int) _nbt_be32(b));
+            break;
+        case MCNBT_TAG_LONG:
+            ASSERT(avail >= 8, return -1);
+            e->pos += 8;
+            r = CALL(e, long_value, name, name_len, (long) _nbt_be64(b));
+            break;
+        case MCNBT_TAG_FLOAT:
+            ASSERT(avail >= 4, return -1);
+            e->pos += 4;
+            v.u32 = _nbt_be32(b);
+            r = CALL(e, float_value, name, name_len, v.f);
+            break;
+        case MCNBT_TAG_DOUBLE:
+            ASSERT(avail >= 8, return -1);
+            e->pos += 8;
+            v.u64 = _nbt_be64(b);
+            r = CALL(e, double_value, name, name_len, v.d);
+            break;
+        case MCNBT_TAG_STRING:
+            ASSERT(avail >= 2, return -1);
+            len = _nbt_be16(b);
+            ASSERT(avail - 2 >= len, return -1);
+            e->pos += 2 + (size_t) len;
+            r = CALL(e, string_value, name, name_len, (const char *) b + 2, (size_t) len);
+            break;
+        case MCNBT_TAG_BYTE_ARRAY:
+        case MCNBT_TAG_INT_ARRAY:
+        case MCNBT_TAG_LONG_ARRAY:
+            ASSERT(_nbt_skip_payload(e->data, e->size, &e->pos, type, depth) == 0, return -1);
+            len = _nbt_be32(b);
+            if (type == MCNBT_TAG_BYTE_ARRAY) {
+                r = CALL(e, byte_array, name, name_len, (const char *) b + 4, (size_t) len);
+            } else if (type == MCNBT_TAG_INT_ARRAY) {
+                r = CALL(e, int_array, name, name_len, b + 4, (size_t) len);
+            } else {
+                r = CALL(e, long_array, name, name_len, b + 4, (size_t) len);
+            }
+            break;
+        case MCNBT_TAG_LIST:
+            ASSERT(avail >= 5, return -1);
+            len = _nbt_be32(b + 1);
+            r = CALL(e, begin_list, name, name_len, (nbt_tag_type_t) b[0], (size_t) len);
+            if (r == MCNBT_EVENT_SKIP) {
+                ASSERT(_nbt_skip_payload(e->data, e->size, &e->pos, type, depth) == 0, return -1);
+                return 0;
+            } else if (r == MCNBT_EVENT_STOP) {
+                return MCNBT_EVENT_STOP;
+            }
+
+            e->pos += 5;
+            return _emit_list(e, (nbt_tag_type_t) b[0], len, depth);
+        case MCNBT_TAG_COMPOUND:
+            r = CALL(e, begin_compound, name, name_len);
+            if (r == MCNBT_EVENT_SKIP) {
+                ASSERT(_nbt_skip_payload(e->data, e->size, &e->pos, type, depth) == 0, return -1);
+                return 0;
+            } else if (r == MCNBT_EVENT_STOP) {
+                return MCNBT_EVENT_STOP;
+            }
+
+            return _emit_compound(e, depth);
+        default:
+            return -1;
+    }
+
+    return r == MCNBT_EVENT_STOP ? MCNBT_EVENT_STOP : 0;
+}
+
+int nbt_parse_events(void *data, size_t size, const nbt_event_callbacks_t *callbacks, void *userdata) {
+    _nbt_events_t e;
+    nbt_tag_type_t type;
+    size_t name_len;
+
+    ASSERT(data != NULL, return -1);
+    ASSERT(callbacks != NULL, return -1);
+
+    e.data = data;
+    e.size = size;
+    e.pos = 0;
+    e.cb = callbacks;
+    e.userdata = userdata;
+
+    ASSERT(size >= 3, return -1);
+    type = (nbt_tag_type_t) e.data[0];
+    ASSERT(type != MCNBT_TAG_END, return -1);
+    name_len = _nbt_be16(e.data + 1);
+    ASSERT(size - 3 >= name_len, return -1);
+    e.pos = 3 + name_len;
+
+    return _emit_payload(&e, type, (const char *) e.data + 3, name_len, 0);
+}
+
+void nbt_decode_int_array(const void *src, int *dst, size_t count) {
+    _nbt_swap32(dst, src, count);
+}
+
+void nbt_decode_long_array(const void *src, long *dst, size_t count) {
+    _nbt_swap64(dst, src, count);
+}
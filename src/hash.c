@@ -0,0 +1,336 @@
+/*
+ *  hash.c
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mcnbt.h"
+#include "tree.h"
+#include "util.h"
+
+#define HASH_SEED 0x6a09e667f3bcc909ULL
+
+static inline uint64_t _rotl(uint64_t v, int n) {
+    return (v << n) | (v >> (64 - n));
+}
+
+/* one round of the MurmurHash3 body */
+static inline uint64_t _mix(uint64_t h, uint64_t v) {
+    v *= 0x87c37b91114253d5ULL;
+    v = _rotl(v, 31);
+    v *= 0x4cf5ad432745937fULL;
+    h ^= v;
+    return _rotl(h, 27) * 5 + 0x52dce729;
+}
+
+static inline uint64_t _finish(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+static uint64_t _mix_bytes(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t v;
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&v, p + i, 8);
+        h = _mix(h, v);
+    }
+
+    if (i < len) {
+        v = 0;
+        memcpy(&v, p + i, len - i);
+        h = _mix(h, v);
+    }
+    return _mix(h, len);
+}
+
+/** Widens a number so that equal values hash alike wherever they are stored
+ * @param data Number in host order
+ * @param type Type of the number
+ * @return The number's bits
+ */
+static uint64_t _number_bits(const void *data, nbt_tag_type_t type) {
+    union {
+        char b;
+        short s;
+        int i;
+        long l;
+        uint32_t u32;
+        uint64_t u64;
+    } v;
+
+    memcpy(&v, data, _nbt_fixed_size(type));
+    switch (type) {
+        case MCNBT_TAG_BYTE:
+            return (uint64_t) (int64_t) v.b;
+        case MCNBT_TAG_SHORT:
+            return (uint64_t) (int64_t) v.s;
+        case MCNBT_TAG_INT:
+            return (uint64_t) (int64_t) v.i;
+        case MCNBT_TAG_FLOAT:
+            return v.u32;
+        default:
+            return v.u64;
+    }
+}
+
+static uint64_t _node_bits(nbt_node_t *node) {
+    union {
+        char b;
+        short s;
+        int i;
+        long l;
+        float f;
+        double d;
+    } v;
+
+    switch (nbt_node_get_type(node)) {
+        case MCNBT_TAG_BYTE:
+            v.b = nbt_node_get_data_byte(node);
+            break;
+        case MCNBT_TAG_SHORT:
+            v.s = nbt_node_get_data_short(node);
+            break;
+        case MCNBT_TAG_INT:
+            v.i = nbt_node_get_data_int(node);
+            break;
+        case MCNBT_TAG_LONG:
+            v.l = nbt_node_get_data_long(node);
+            break;
+        case MCNBT_TAG_FLOAT:
+            v.f = nbt_node_get_data_float(node);
+            break;
+        case MCNBT_TAG_DOUBLE:
+            v.d = nbt_node_get_data_double(node);
+            break;
+        default:
+            return 0;
+    }
+    return _number_bits(&v, nbt_node_get_type(node));
+}
+
+/** Hashes a subtree, including the name of its root
+ * @param node Root of the subtree
+ * @return A hash that is equal for equal trees, whatever the order of compound children
+ */
+static uint64_t _hash(nbt_node_t *node) {
+    nbt_tag_type_t type = nbt_node_get_type(node);
+    nbt_tag_type_t list_type;
+    const unsigned char *packed;
+    const char *str;
+    size_t len, width;
+    uint64_t h, sum;
+
+    h = _mix(HASH_SEED, type);
+    str = nbt_node_get_name_view(node, &len);
+    h = _mix_bytes(h, str, len);
+
+    switch (type) {
+        case MCNBT_TAG_BYTE:
+        case MCNBT_TAG_SHORT:
+        case MCNBT_TAG_INT:
+        case MCNBT_TAG_LONG:
+        case MCNBT_TAG_FLOAT:
+        case MCNBT_TAG_DOUBLE:
+            h = _mix(h, _node_bits(node));
+            break;
+        case MCNBT_TAG_STRING:
+        case MCNBT_TAG_BYTE_ARRAY:
+            str = nbt_node_get_data_str_view(node, &len);
+            h = _mix_bytes(h, str, len);
+            break;
+        case MCNBT_TAG_INT_ARRAY:
+            str = (const char *) nbt_node_get_data_int_array_view(node, &len);
+            h = _mix_bytes(h, str, len * sizeof(int));
+            break;
+        case MCNBT_TAG_LONG_ARRAY:
+            str = (const char *) nbt_node_get_data_long_array_view(node, &len);
+            h = _mix_bytes(h, str, len * sizeof(long));
+            break;
+        case MCNBT_TAG_LIST:
+            list_type = nbt_node_get_list_type(node);
+            h = _mix(h, list_type);
+
+            /* packed and unpacked lists of the same numbers hash alike */
+            if ((packed = _nbt_node_get_packed(node, &len)) != NULL) {
+                width = _nbt_fixed_size(list_type);
+                for (size_t i = 0; i < len; i++) {
+                    h = _mix(h, _number_bits(packed + i * width, list_type));
+                }
+                h = _mix(h, len);
+                break;
+            }
+
+            len = 0;
+            for (nbt_node_t *c = nbt_node_get_first_child(node); c; c = nbt_node_get_next_child(c), len++) {
+                h = _mix(h, _nbt_fixed_size(list_type) != 0 ? _node_bits(c) : nbt_node_hash(c));
+            }
+            h = _mix(h, len);
+            break;
+        case MCNBT_TAG_COMPOUND:
+            /* children are summed since their order carries no meaning */
+            sum = 0;
+            len = 0;
+            for (nbt_node_t *c = nbt_node_get_first_child(node); c; c = nbt_node_get_next_child(c), len++) {
+                sum += nbt_node_hash(c);
+            }
+            h = _mix(_mix(h, sum), len);
+            break;
+        default:
+            break;
+    }
+    return _finish(h);
+}
+
+uint64_t nbt_node_hash(nbt_node_t *node) {
+    uint64_t h;
+    ASSERT(node != NULL, return 0);
+
+    /* subtrees keep their hash until _touch() in tree.c drops it */
+    if (!_nbt_node_get_hash(node, &h)) {
+        h = _hash(node);
+        _nbt_node_set_hash(node, h);
+    }
+    return h;
+}
+
+/** Returns the i-th element of a list of numbers, widened like _number_bits()
+ * @param list List of numbers
+ * @param packed Its packed elements, or NULL if it has child nodes
+ * @param i Index of the element
+ * @return The element's bits
+ */
+static uint64_t _element_bits(nbt_node_t *list, const unsigned char *packed, size_t i) {
+    nbt_tag_type_t type = nbt_node_get_list_type(list);
+
+    if (packed != NULL) {
+        return _number_bits(packed + i * _nbt_fixed_size(type), type);
+    }
+    return _node_bits(nbt_node_get_child_at(list, i));
+}
+
+/** Compares two subtrees that hash alike
+ * @param a First subtree
+ * @param b Second subtree
+ * @return 1 if both are equal, 0 otherwise
+ */
+static int _equal(nbt_node_t *a, nbt_node_t *b) {
+    nbt_tag_type_t type = nbt_node_get_type(a);
+    const unsigned char *pa, *pb;
+    const char *na, *nb;
+    size_t la, lb;
+    nbt_node_t *ca, *cb;
+
+    na = nbt_node_get_name_view(a, &la);
+    nb = nbt_node_get_name_view(b, &lb);
+    if (type != nbt_node_get_type(b) || la != lb || (la != 0 && memcmp(na, nb, la) != 0)) {
+        return 0;
+    }
+
+    switch (type) {
+        case MCNBT_TAG_STRING:
+        case MCNBT_TAG_BYTE_ARRAY:
+        case MCNBT_TAG_INT_ARRAY:
+        case MCNBT_TAG_LONG_ARRAY:
+            pa = _nbt_node_get_payload(a, &la);
+            pb = _nbt_node_get_payload(b, &lb);
+            return la == lb && (la == 0 || memcmp(pa, pb, la) == 0);
+        case MCNBT_TAG_LIST:
+            la = nbt_node_get_len(a);
+            if (nbt_node_get_list_type(a) != nbt_node_get_list_type(b) || la != nbt_node_get_len(b)) {
+                return 0;
+            }
+
+            if (_nbt_fixed_size(nbt_node_get_list_type(a)) != 0) {
+                pa = _nbt_node_get_packed(a, &lb);
+                pb = _nbt_node_get_packed(b, &lb);
+                for (size_t i = 0; i < la; i++) {
+                    if (_element_bits(a, pa, i) != _element_bits(b, pb, i)) {
+                        return 0;
+                    }
+                }
+                return 1;
+            }
+
+            for (ca = nbt_node_get_first_child(a), cb = nbt_node_get_first_child(b); ca != NULL && cb != NULL;
+                 ca = nbt_node_get_next_child(ca), cb = nbt_node_get_next_child(cb)) {
+                if (!nbt_node_equal(ca, cb)) {
+                    return 0;
+                }
+            }
+            return ca == NULL && cb == NULL;
+        case MCNBT_TAG_COMPOUND:
+            if (nbt_node_get_len(a) != nbt_node_get_len(b)) {
+                return 0;
+            }
+
+            /* each name of a must be unique; as many names then leave no room for duplicates in b */
+            for (ca = nbt_node_get_first_child(a); ca != NULL; ca = nbt_node_get_next_child(ca)) {
+                na = nbt_node_get_name_view(ca, &la);
+                if (_nbt_node_find_child_len(a, na, la) != ca) {
+                    break;
+                }
+
+                cb = _nbt_node_find_child_len(b, na, la);
+                if (cb == NULL || !nbt_node_equal(ca, cb)) {
+                    return 0;
+                }
+            }
+
+            if (ca == NULL) {
+                return 1;
+            }
+
+            /* a has duplicate names, so only the same order counts as equal */
+            for (ca = nbt_node_get_first_child(a), cb = nbt_node_get_first_child(b); ca != NULL && cb != NULL;
+                 ca = nbt_node_get_next_child(ca), cb = nbt_node_get_next_child(cb)) {
+                if (!nbt_node_equal(ca, cb)) {
+                    return 0;
+                }
+            }
+            return 1;
+        default:
+            return _node_bits(a) == _node_bits(b);
+    }
+}
+
+int nbt_node_equal(nbt_node_t *a, nbt_node_t *b) {
+    ASSERT(a != NULL, return 0);
+    ASSERT(b != NULL, return 0);
+
+    if (a == b) {
+        return 1;
+    }
+
+    /* cached hashes rule out most unequal pairs without a walk */
+    return nbt_node_hash(a) == nbt_node_hash(b) && _equal(a, b);
+}
+
+/** Hashes a payload buffer for nbt_dedup_tree()
+ * @param data Payload
+ * @param len Size of the payload in bytes
+ * @return The hash of the payload
+ */
+uint64_t _nbt_hash_payload(const void *data, size_t len) {
+    return _finish(_mix_bytes(HASH_SEED, data, len));
+}
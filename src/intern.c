@@ -0,0 +1,183 @@
+/*
+ *  intern.c
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mcnbt.h"
+#include "intern.h"
+#include "util.h"
+
+/* a power of two; threads parsing at once rarely meet on the same lock */
+#define INTERN_SHARDS 64
+#define INTERN_MIN_CAP 64
+
+typedef struct _nbt_interned_t {
+    struct _nbt_interned_t *next;
+    size_t hash;
+    size_t refs;
+    size_t len;
+    char str[];
+} _nbt_interned_t;
+
+#define INTERNED(s) ((_nbt_interned_t *) ((char *) (s) - offsetof(_nbt_interned_t, str)))
+
+/* chained buckets; the low hash bits pick the shard, the rest the bucket */
+typedef struct _nbt_intern_shard_t {
+    pthread_mutex_t lock;
+    _nbt_interned_t **buckets;
+    size_t cap;
+    size_t count;
+} _nbt_intern_shard_t;
+
+static _nbt_intern_shard_t _shards[INTERN_SHARDS];
+static pthread_once_t _shards_once = PTHREAD_ONCE_INIT;
+
+static void _shards_init(void) {
+    for (size_t i = 0; i < INTERN_SHARDS; i++) {
+        pthread_mutex_init(&_shards[i].lock, NULL);
+    }
+}
+
+static inline size_t _bucket(const _nbt_intern_shard_t *shard, size_t hash) {
+    return (hash / INTERN_SHARDS) & (shard->cap - 1);
+}
+
+/** Doubles the bucket array of a shard, called with its lock held
+ * @param shard Shard to grow
+ * @return 0 on success, -1 on failure
+ */
+static int _grow(_nbt_intern_shard_t *shard) {
+    _nbt_interned_t **old = shard->buckets;
+    size_t old_cap = shard->cap;
+
+    shard->cap = old_cap ? old_cap * 2 : INTERN_MIN_CAP;
+    CALLOC(shard->buckets, shard->cap, sizeof(_nbt_interned_t *),
+           shard->buckets = old; shard->cap = old_cap; return -1);
+
+    for (size_t i = 0; i < old_cap; i++) {
+        _nbt_interned_t *e = old[i];
+        while (e != NULL) {
+            _nbt_interned_t *next = e->next;
+            size_t b = _bucket(shard, e->hash);
+            e->next = shard->buckets[b];
+            shard->buckets[b] = e;
+            e = next;
+        }
+    }
+
+    FREE(old);
+    return 0;
+}
+
+/** Returns the shared copy of a string, creating it on first use
+ * @param str String, need not be NUL terminated
+ * @param len Length of str
+ * @return A NUL terminated copy that must not be written, or NULL on failure;
+ *         each call takes a reference that _nbt_intern_release() drops
+ */
+char *_nbt_intern(const char *str, size_t len) {
+    size_t hash = _nbt_name_hash(str, len);
+    _nbt_intern_shard_t *shard = &_shards[hash & (INTERN_SHARDS - 1)];
+    _nbt_interned_t *e = NULL;
+
+    pthread_once(&_shards_once, _shards_init);
+    pthread_mutex_lock(&shard->lock);
+
+    if (shard->count >= shard->cap && _grow(shard) != 0 && shard->cap == 0) {
+        goto done;
+    }
+
+    for (e = shard->buckets[_bucket(shard, hash)]; e != NULL; e = e->next) {
+        if (e->hash == hash && e->len == len && memcmp(e->str, str, len) == 0) {
+            e->refs++;
+            goto done;
+        }
+    }
+
+    MALLOC(e, sizeof(_nbt_interned_t) + len + 1, goto done);
+    e->hash = hash;
+    e->refs = 1;
+    e->len = len;
+    memcpy(e->str, str, len);
+    e->str[len] = '\0';
+
+    e->next = shard->buckets[_bucket(shard, hash)];
+    shard->buckets[_bucket(shard, hash)] = e;
+    shard->count++;
+
+done:
+    pthread_mutex_unlock(&shard->lock);
+    return e != NULL ? e->str : NULL;
+}
+
+void _nbt_intern_release(const char *str) {
+    _nbt_interned_t *e = INTERNED(str);
+    _nbt_intern_shard_t *shard = &_shards[e->hash & (INTERN_SHARDS - 1)];
+
+    pthread_mutex_lock(&shard->lock);
+    if (--e->refs == 0) {
+        _nbt_interned_t **p = &shard->buckets[_bucket(shard, e->hash)];
+        while (*p != e) {
+            p = &(*p)->next;
+        }
+        *p = e->next;
+        shard->count--;
+        FREE(e);
+
+        /* an empty table holds no memory, so the allocator can be swapped once all trees are gone */
+        if (shard->count == 0) {
+            FREE(shard->buckets);
+            shard->cap = 0;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/** Takes another reference to an interned string
+ * @param str String returned by _nbt_intern()
+ */
+void _nbt_intern_ref(const char *str) {
+    _nbt_interned_t *e = INTERNED(str);
+    _nbt_intern_shard_t *shard = &_shards[e->hash & (INTERN_SHARDS - 1)];
+
+    pthread_mutex_lock(&shard->lock);
+    e->refs++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+size_t _nbt_intern_hash(const char *str) {
+    return INTERNED(str)->hash;
+}
+
+size_t _nbt_intern_len(const char *str) {
+    return INTERNED(str)->len;
+}
+
+const char *nbt_intern(const char *str) {
+    ASSERT(str != NULL, return NULL);
+    return _nbt_intern(str, strlen(str));
+}
+
+void nbt_intern_release(const char *str) {
+    ASSERT(str != NULL, return);
+    _nbt_intern_release(str);
+}
@@ -0,0 +1,43 @@
+/*
+ *  intern.h
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef LIBMCNBT_INTERN_H
+#define LIBMCNBT_INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* FNV-1a; interned strings keep theirs so the child index need not hash them again */
+static inline size_t _nbt_name_hash(const char *name, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) name[i];
+        h *= 1099511628211ULL;
+    }
+    return (size_t) h;
+}
+
+char *_nbt_intern(const char *str, size_t len);
+void _nbt_intern_ref(const char *str);
+void _nbt_intern_release(const char *str);
+size_t _nbt_intern_hash(const char *str);
+size_t _nbt_intern_len(const char *str);
+
+#endif
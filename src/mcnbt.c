@@ -21,82 +21,149 @@
 #include <string.h>
 #include <archive.h>
 #include <archive_entry.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "mcnbt.h"
+#include "stream.h"
 #include "tree.h"
 #include "util.h"
 
-nbt_node_t *nbt_initialize_from_file(const char *filename) {
-    FILE *fp = fopen(filename, "rb");
-    long file_size;
-    char *buf;
+/* compressed inputs at least this big are inflated on a second thread */
+#define READAHEAD_THRESHOLD 1048576
+
+static ssize_t _archive_read(void *ctx, void *buf, size_t len) {
+    return archive_read_data(ctx, buf, len);
+}
+
+static nbt_node_t *_nbt_read_archive(struct archive *a, size_t size, nbt_arena_t *arena) {
+    struct archive_entry *ae;
+    _nbt_readahead_t *ra = NULL;
     nbt_node_t *ret;
+    int scope;
 
-    fseek(fp, 0, SEEK_END);
-    file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    if (archive_read_next_header(a, &ae) != ARCHIVE_OK) {
+        archive_read_free(a);
+        return NULL;
+    }
 
-    MALLOC(buf, (file_size + 1) * sizeof(char), return NULL);
-    fread(buf, 1, (size_t) file_size, fp);
+    scope = _nbt_alloc_enter(MCNBT_ALLOC_PARSE);
+    if (size >= READAHEAD_THRESHOLD) {
+        ra = _nbt_readahead_new(_archive_read, a, READAHEAD_BLOCK);
+    }
 
-    ret = nbt_initialize(buf, (size_t) file_size);
-    fclose(fp);
-    FREE(buf);
+    if (ra != NULL) {
+        ret = _nbt_parse_stream(_nbt_readahead_read, ra, arena);
+        _nbt_readahead_free(ra);
+    } else {
+        ret = _nbt_parse_stream(_archive_read, a, arena);
+    }
+    _nbt_alloc_leave(scope);
+
+    archive_read_free(a);
     return ret;
 }
 
-nbt_node_t *nbt_initialize(void *data, size_t size) {
-    char buf[MAX_BUFFER];
-    ssize_t s;
+nbt_node_t *nbt_initialize_from_file(const char *filename) {
+    struct archive *a;
+    struct stat st;
 
-    struct archive_entry *ae;
-    struct archive *a = archive_read_new();
+    ASSERT(stat(filename, &st) == 0, return NULL);
+
+    a = archive_read_new();
     archive_read_support_filter_all(a);
     archive_read_support_format_raw(a);
-    int r = archive_read_open_memory(a, data, size);
 
-    if (r != ARCHIVE_OK) {
+    if (archive_read_open_filename(a, filename, 10240) != ARCHIVE_OK) {
+        archive_read_free(a);
         return NULL;
     }
 
-    r = archive_read_next_header(a, &ae);
-    if (r != ARCHIVE_OK) {
-        return NULL;
-    }
+    return _nbt_read_archive(a, (size_t) st.st_size, NULL);
+}
 
-    s = archive_read_data(a, buf, sizeof(buf));
+static nbt_node_t *_nbt_initialize(void *data, size_t size, nbt_arena_t *arena) {
+    struct archive *a = archive_read_new();
+    archive_read_support_filter_all(a);
+    archive_read_support_format_raw(a);
 
-    if (s < 0) {
+    if (archive_read_open_memory(a, data, size) != ARCHIVE_OK) {
+        archive_read_free(a);
         return NULL;
     }
 
-    if (s == 0) {
-        return NULL;
+    return _nbt_read_archive(a, size, arena);
+}
+
+nbt_node_t *nbt_initialize(void *data, size_t size) {
+    return _nbt_initialize(data, size, NULL);
+}
+
+nbt_node_t *nbt_initialize_arena(void *data, size_t size, nbt_arena_t *arena) {
+    ASSERT(arena != NULL, return NULL);
+    return _nbt_initialize(data, size, arena);
+}
+
+nbt_node_t *nbt_initialize_raw(void *data, size_t size, nbt_arena_t *arena, int flags) {
+    ASSERT(data != NULL, return NULL);
+    return _nbt_parse(data, size, arena, flags);
+}
+
+/** Syncs the directory holding a file, so that a rename into it is durable
+ * @param filename Path of the file
+ * @return 0 on success, -1 on failure
+ */
+static int _sync_dir(const char *filename) {
+    const char *slash = strrchr(filename, '/');
+    char *dir;
+    int fd, ret;
+
+    if (slash == NULL) {
+        dir = NULL;
+    } else {
+        MALLOC(dir, (size_t) (slash - filename) + 2, return -1);
+        memcpy(dir, filename, (size_t) (slash - filename) + 1);
+        dir[slash - filename + 1] = '\0';
     }
 
-    archive_read_free(a);
+    fd = open(dir != NULL ? dir : ".", O_RDONLY);
+    FREE(dir);
+    ASSERT(fd >= 0, return -1);
 
-    return _nbt_parse(buf, (size_t) s, NULL, NULL);
+    ret = fsync(fd);
+    close(fd);
+    return ret == 0 ? 0 : -1;
 }
 
-void nbt_write_tree(const char *filename, nbt_node_t *tree) {
-    struct archive *a;
-    struct archive_entry *ae;
-    size_t s;
-    char *serialized_tree = nbt_node_serialize(tree, &s);
-
-    a = archive_write_new();
-    archive_write_add_filter_gzip(a);
-    archive_write_set_format_raw(a);
-    archive_write_open_filename(a, filename);
-
-    ae = archive_entry_new();
-    archive_entry_set_filetype(ae, AE_IFREG);
-    archive_entry_set_size(ae, s);
-    archive_write_header(a, ae);
-    archive_write_data(a, serialized_tree, s);
-    archive_entry_free(ae);
-
-    archive_write_close(a);
-    archive_write_free(a);
-}
\ No newline at end of file
+int nbt_write_tree(const char *filename, nbt_node_t *tree) {
+    size_t len;
+    char *tmp;
+    int fd, ret;
+    ASSERT(filename != NULL, return -1);
+    ASSERT(tree != NULL, return -1);
+
+    /* written beside the file and renamed over it, so a failed write leaves the old one */
+    len = strlen(filename);
+    MALLOC(tmp, len + 8, return -1);
+    memcpy(tmp, filename, len);
+    memcpy(tmp + len, ".XXXXXX", 8);
+
+    fd = mkstemp(tmp);
+    ASSERT(fd >= 0, FREE(tmp); return -1);
+
+    ret = fchmod(fd, 0644) == 0 && nbt_write_fd(tree, fd, MCNBT_COMPRESS_GZIP) == 0 && fsync(fd) == 0 ? 0 : -1;
+    if (close(fd) != 0) {
+        ret = -1;
+    }
+
+    if (ret == 0 && rename(tmp, filename) == 0) {
+        ret = _sync_dir(filename);
+    } else {
+        unlink(tmp);
+        ret = -1;
+    }
+
+    FREE(tmp);
+    return ret;
+}
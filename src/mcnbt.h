@@ -23,6 +23,8 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #define MCNBT_VERSION_NUMBER 0001000
@@ -44,10 +46,177 @@ typedef enum _tag_type_t {
 } nbt_tag_type_t;
 
 typedef struct _nbt_node_t nbt_node_t;
+typedef struct _nbt_arena_t nbt_arena_t;
+typedef struct _nbt_query_t nbt_query_t;
+typedef struct _nbt_region_t nbt_region_t;
+typedef struct _nbt_patch_t nbt_patch_t;
+typedef struct _nbt_dedup_t nbt_dedup_t;
 
+#define MCNBT_COMPRESS_NONE 0
+#define MCNBT_COMPRESS_GZIP 1
+#define MCNBT_COMPRESS_ZLIB 2
+
+/* must consume all len bytes; returns 0 on success and -1 on failure */
+typedef int (*nbt_write_fn)(void *userdata, const void *buf, size_t len);
+
+#define MCNBT_POOL_ORDERED 0x1
+
+/* region is an index into the file list, x and z are relative to the
+ * region. chunk is NULL for a damaged chunk and only valid until the
+ * callback returns. A non-zero return stops processing. Without
+ * MCNBT_POOL_ORDERED the callback runs on several threads at once; with it
+ * a slow callback stalls decoding once a few chunks per thread are waiting. */
+typedef int (*nbt_chunk_fn)(void *userdata, size_t region, int x, int z, nbt_node_t *chunk);
+
+#define MCNBT_EVENT_CONTINUE 0
+#define MCNBT_EVENT_SKIP 1
+#define MCNBT_EVENT_STOP 2
+
+/* Names and values point into the parsed buffer. Elements of a list
+ * have no name. Int and long arrays are handed over big-endian as they
+ * appear in the buffer, see nbt_decode_int_array(). */
+typedef struct _nbt_event_callbacks_t {
+    int (*begin_compound)(void *userdata, const char *name, size_t name_len);
+    int (*end_compound)(void *userdata);
+    int (*begin_list)(void *userdata, const char *name, size_t name_len, nbt_tag_type_t list_type, size_t count);
+    int (*end_list)(void *userdata);
+
+    int (*byte_value)(void *userdata, const char *name, size_t name_len, char value);
+    int (*short_value)(void *userdata, const char *name, size_t name_len, short value);
+    int (*int_value)(void *userdata, const char *name, size_t name_len, int value);
+    int (*long_value)(void *userdata, const char *name, size_t name_len, long value);
+    int (*float_value)(void *userdata, const char *name, size_t name_len, float value);
+    int (*double_value)(void *userdata, const char *name, size_t name_len, double value);
+
+    int (*string_value)(void *userdata, const char *name, size_t name_len, const char *value, size_t len);
+    int (*byte_array)(void *userdata, const char *name, size_t name_len, const char *value, size_t len);
+    int (*int_array)(void *userdata, const char *name, size_t name_len, const void *value, size_t count);
+    int (*long_array)(void *userdata, const char *name, size_t name_len, const void *value, size_t count);
+} nbt_event_callbacks_t;
+
+/* data and len: the characters of a string, the big-endian elements and
+ * count of an array or list, or the encoded payload of a compound */
+typedef struct _nbt_query_result_t {
+    nbt_tag_type_t type;
+    const char *name;
+    size_t name_len;
+    union {
+        char b;
+        short s;
+        int i;
+        long l;
+        float f;
+        double d;
+    } value;
+    const void *data;
+    size_t len;
+    nbt_tag_type_t list_type;
+} nbt_query_result_t;
+
+typedef int (*nbt_query_fn)(void *userdata, const nbt_query_result_t *result);
+
+/* calloc may be NULL, the other functions are required; userdata is
+ * passed to each of them */
+typedef struct _nbt_allocator_t {
+    void *(*malloc)(void *userdata, size_t size);
+    void *(*calloc)(void *userdata, size_t n, size_t size);
+    void *(*realloc)(void *userdata, void *ptr, size_t size);
+    void (*free)(void *userdata, void *ptr);
+    void *userdata;
+} nbt_allocator_t;
+
+/* what the library was doing when it allocated: building and editing
+ * trees (and anything else), parsing or serializing */
+#define MCNBT_ALLOC_TREE 0
+#define MCNBT_ALLOC_PARSE 1
+#define MCNBT_ALLOC_SERIALIZE 2
+#define MCNBT_ALLOC_CATEGORIES 3
+
+/* calls to malloc, calloc and realloc, and the bytes they asked for */
+typedef struct _nbt_alloc_stats_t {
+    uint64_t calls[MCNBT_ALLOC_CATEGORIES];
+    uint64_t bytes[MCNBT_ALLOC_CATEGORIES];
+} nbt_alloc_stats_t;
+
+#define MCNBT_ARENA_HUGEPAGES 0x1
+
+/* entries never cross a long, as in chunks from 1.16 on */
+#define MCNBT_BITS_PADDED 0x1
+
+#define MCNBT_PARSE_BORROW 0x1
+#define MCNBT_PARSE_LAZY 0x2
+
+/* Memory the library hands back, such as the output of
+ * nbt_node_serialize(), is released with nbt_free(). Allocators may only
+ * be changed while nothing they would have to free is still allocated. */
+int nbt_set_allocator(const nbt_allocator_t *allocator);
+void nbt_free(void *ptr);
+void nbt_alloc_stats_enable(int enable);
+void nbt_alloc_stats_get(nbt_alloc_stats_t *stats);
+void nbt_alloc_stats_reset(void);
+
+nbt_arena_t *nbt_arena_new(size_t block_size, int flags);
+int nbt_arena_set_allocator(nbt_arena_t *arena, const nbt_allocator_t *allocator);
+void nbt_arena_reset(nbt_arena_t *arena);
+void nbt_arena_free(nbt_arena_t *arena);
+
+/* these inflate and parse as the data streams in, checking each field as
+ * it is read; only nbt_initialize_raw() without MCNBT_PARSE_LAZY validates
+ * the whole input before allocating and reserves an arena in one block */
 nbt_node_t *nbt_initialize_from_file(const char *filename);
 nbt_node_t *nbt_initialize(void *data, size_t size);
-void nbt_write_tree(const char *filename, nbt_node_t *tree);
+nbt_node_t *nbt_initialize_arena(void *data, size_t size, nbt_arena_t *arena);
+nbt_node_t *nbt_initialize_raw(void *data, size_t size, nbt_arena_t *arena, int flags);
+int nbt_parse_events(void *data, size_t size, const nbt_event_callbacks_t *callbacks, void *userdata);
+void nbt_decode_int_array(const void *src, int *dst, size_t count);
+void nbt_decode_long_array(const void *src, long *dst, size_t count);
+
+size_t nbt_bits_packed_len(size_t count, unsigned int bits, int flags);
+int nbt_unpack_bits(const long *src, size_t src_len, unsigned short *dst, size_t count, unsigned int bits, int flags);
+int nbt_pack_bits(const unsigned short *src, size_t count, long *dst, size_t dst_len, unsigned int bits, int flags);
+void nbt_unpack_nibbles(const void *src, unsigned char *dst, size_t count);
+void nbt_pack_nibbles(const unsigned char *src, void *dst, size_t count);
+
+nbt_query_t *nbt_query_compile(const char *path);
+int nbt_query_run(nbt_query_t *query, void *data, size_t size, nbt_query_fn callback, void *userdata);
+void nbt_query_free(nbt_query_t *query);
+/* replaces the file only once the whole tree has been written and synced */
+int nbt_write_tree(const char *filename, nbt_node_t *tree);
+int nbt_write_sink(nbt_node_t *tree, nbt_write_fn write, void *userdata, int compression);
+int nbt_write_fd(nbt_node_t *tree, int fd, int compression);
+int nbt_write_file(nbt_node_t *tree, FILE *file, int compression);
+
+nbt_patch_t *nbt_diff(nbt_node_t *from, nbt_node_t *to);
+/* A patch applies completely or not at all. On success the tree is returned,
+ * or its replacement if the patch set a new root, in which case tree is freed.
+ * On failure NULL is returned and tree is left as it was. */
+nbt_node_t *nbt_patch_apply(nbt_node_t *tree, const nbt_patch_t *patch);
+const void *nbt_patch_get_data(const nbt_patch_t *patch, size_t *len);
+nbt_patch_t *nbt_patch_load(const void *data, size_t len);
+size_t nbt_patch_count_ops(const nbt_patch_t *patch);
+void nbt_patch_free(nbt_patch_t *patch);
+
+const char *nbt_intern(const char *str);
+void nbt_intern_release(const char *str);
+
+nbt_dedup_t *nbt_dedup_new(void);
+size_t nbt_dedup_tree(nbt_dedup_t *dedup, nbt_node_t *tree);
+void nbt_dedup_free(nbt_dedup_t *dedup);
+
+nbt_region_t *nbt_region_open(const char *filename);
+void nbt_region_close(nbt_region_t *region);
+size_t nbt_region_count_chunks(nbt_region_t *region);
+int nbt_region_get_chunk_pos(nbt_region_t *region, size_t i, int *x, int *z);
+int nbt_region_has_chunk(nbt_region_t *region, int x, int z);
+unsigned int nbt_region_get_timestamp(nbt_region_t *region, int x, int z);
+nbt_node_t *nbt_region_read_chunk(nbt_region_t *region, int x, int z);
+nbt_node_t *nbt_region_read_chunk_arena(nbt_region_t *region, int x, int z, nbt_arena_t *arena);
+nbt_region_t *nbt_region_open_rw(const char *filename);
+int nbt_region_write_chunk(nbt_region_t *region, int x, int z, nbt_node_t *chunk, unsigned int timestamp);
+int nbt_region_delete_chunk(nbt_region_t *region, int x, int z);
+int nbt_region_flush(nbt_region_t *region);
+int nbt_region_process(const char *const *filenames, size_t count, size_t threads, int flags, nbt_chunk_fn fn,
+                       void *userdata);
 
 nbt_node_t *nbt_node_get_next(nbt_node_t *node);
 nbt_node_t *nbt_node_get_prev(nbt_node_t *node);
@@ -57,8 +226,13 @@ void nbt_node_free(nbt_node_t *tree);
 nbt_node_t *nbt_node_initialize(nbt_tag_type_t type, const char *name, void *data);
 nbt_node_t *nbt_node_initialize_len(nbt_tag_type_t type, const char *name, void *data, size_t data_size);
 nbt_node_t *nbt_node_initialize_list(nbt_tag_type_t type, const char *name, void *data, nbt_tag_type_t list_type);
+nbt_node_t *nbt_node_initialize_arena(nbt_arena_t *arena, nbt_tag_type_t type, const char *name, void *data,
+                                      size_t data_size);
 
+/* names are shared between trees and must not be written to; rename a tag
+ * with nbt_node_set_name() */
 char *nbt_node_get_name(nbt_node_t *node);
+const char *nbt_node_get_name_view(nbt_node_t *node, size_t *len);
 int nbt_node_set_name(nbt_node_t *node, const char *name);
 
 nbt_tag_type_t nbt_node_get_type(nbt_node_t *node);
@@ -81,23 +255,50 @@ int nbt_node_set_data_long(nbt_node_t *node, long data);
 int nbt_node_get_data_int(nbt_node_t *node);
 int nbt_node_set_data_int(nbt_node_t *node, int data);
 
+/* the getters returning a writable payload are for changing it in place:
+ * each call gives the node a private copy and drops the cached hash and
+ * encoding of the node and its ancestors; the _view getters only read */
 char *nbt_node_get_data_str(nbt_node_t *node);
+const char *nbt_node_get_data_str_view(nbt_node_t *node, size_t *len);
 int nbt_node_set_data_str(nbt_node_t *node, char *data);
 int nbt_node_set_data_byte_array(nbt_node_t *node, char *data, size_t len);
 
 int *nbt_node_get_data_int_array(nbt_node_t *node);
+const int *nbt_node_get_data_int_array_view(nbt_node_t *node, size_t *len);
 int nbt_node_set_data_int_array(nbt_node_t *node, int *data, size_t len);
 
 long *nbt_node_get_data_long_array(nbt_node_t *node);
+const long *nbt_node_get_data_long_array_view(nbt_node_t *node, size_t *len);
 int nbt_node_set_data_long_array(nbt_node_t *node, long *data, size_t len);
 
 nbt_tag_type_t nbt_node_get_list_type(nbt_node_t *node);
+int nbt_node_set_list_type(nbt_node_t *node, nbt_tag_type_t list_type);
 
 nbt_node_t *nbt_node_get_first_child(nbt_node_t *node);
 nbt_node_t *nbt_node_get_last_child(nbt_node_t *node);
 nbt_node_t *nbt_node_get_parent(nbt_node_t *node);
 nbt_node_t *nbt_node_get_next_child(nbt_node_t *node);
 nbt_node_t *nbt_node_get_prev_child(nbt_node_t *node);
+nbt_node_t *nbt_node_find_child(nbt_node_t *node, const char *name);
+nbt_node_t *nbt_node_get_child_at(nbt_node_t *node, size_t i);
+int nbt_node_reserve(nbt_node_t *node, size_t count);
+
+/* lists of numbers are stored packed; walking one node by node unpacks it
+ * for good, so read it with these or nbt_list_get_number(), which copies
+ * element i in the list type into out */
+int nbt_list_get_number(nbt_node_t *list, size_t i, void *out);
+size_t nbt_list_get_bytes(nbt_node_t *list, char *out, size_t n);
+int nbt_list_set_bytes(nbt_node_t *list, const char *values, size_t n);
+size_t nbt_list_get_shorts(nbt_node_t *list, short *out, size_t n);
+int nbt_list_set_shorts(nbt_node_t *list, const short *values, size_t n);
+size_t nbt_list_get_ints(nbt_node_t *list, int *out, size_t n);
+int nbt_list_set_ints(nbt_node_t *list, const int *values, size_t n);
+size_t nbt_list_get_longs(nbt_node_t *list, long *out, size_t n);
+int nbt_list_set_longs(nbt_node_t *list, const long *values, size_t n);
+size_t nbt_list_get_floats(nbt_node_t *list, float *out, size_t n);
+int nbt_list_set_floats(nbt_node_t *list, const float *values, size_t n);
+size_t nbt_list_get_doubles(nbt_node_t *list, double *out, size_t n);
+int nbt_list_set_doubles(nbt_node_t *list, const double *values, size_t n);
 
 int nbt_node_append_child(nbt_node_t *parent, nbt_node_t *child);
 int nbt_node_prepend_child(nbt_node_t *parent, nbt_node_t *child);
@@ -107,8 +308,16 @@ int nbt_node_unlink(nbt_node_t *node);
 int nbt_node_replace(nbt_node_t *old, nbt_node_t *new);
 
 size_t nbt_node_get_len(nbt_node_t *node);
+/* a heap clone shares payloads with the original and may be handed to
+ * another thread, to be used there by one thread at a time */
+nbt_node_t *nbt_node_clone(nbt_node_t *node);
+nbt_node_t *nbt_node_clone_arena(nbt_node_t *node, nbt_arena_t *arena);
+uint64_t nbt_node_hash(nbt_node_t *node);
+int nbt_node_equal(nbt_node_t *a, nbt_node_t *b);
 
 char *nbt_node_serialize(nbt_node_t *node, size_t *len);
+size_t nbt_node_serialized_size(nbt_node_t *node);
+size_t nbt_node_serialize_into(nbt_node_t *node, void *buf, size_t size);
 
 #ifdef __cplusplus
 }
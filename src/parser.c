@@ -1,5 +1,5 @@
 /*
- *  parser.h
+ *  parser.c
  *
  *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
  *
@@ -16,477 +16,440 @@
  *  License along with this library; if not see <http://www.gnu.org/licenses/>.
  */
 
-/* TODO: Clean up this file. */
-
+#include <stdint.h>
 #include <string.h>
 #include "tree.h"
 #include "mcnbt.h"
+#include "arena.h"
+#include "scan.h"
+#include "swap.h"
+#include "stream.h"
 #include "util.h"
 
-static nbt_node_t *_nbt_parse_byte_array(void *data, int *pos, int in_list) {
-    nbt_node_t *ret;
-    char *name = NULL;
-    size_t name_len;
-    char *stor;
-    int s = 0;
-
-    if (in_list == 0) {
-        name_len = (size_t)((char *) data)[*pos] << 8;
-        *pos += 1;
-        name_len += (size_t)((char *) data)[*pos];
-        *pos += 1;
-
-        MALLOC(name, (name_len + 1) * sizeof(char), return NULL);
-        for (int i = *pos; i < *pos + name_len; i++) {
-            *(name + i - *pos) = ((char *) data)[i];
-        }
-        *(name + name_len) = '\0';
-        *pos += name_len;
+#define STREAM_WINDOW 65536
+#define MAX_NAME 65536
+
+typedef struct _nbt_parser_t {
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+    nbt_arena_t *arena;
+    int create;
+    int depth;
+
+    /* set in lazy mode; containers are skipped and parsed on first access */
+    _nbt_source_t *src;
+
+    /* set once the input has been validated, so lengths need no checks */
+    int checked;
+
+    /* streaming input; data is a window over what has been read so far */
+    _nbt_read_fn read;
+    void *read_ctx;
+    unsigned char *window;
+    size_t cap;
+    char *scratch;
+} _nbt_parser_t;
+
+static int _refill(_nbt_parser_t *p, size_t n) {
+    size_t avail = p->size - p->pos;
+    ssize_t r;
+
+    if (p->read == NULL) {
+        return -1;
     }
 
-    MALLOC(stor, sizeof(char) * 4, return NULL);
-    for (int i = *pos; i < *pos + 4; i++) {
-        *(stor + i - *pos) = ((char *) data)[i];
-    }
-    *pos += 4;
+    /* the window only has to hold the largest single payload */
+    memmove(p->window, p->window + p->pos, avail);
+    p->pos = 0;
+    p->size = avail;
 
-    s = (*(stor) & 255) << 24;
-    s += (*(stor + 1) & 255) << 16;
-    s += (*(stor + 2) & 255) << 8;
-    s += (*(stor + 3) & 255);
-    FREE(stor);
+    if (n > p->cap) {
+        size_t cap = p->cap * 2 > n ? p->cap * 2 : n;
+        REALLOC(p->window, cap, return -1);
+        p->cap = cap;
+    }
+    p->data = p->window;
 
-    MALLOC(stor, sizeof(char) * s, return NULL);
-    for (int i = *pos; i < *pos + s; i++) {
-        *(stor + i - *pos) = ((char *) data)[i];
+    while (p->size < n) {
+        r = p->read(p->read_ctx, p->window + p->size, p->cap - p->size);
+        if (r <= 0) {
+            return -1;
+        }
+        p->size += (size_t) r;
     }
-    *pos += s;
 
-    ret = nbt_node_initialize_len(MCNBT_TAG_BYTE_ARRAY, name, stor, (size_t) s);
-    nbt_node_set_len(ret, (size_t) s);
-    FREE(name);
-    FREE(stor);
-    return ret;
+    return 0;
 }
 
-static nbt_node_t *_nbt_parse_compound(void *data, int *pos, int in_list) {
-    nbt_node_t *ret;
-    char *name = NULL;
-    size_t name_len;
+static int _need(_nbt_parser_t *p, size_t n) {
+    if (p->checked) {
+        return 0;
+    }
+    return p->size - p->pos >= n ? 0 : _refill(p, n);
+}
 
-    if (in_list == 0) {
-        name_len = (size_t)((char *) data)[*pos] << 8;
-        *pos += 1;
-        name_len += (size_t)((char *) data)[*pos];
-        *pos += 1;
+static int _parse_name(_nbt_parser_t *p, const char **name, size_t *name_len) {
+    ASSERT(_need(p, 2) == 0, return -1);
+    *name_len = _nbt_be16(p->data + p->pos);
+    p->pos += 2;
 
-        MALLOC(name, (name_len + 1) * sizeof(char), return NULL);
-        for (int i = *pos; i < *pos + name_len; i++) {
-            *(name + i - *pos) = ((char *) data)[i];
-        }
-        *(name + name_len) = '\0';
-        *pos += name_len - 1;
-    }
+    ASSERT(_need(p, *name_len) == 0, return -1);
+    *name = (const char *) p->data + p->pos;
+    p->pos += *name_len;
 
-    ret = nbt_node_initialize(MCNBT_TAG_COMPOUND, name, NULL);
-    FREE(name);
-    return ret;
+    /* the window may move while the payload is read */
+    if (p->read != NULL) {
+        memcpy(p->scratch, *name, *name_len);
+        *name = p->scratch;
+    }
+    return 0;
 }
 
-static nbt_node_t *_nbt_parse_num(void *data, int *pos, nbt_tag_type_t type, int in_list) {
-    nbt_node_t *ret;
-    char *name = NULL;
-    char *stor;
-    size_t name_len = 0;
-    size_t data_len;
-    void *edata;
-
-    if (in_list == 0) {
-        name_len = (size_t)((char *) data)[*pos] << 8;
-        *pos += 1;
-        name_len += (size_t)((char *) data)[*pos];
-        *pos += 1;
-
-        MALLOC(name, (name_len + 1) * sizeof(char), return NULL);
-        for (int i = *pos; i < *pos + name_len; i++) {
-            *(name + i - *pos) = ((char *) data)[i];
+static nbt_node_t *_parse_payload(_nbt_parser_t *p, nbt_tag_type_t type, const char *name, size_t name_len);
+
+static int _parse_compound(_nbt_parser_t *p, nbt_node_t *node) {
+    nbt_tag_type_t type;
+    const char *name;
+    size_t name_len;
+    nbt_node_t *child;
+
+    for (;;) {
+        ASSERT(_need(p, 1) == 0, return -1);
+        type = (nbt_tag_type_t) p->data[p->pos++];
+        if (type == MCNBT_TAG_END) {
+            return 0;
         }
-        *(name + name_len) = '\0';
-        *pos += name_len;
+
+        ASSERT(_parse_name(p, &name, &name_len) == 0, return -1);
+        child = _parse_payload(p, type, name, name_len);
+        ASSERT(child != NULL, return -1);
+        nbt_node_append_child(node, child);
     }
+}
 
-    switch (type) {
-        case MCNBT_TAG_BYTE:
-            data_len = 1;
+/** Decodes big-endian numbers into the host layout of a packed list
+ * @param dst Packed storage
+ * @param src Serialized elements
+ * @param type Element type
+ * @param count Number of elements
+ */
+static void _decode_packed(void *dst, const unsigned char *src, nbt_tag_type_t type, size_t count) {
+    /* floats and doubles share the byte order of same-sized integers */
+    switch (_nbt_fixed_size(type)) {
+        case 1:
+            memcpy(dst, src, count);
             break;
-        case MCNBT_TAG_SHORT:
-            data_len = 2;
+        case 2:
+            _nbt_swap16(dst, src, count);
             break;
-        case MCNBT_TAG_INT:
-        case MCNBT_TAG_FLOAT:
-            data_len = 4;
+        case 4:
+            _nbt_swap32(dst, src, count);
             break;
-        case MCNBT_TAG_LONG:
-        case MCNBT_TAG_DOUBLE:
-            data_len = 8;
+        case 8:
+            _nbt_swap64(dst, src, count);
             break;
         default:
-            data_len = 0;
             break;
     }
-
-    MALLOC(stor, sizeof(char) * data_len, return NULL);
-    for (int i = *pos; i < *pos + data_len; i++) {
-        *(stor + i - *pos) = ((char *) data)[i];
-    }
-    *pos += data_len - 1;
-
-    if (type == MCNBT_TAG_BYTE) {
-        MALLOC(edata, sizeof(char), return NULL);
-        *((char *) edata) = stor[0];
-    } else if (type == MCNBT_TAG_SHORT) {
-        MALLOC(edata, sizeof(short), return NULL);
-        *((short *) edata) = (short) (((short) stor[0] & 255) << 8);
-        *((short *) edata) += (short) stor[1] & 255;
-    } else if (type == MCNBT_TAG_INT) {
-        MALLOC(edata, sizeof(int), return NULL);
-        *((int *) edata) = ((int) stor[0] & 255) << 24;
-        *((int *) edata) += ((int) stor[1] & 255) << 16;
-        *((int *) edata) += ((int) stor[2] & 255) << 8;
-        *((int *) edata) += (int) stor[3] & 255;
-    } else if (type == MCNBT_TAG_LONG) {
-        MALLOC(edata, sizeof(long), return NULL);
-        *((long *) edata) = ((long) stor[0] & 255) << 56;
-        *((long *) edata) += ((long) stor[1] & 255) << 48;
-        *((long *) edata) += ((long) stor[2] & 255) << 40;
-        *((long *) edata) += ((long) stor[3] & 255) << 32;
-        *((long *) edata) += ((long) stor[4] & 255) << 24;
-        *((long *) edata) += ((long) stor[5] & 255) << 16;
-        *((long *) edata) += ((long) stor[6] & 255) << 8;
-        *((long *) edata) += (long) stor[7] & 255;
-    } else if (type == MCNBT_TAG_FLOAT) {
-        MALLOC(edata, sizeof(int), return NULL);
-        *((int *) edata) = ((int) stor[0] & 255) << 24;
-        *((int *) edata) += ((int) stor[1] & 255) << 16;
-        *((int *) edata) += ((int) stor[2] & 255) << 8;
-        *((int *) edata) += (int) stor[3] & 255;
-    } else if (type == MCNBT_TAG_DOUBLE) {
-        MALLOC(edata, sizeof(long), return NULL);
-        *((long *) edata) = ((long) stor[0] & 255) << 56;
-        *((long *) edata) += ((long) stor[1] & 255) << 48;
-        *((long *) edata) += ((long) stor[2] & 255) << 40;
-        *((long *) edata) += ((long) stor[3] & 255) << 32;
-        *((long *) edata) += ((long) stor[4] & 255) << 24;
-        *((long *) edata) += ((long) stor[5] & 255) << 16;
-        *((long *) edata) += ((long) stor[6] & 255) << 8;
-        *((long *) edata) += (long) stor[7] & 255;
-    } else {
-        edata = NULL;
-    }
-
-    FREE(stor);
-
-    ret = nbt_node_initialize(type, name, edata);
-    FREE(edata);
-    FREE(name);
-    return ret;
 }
 
-static nbt_node_t *_nbt_parse_string(void *, int *, int);
-static nbt_node_t *_nbt_parse_int_array(void *data, int *pos, int in_list);
-static nbt_node_t *_nbt_parse_long_array(void *data, int *pos, int in_list);
-
-static nbt_node_t *_nbt_parse_list(void *data, size_t size, int *pos, int in_list) {
-    nbt_node_t *ret;
-    char *name = NULL;
-    size_t name_len;
-    char *stor;
-    int num;
-    nbt_tag_type_t list_type;
+static int _parse_list(_nbt_parser_t *p, nbt_node_t *node) {
     nbt_node_t *child;
-
-    if (in_list == 0) {
-        name_len = (size_t)((char *) data)[*pos] << 8;
-        *pos += 1;
-        name_len += (size_t)((char *) data)[*pos];
-        *pos += 1;
-
-        MALLOC(name, (name_len + 1) * sizeof(char), return NULL);
-        for (int i = *pos; i < *pos + name_len; i++) {
-            *(name + i - *pos) = ((char *) data)[i];
-        }
-        *(name + name_len) = '\0';
-        *pos += name_len;
+    nbt_tag_type_t type;
+    uint32_t num;
+    size_t width;
+    void *dst;
+
+    ASSERT(_need(p, 5) == 0, return -1);
+    type = (nbt_tag_type_t) p->data[p->pos];
+    nbt_node_set_list_type(node, type);
+    num = _nbt_be32(p->data + p->pos + 1);
+    p->pos += 5;
+
+    /* lists of numbers are kept as one array instead of a node per element */
+    width = _nbt_fixed_size(type);
+    if (width != 0 && num > 0) {
+        ASSERT(_need(p, (size_t) num * width) == 0, return -1);
+        dst = _nbt_node_pack(node, num);
+        ASSERT(dst != NULL, return -1);
+        _decode_packed(dst, p->data + p->pos, type, num);
+        p->pos += (size_t) num * width;
+        return 0;
     }
 
-    list_type = (nbt_tag_type_t)((char *) data)[*pos];
-    *pos += 1;
+    /* every element takes at least one byte, so a bogus count cannot over-allocate */
+    ASSERT(nbt_node_reserve(node, num < p->size - p->pos ? num : p->size - p->pos) == 0, return -1);
 
-    MALLOC(stor, sizeof(char) * 4, return NULL);
-    for (int i = *pos; i < *pos + 4; i++) {
-        *(stor + i - *pos) = ((char *) data)[i];
-    }
-    *pos += 4;
-
-    num = (*(stor) & 255) << 24;
-    num += (*(stor + 1) & 255) << 16;
-    num += (*(stor + 2) & 255) << 8;
-    num += (*(stor + 3) & 255);
-    FREE(stor);
-
-    ret = nbt_node_initialize_list(MCNBT_TAG_LIST, name, NULL, list_type);
-
-    for (int i = 0; i < num; i++) {
-        if (list_type == MCNBT_TAG_BYTE || list_type == MCNBT_TAG_SHORT || list_type == MCNBT_TAG_INT ||
-                list_type == MCNBT_TAG_LONG || list_type == MCNBT_TAG_FLOAT || list_type == MCNBT_TAG_DOUBLE) {
-            child = _nbt_parse_num(data, pos, list_type, 1);
-            nbt_node_append_child(ret, child);
-            (*pos)++;
-        } else if (list_type == MCNBT_TAG_STRING) {
-            child = _nbt_parse_string(data, pos, 1);
-            nbt_node_append_child(ret, child);
-            (*pos)++;
-        } else if (list_type == MCNBT_TAG_BYTE_ARRAY) {
-            child = _nbt_parse_byte_array(data, pos, 1);
-            nbt_node_append_child(ret, child);
-            (*pos)++;
-        } else if (list_type == MCNBT_TAG_COMPOUND) {
-            child = _nbt_parse_compound(data, pos, 1);
-            child = _nbt_parse(data, size, child, pos);
-            nbt_node_append_child(ret, child);
-            (*pos)++;
-        } else if (list_type == MCNBT_TAG_INT_ARRAY) {
-            child = _nbt_parse_int_array(data, pos, 1);
-            nbt_node_append_child(ret, child);
-        } else if (list_type == MCNBT_TAG_LONG_ARRAY) {
-            child = _nbt_parse_long_array(data, pos, 1);
-            nbt_node_append_child(ret, child);
-        }
+    for (uint32_t i = 0; i < num; i++) {
+        child = _parse_payload(p, nbt_node_get_list_type(node), NULL, 0);
+        ASSERT(child != NULL, return -1);
+        nbt_node_append_child(node, child);
     }
 
-    (*pos)--;
-    FREE(name);
-    return ret;
+    return 0;
 }
 
-static nbt_node_t *_nbt_parse_string(void *data, int *pos, int in_list) {
-    nbt_node_t *ret;
-    char *name = NULL;
-    size_t name_len;
-    char *stor;
-    int s = 0;
-
-    if (in_list == 0) {
-        name_len = (size_t)((char *) data)[*pos] << 8;
-        *pos += 1;
-        name_len += (size_t)((char *) data)[*pos];
-        *pos += 1;
-
-        MALLOC(name, (name_len + 1) * sizeof(char), return NULL);
-        for (int i = *pos; i < *pos + name_len; i++) {
-            *(name + i - *pos) = ((char *) data)[i];
-        }
-        *(name + name_len) = '\0';
-        *pos += name_len;
-    }
+static nbt_node_t *_parse_payload(_nbt_parser_t *p, nbt_tag_type_t type, const char *name, size_t name_len) {
+    nbt_node_t *ret = NULL;
+    uint32_t len;
+    int r;
+    union {
+        char b;
+        short s;
+        int i;
+        long l;
+        float f;
+        double d;
+        uint32_t u32;
+        uint64_t u64;
+    } v;
 
-    MALLOC(stor, sizeof(char) * 2, return NULL);
-    for (int i = *pos; i < *pos + 2; i++) {
-        *(stor + i - *pos) = ((char *) data)[i];
-    }
-    *pos += 2;
-
-    s = (*(stor) & 255) << 8;
-    s += *(stor + 1) & 255;
-    FREE(stor);
+    switch (type) {
+        case MCNBT_TAG_BYTE:
+            ASSERT(_need(p, 1) == 0, return NULL);
+            v.b = (char) p->data[p->pos];
+            p->pos += 1;
+            break;
+        case MCNBT_TAG_SHORT:
+            ASSERT(_need(p, 2) == 0, return NULL);
+            v.s = (short) _nbt_be16(p->data + p->pos);
+            p->pos += 2;
+            break;
+        case MCNBT_TAG_INT:
+        case MCNBT_TAG_FLOAT:
+            ASSERT(_need(p, 4) == 0, return NULL);
+            v.u32 = _nbt_be32(p->data + p->pos);
+            p->pos += 4;
+            break;
+        case MCNBT_TAG_LONG:
+        case MCNBT_TAG_DOUBLE:
+            ASSERT(_need(p, 8) == 0, return NULL);
+            v.u64 = _nbt_be64(p->data + p->pos);
+            p->pos += 8;
+            break;
+        case MCNBT_TAG_BYTE_ARRAY:
+            ASSERT(_need(p, 4) == 0, return NULL);
+            len = _nbt_be32(p->data + p->pos);
+            p->pos += 4;
+
+            ASSERT(_need(p, len) == 0, return NULL);
+            ret = _nbt_node_create(p->arena, type, name, name_len, p->data + p->pos, len, p->create);
+            p->pos += len;
+            return ret;
+        case MCNBT_TAG_STRING:
+            ASSERT(_need(p, 2) == 0, return NULL);
+            len = _nbt_be16(p->data + p->pos);
+            p->pos += 2;
+
+            ASSERT(_need(p, len) == 0, return NULL);
+            ret = _nbt_node_create(p->arena, type, name, name_len, p->data + p->pos, len, p->create);
+            p->pos += len;
+            return ret;
+        case MCNBT_TAG_INT_ARRAY:
+            ASSERT(_need(p, 4) == 0, return NULL);
+            len = _nbt_be32(p->data + p->pos);
+            p->pos += 4;
+
+            ASSERT(_need(p, (size_t) len * 4) == 0, return NULL);
+            ret = _nbt_node_create(p->arena, type, name, name_len, NULL, (size_t) len * 4, p->create);
+            ASSERT(ret != NULL, return NULL);
+            _nbt_swap32(_nbt_node_get_buffer(ret), p->data + p->pos, len);
+            p->pos += (size_t) len * 4;
+            return ret;
+        case MCNBT_TAG_LONG_ARRAY:
+            ASSERT(_need(p, 4) == 0, return NULL);
+            len = _nbt_be32(p->data + p->pos);
+            p->pos += 4;
+
+            ASSERT(_need(p, (size_t) len * 8) == 0, return NULL);
+            ret = _nbt_node_create(p->arena, type, name, name_len, NULL, (size_t) len * 8, p->create);
+            ASSERT(ret != NULL, return NULL);
+            _nbt_swap64(_nbt_node_get_buffer(ret), p->data + p->pos, len);
+            p->pos += (size_t) len * 8;
+            return ret;
+        case MCNBT_TAG_LIST:
+        case MCNBT_TAG_COMPOUND:
+            ASSERT(p->depth < MAX_DEPTH, return NULL);
+            ret = _nbt_node_create(p->arena, type, name, name_len, NULL, 0, p->create);
+            ASSERT(ret != NULL, return NULL);
+
+            if (p->src != NULL) {
+                size_t start = p->pos;
+                if (_nbt_skip_payload(p->data, p->size, &p->pos, type, p->depth) != 0) {
+                    nbt_node_free(ret);
+                    return NULL;
+                }
 
-    MALLOC(stor, sizeof(char) * (s + 1), return NULL);
-    for (int i = *pos; i < *pos + s; i++) {
-        *(stor + i - *pos) = ((char *) data)[i];
+                if (type == MCNBT_TAG_LIST) {
+                    nbt_node_set_list_type(ret, (nbt_tag_type_t) p->data[start]);
+                }
+                _nbt_node_set_lazy(ret, p->src, start, p->pos - start);
+                return ret;
+            }
+
+            p->depth++;
+            r = type == MCNBT_TAG_LIST ? _parse_list(p, ret) : _parse_compound(p, ret);
+            p->depth--;
+
+            if (r != 0) {
+                nbt_node_free(ret);
+                return NULL;
+            }
+            return ret;
+        default:
+            return NULL;
     }
-    *(stor + s) = '\0';
-    *pos += s - 1;
 
-    ret = nbt_node_initialize_len(MCNBT_TAG_STRING, name, stor, strlen(stor) + 1);
-    FREE(stor);
-    FREE(name);
-    return ret;
+    return _nbt_node_create(p->arena, type, name, name_len, &v, 0, p->create);
 }
 
-static nbt_node_t *_nbt_parse_int_array(void *data, int *pos, int in_list) {
-    nbt_node_t *ret;
-    char *name = NULL;
+static nbt_node_t *_parse_root(_nbt_parser_t *p) {
+    nbt_tag_type_t type;
+    const char *name;
     size_t name_len;
-    int s = 0;
-    int *arr = NULL;
-
-    if (in_list == 0) {
-        name_len = (size_t)((char *) data)[*pos] << 8;
-        *pos += 1;
-        name_len += (size_t)((char *) data)[*pos];
-        *pos += 1;
-
-        MALLOC(name, (name_len + 1) * sizeof(char), return NULL);
-        for (int i = *pos; i < *pos + name_len; i++) {
-            *(name + i - *pos) = ((char *) data)[i];
-        }
-        *(name + name_len) = '\0';
-        *pos += name_len;
-    }
 
-    s = (((unsigned char *)data)[*pos] << 24) |
-        (((unsigned char *)data)[*pos + 1] << 16) |
-        (((unsigned char *)data)[*pos + 2] << 8) |
-        (((unsigned char *)data)[*pos + 3]);
-    *pos += 4;
-
-    CALLOC(arr, (size_t) s, sizeof(int), return NULL);
-    for (int i = 0; i < s; i++) {
-        arr[i] = (((unsigned char *)data)[*pos] << 24) |
-                 (((unsigned char *)data)[*pos + 1] << 16) |
-                 (((unsigned char *)data)[*pos + 2] << 8) |
-                 (((unsigned char *)data)[*pos + 3]);
-        *pos += 4;
-    }
+    ASSERT(_need(p, 1) == 0, return NULL);
+    type = (nbt_tag_type_t) p->data[p->pos++];
+    ASSERT(type != MCNBT_TAG_END, return NULL);
+    ASSERT(_parse_name(p, &name, &name_len) == 0, return NULL);
 
-    ret = nbt_node_initialize_len(MCNBT_TAG_INT_ARRAY, name, arr, (size_t) s * 4);
-    FREE(arr);
-    FREE(name);
-    return ret;
+    return _parse_payload(p, type, name, name_len);
 }
 
-static nbt_node_t *_nbt_parse_long_array(void *data, int *pos, int in_list) {
+static nbt_node_t *_parse_buffer(void *data, size_t size, nbt_arena_t *arena, int flags) {
+    _nbt_parser_t p;
+    _nbt_scan_t stats;
     nbt_node_t *ret;
-    char *name = NULL;
-    size_t name_len;
-    int s = 0;
-    long *arr = NULL;
-
-    if (in_list == 0) {
-        name_len = (size_t)((char *) data)[*pos] << 8;
-        *pos += 1;
-        name_len += (size_t)((char *) data)[*pos];
-        *pos += 1;
-
-        MALLOC(name, (name_len + 1) * sizeof(char), return NULL);
-        for (int i = *pos; i < *pos + name_len; i++) {
-            *(name + i - *pos) = ((char *) data)[i];
-        }
-        *(name + name_len) = '\0';
-        *pos += name_len;
-    }
 
-    s = (((unsigned char *)data)[*pos] << 24) |
-        (((unsigned char *)data)[*pos + 1] << 16) |
-        (((unsigned char *)data)[*pos + 2] << 8) |
-        (((unsigned char *)data)[*pos + 3]);
-    *pos += 4;
-
-    CALLOC(arr, (size_t) s, sizeof(long), return NULL);
-    for (int i = 0; i < s; i++) {
-        arr[i] = ((long)(((unsigned char *)data)[*pos]) << 56) |
-                 ((long)(((unsigned char *)data)[*pos + 1]) << 48) |
-                 ((long)(((unsigned char *)data)[*pos + 2]) << 40) |
-                 ((long)(((unsigned char *)data)[*pos + 3]) << 32) |
-                 (((unsigned char *)data)[*pos + 4] << 24) |
-                 (((unsigned char *)data)[*pos + 5] << 16) |
-                 (((unsigned char *)data)[*pos + 6] << 8) |
-                 (((unsigned char *)data)[*pos + 7]);
-        *pos += 8;
-    }
+    memset(&p, 0, sizeof(p));
+    p.data = data;
+    p.size = size;
+    p.arena = arena;
+    p.create = (flags & MCNBT_PARSE_BORROW) ? NBT_CREATE_BORROW : 0;
 
-    ret = nbt_node_initialize_len(MCNBT_TAG_LONG_ARRAY, name, arr, (size_t) s * 8);
-    FREE(arr);
-    FREE(name);
-    return ret;
-}
-
-nbt_node_t *_nbt_parse(void *data, size_t size, nbt_node_t *root, int *pos) {
-    nbt_node_t *ret;
-    nbt_node_t *current_parent = NULL;
-    nbt_node_t *tmp;
-    nbt_tag_type_t type;
-    int islist;
-    int i;
+    if (flags & MCNBT_PARSE_LAZY) {
+        if (arena != NULL) {
+            p.src = _nbt_arena_alloc(arena, sizeof(_nbt_source_t));
+            ASSERT(p.src != NULL, return NULL);
+        } else {
+            MALLOC(p.src, sizeof(_nbt_source_t), return NULL);
+        }
 
-    if (root == NULL) {
-        ret = NULL;
+        p.src->data = p.data;
+        p.src->size = size;
+        p.src->arena = arena;
+        p.src->create = p.create;
+        p.src->refs = 1;
     } else {
-        ret = root;
-        current_parent = root;
+        /* malformed input is rejected before anything is allocated */
+        ASSERT(_nbt_scan_tree(p.data, size, &stats) == 0, return NULL);
+        if (arena != NULL) {
+            ASSERT(_nbt_node_reserve_tree(arena, &stats) == 0, return NULL);
+        }
+        p.checked = 1;
     }
 
-    if (pos == NULL) {
-        i = 0;
-    } else {
-        i = *pos;
+    ret = _parse_root(&p);
+
+    if (p.src != NULL) {
+        _nbt_source_unref(p.src);
     }
+    return ret;
+}
 
-    for (i; i < size; i++) {
-        type = (nbt_tag_type_t)((char *) data)[i];
-        i++;
-        if (nbt_node_get_type(current_parent) == MCNBT_TAG_LIST) {
-            islist = 1;
-        } else {
-            islist = 0;
-        }
+nbt_node_t *_nbt_parse(void *data, size_t size, nbt_arena_t *arena, int flags) {
+    int scope = _nbt_alloc_enter(MCNBT_ALLOC_PARSE);
+    nbt_node_t *ret = _parse_buffer(data, size, arena, flags);
+    _nbt_alloc_leave(scope);
+    return ret;
+}
 
-        switch (type) {
-            case MCNBT_TAG_BYTE:
-            case MCNBT_TAG_SHORT:
-            case MCNBT_TAG_INT:
-            case MCNBT_TAG_LONG:
-            case MCNBT_TAG_FLOAT:
-            case MCNBT_TAG_DOUBLE:
-                tmp = _nbt_parse_num(data, &i, type, islist);
-                nbt_node_append_child(current_parent, tmp);
-                break;
-            case MCNBT_TAG_COMPOUND:
-                if (ret == NULL) {
-                    ret = _nbt_parse_compound(data, &i, islist);
-                    current_parent = ret;
-                } else {
-                    tmp = _nbt_parse_compound(data, &i, islist);
-                    nbt_node_append_child(current_parent, tmp);
-                    current_parent = tmp;
-                }
-                break;
-            case MCNBT_TAG_LIST:
-                tmp = _nbt_parse_list(data, size, &i, islist);
-                nbt_node_append_child(current_parent, tmp);
-                break;
-            case MCNBT_TAG_BYTE_ARRAY:
-                tmp = _nbt_parse_byte_array(data, &i, islist);
-                nbt_node_append_child(current_parent, tmp);
-                i--;
-                break;
-            case MCNBT_TAG_STRING:
-                tmp = _nbt_parse_string(data, &i, islist);
-                nbt_node_append_child(current_parent, tmp);
-                break;
-            case MCNBT_TAG_INT_ARRAY:
-                tmp = _nbt_parse_int_array(data, &i, islist);
-                nbt_node_append_child(current_parent, tmp);
-                break;
-            case MCNBT_TAG_LONG_ARRAY:
-                tmp = _nbt_parse_long_array(data, &i, islist);
-                nbt_node_append_child(current_parent, tmp);
-                break;
-            case MCNBT_TAG_END:
-                current_parent = nbt_node_get_parent(current_parent);
-                i--;
-            default:
-                break;
-        }
+/** Parses a single payload that fills a buffer exactly
+ * @param data Serialized payload
+ * @param size Size of the payload
+ * @param type Type of the payload
+ * @param name Name to give the node, or NULL
+ * @param name_len Length of name
+ * @param arena Arena to allocate from, or NULL for the heap
+ * @return The parsed node or NULL
+ */
+nbt_node_t *_nbt_parse_value(const void *data, size_t size, nbt_tag_type_t type, const char *name, size_t name_len,
+                             nbt_arena_t *arena) {
+    _nbt_parser_t p;
+    size_t end = 0;
+
+    ASSERT(_nbt_skip_payload(data, size, &end, type, 0) == 0 && end == size, return NULL);
+
+    memset(&p, 0, sizeof(p));
+    p.data = data;
+    p.size = size;
+    p.arena = arena;
+    p.checked = 1;
+    return _parse_payload(&p, type, name, name_len);
+}
 
-        if (current_parent == NULL) {
-            break;
-        }
+/** Parses one level of children that were skipped by a lazy parse
+ * @param node Compound or list to fill
+ * @param src Buffer the tree was parsed from
+ * @param pos Offset of the payload of node
+ * @param len Length of the payload
+ * @return 0 on success, -1 on failure
+ */
+int _nbt_parse_children(nbt_node_t *node, _nbt_source_t *src, size_t pos, size_t len) {
+    _nbt_parser_t p;
+
+    memset(&p, 0, sizeof(p));
+    p.data = src->data;
+    p.size = pos + len;
+    p.pos = pos;
+    p.arena = src->arena;
+    p.create = src->create;
+    p.src = src;
+
+    /* the payload was validated when it was skipped */
+    p.checked = 1;
+
+    if (nbt_node_get_type(node) == MCNBT_TAG_LIST) {
+        return _parse_list(&p, node);
     }
+    return _parse_compound(&p, node);
+}
 
-    if (pos != NULL) {
-        *pos = i;
+void _nbt_source_unref(_nbt_source_t *src) {
+    if (REF_DEC(src->refs) == 0 && src->arena == NULL) {
+        FREE(src);
     }
+}
 
+/** Parses a tree while pulling its bytes from a reader
+ * @param read Function filling a buffer, returning 0 at the end and negative on error
+ * @param ctx Context passed to read
+ * @param arena Arena to allocate from, or NULL for the heap
+ * @return The parsed tree or NULL
+ */
+nbt_node_t *_nbt_parse_stream(_nbt_read_fn read, void *ctx, nbt_arena_t *arena) {
+    _nbt_parser_t p;
+    nbt_node_t *ret = NULL;
+    int scope = _nbt_alloc_enter(MCNBT_ALLOC_PARSE);
+
+    memset(&p, 0, sizeof(p));
+    p.arena = arena;
+    p.read = read;
+    p.read_ctx = ctx;
+    p.cap = STREAM_WINDOW;
+
+    MALLOC(p.window, p.cap, goto cleanup);
+    MALLOC(p.scratch, MAX_NAME, goto cleanup);
+    p.data = p.window;
+
+    /* only a window of the input is at hand, so there is no pre-scan: every
+     * field is checked as it arrives and nodes are allocated one at a time */
+    ret = _parse_root(&p);
+
+cleanup:
+    FREE(p.scratch);
+    FREE(p.window);
+    _nbt_alloc_leave(scope);
     return ret;
-}
\ No newline at end of file
+}
@@ -0,0 +1,627 @@
+/*
+ *  patch.c
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mcnbt.h"
+#include "scan.h"
+#include "stream.h"
+#include "tree.h"
+#include "util.h"
+
+/* A patch is kept in its wire format: the magic, then a sequence of
+ *   op (1 byte), path depth (2 bytes), path steps, value
+ * where a step is STEP_NAME with a 2-byte length and the name, or
+ * STEP_INDEX with a 4-byte list index. Set and insert carry the new value
+ * as a type byte and payload; a set of the root also carries its name.
+ * Numbers are big-endian as in NBT itself. */
+#define PATCH_MAGIC "NBTP"
+#define PATCH_MAGIC_LEN 4
+#define PATCH_MIN_CAP 256
+
+#define PATCH_SET 1
+#define PATCH_REMOVE 2
+#define PATCH_INSERT 3
+
+#define STEP_NAME 0
+#define STEP_INDEX 1
+
+struct _nbt_patch_t {
+    _nbt_out_t out;
+    size_t ops;
+};
+
+/* path from the root to the node being compared, already encoded */
+typedef struct _nbt_path_t {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+    unsigned int depth;
+} _nbt_path_t;
+
+typedef struct _nbt_differ_t {
+    nbt_patch_t *patch;
+    _nbt_path_t path;
+} _nbt_differ_t;
+
+static int _grow(_nbt_out_t *out) {
+    size_t used = (size_t) (out->pos - out->start);
+    size_t cap = (size_t) (out->end - out->start) * 2;
+    unsigned char *tmp = out->start;
+
+    REALLOC(tmp, cap, return -1);
+    out->start = tmp;
+    out->pos = tmp + used;
+    out->end = tmp + cap;
+    return 0;
+}
+
+static int _put(_nbt_out_t *out, const void *data, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    while ((size_t) (out->end - out->pos) < len) {
+        ASSERT(_grow(out) == 0, return -1);
+    }
+    memcpy(out->pos, data, len);
+    out->pos += len;
+    return 0;
+}
+
+static nbt_patch_t *_patch_new(void) {
+    nbt_patch_t *ret;
+    CALLOC(ret, 1, sizeof(nbt_patch_t), return NULL);
+    MALLOC(ret->out.start, PATCH_MIN_CAP, FREE(ret); return NULL);
+
+    ret->out.pos = ret->out.start;
+    ret->out.end = ret->out.start + PATCH_MIN_CAP;
+    ret->out.flush = _grow;
+    memcpy(ret->out.pos, PATCH_MAGIC, PATCH_MAGIC_LEN);
+    ret->out.pos += PATCH_MAGIC_LEN;
+    return ret;
+}
+
+/** Appends a step to the current path
+ * @param path Path to extend
+ * @param node Compound child being stepped into, or NULL for a list element
+ * @param index Position of the list element
+ * @return The length of the path before the step, to pass to _path_pop(), or -1 on failure
+ */
+static size_t _path_push(_nbt_path_t *path, nbt_node_t *node, size_t index) {
+    size_t ret = path->len;
+    const char *name = NULL;
+    size_t need, name_len = 0;
+    unsigned char *p;
+
+    if (node != NULL) {
+        name = nbt_node_get_name_view(node, &name_len);
+        ASSERT(name_len <= MAX_SHORT_LEN, return (size_t) -1);
+        need = 3 + name_len;
+    } else {
+        ASSERT(index <= UINT32_MAX, return (size_t) -1);
+        need = 5;
+    }
+
+    if (path->cap - path->len < need) {
+        size_t cap = path->cap ? path->cap * 2 : PATCH_MIN_CAP;
+        while (cap - path->len < need) {
+            cap *= 2;
+        }
+        REALLOC(path->data, cap, return (size_t) -1);
+        path->cap = cap;
+    }
+
+    p = path->data + path->len;
+    if (node != NULL) {
+        p[0] = STEP_NAME;
+        _nbt_put_be16(p + 1, (uint16_t) name_len);
+        memcpy(p + 3, name, name_len);
+    } else {
+        p[0] = STEP_INDEX;
+        _nbt_put_be32(p + 1, (uint32_t) index);
+    }
+    path->len += need;
+    path->depth++;
+    return ret;
+}
+
+static void _path_pop(_nbt_path_t *path, size_t len) {
+    path->len = len;
+    path->depth--;
+}
+
+/** Records one operation at the current path
+ * @param d Diff state
+ * @param op PATCH_SET, PATCH_REMOVE or PATCH_INSERT
+ * @param value New value for set and insert, NULL for remove
+ * @return 0 on success, -1 on failure
+ */
+static int _emit(_nbt_differ_t *d, int op, nbt_node_t *value) {
+    _nbt_out_t *out = &d->patch->out;
+    unsigned char head[3];
+    const char *name;
+    size_t name_len;
+
+    head[0] = (unsigned char) op;
+    _nbt_put_be16(head + 1, (uint16_t) d->path.depth);
+    ASSERT(_put(out, head, 3) == 0, return -1);
+    ASSERT(_put(out, d->path.data, d->path.len) == 0, return -1);
+
+    if (value != NULL) {
+        head[0] = (unsigned char) nbt_node_get_type(value);
+        ASSERT(_put(out, head, 1) == 0, return -1);
+
+        if (d->path.depth == 0) {
+            name = nbt_node_get_name_view(value, &name_len);
+            ASSERT(name_len <= MAX_SHORT_LEN, return -1);
+            _nbt_put_be16(head, (uint16_t) name_len);
+            ASSERT(_put(out, head, 2) == 0, return -1);
+            ASSERT(_put(out, name, name_len) == 0, return -1);
+        }
+        ASSERT(_nbt_write_payload(value, out) == 0, return -1);
+    }
+
+    d->patch->ops++;
+    return 0;
+}
+
+static int _diff(_nbt_differ_t *d, nbt_node_t *from, nbt_node_t *to);
+
+/** Checks that every child of a compound can be addressed by its name
+ * @param node Compound to check
+ * @return 1 if no two children share a name, 0 otherwise
+ */
+static int _names_unique(nbt_node_t *node) {
+    const char *name;
+    size_t len;
+
+    for (nbt_node_t *c = nbt_node_get_first_child(node); c; c = nbt_node_get_next_child(c)) {
+        name = nbt_node_get_name_view(c, &len);
+        if (_nbt_node_find_child_len(node, name, len) != c) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int _diff_compound(_nbt_differ_t *d, nbt_node_t *from, nbt_node_t *to) {
+    const char *name;
+    size_t len, mark;
+    nbt_node_t *match;
+
+    if (!_names_unique(from) || !_names_unique(to)) {
+        return _emit(d, PATCH_SET, to);
+    }
+
+    for (nbt_node_t *c = nbt_node_get_first_child(from); c; c = nbt_node_get_next_child(c)) {
+        name = nbt_node_get_name_view(c, &len);
+        match = _nbt_node_find_child_len(to, name, len);
+
+        ASSERT((mark = _path_push(&d->path, c, 0)) != (size_t) -1, return -1);
+        ASSERT((match != NULL ? _diff(d, c, match) : _emit(d, PATCH_REMOVE, NULL)) == 0, return -1);
+        _path_pop(&d->path, mark);
+    }
+
+    for (nbt_node_t *c = nbt_node_get_first_child(to); c; c = nbt_node_get_next_child(c)) {
+        name = nbt_node_get_name_view(c, &len);
+        if (_nbt_node_find_child_len(from, name, len) != NULL) {
+            continue;
+        }
+
+        ASSERT((mark = _path_push(&d->path, c, 0)) != (size_t) -1, return -1);
+        ASSERT(_emit(d, PATCH_SET, c) == 0, return -1);
+        _path_pop(&d->path, mark);
+    }
+    return 0;
+}
+
+/* elements are matched by position after trimming the common ends, which
+ * covers appends, removals at either end and edits in place */
+static int _diff_list(_nbt_differ_t *d, nbt_node_t *from, nbt_node_t *to) {
+    size_t nf = nbt_node_get_len(from), nt = nbt_node_get_len(to);
+    size_t min = nf < nt ? nf : nt;
+    size_t head = 0, tail = 0, common, mark;
+
+    while (head < min && nbt_node_equal(nbt_node_get_child_at(from, head), nbt_node_get_child_at(to, head))) {
+        head++;
+    }
+    while (tail < min - head && nbt_node_equal(nbt_node_get_child_at(from, nf - 1 - tail),
+                                               nbt_node_get_child_at(to, nt - 1 - tail))) {
+        tail++;
+    }
+
+    common = min - head - tail;
+    for (size_t i = head; i < head + common; i++) {
+        ASSERT((mark = _path_push(&d->path, NULL, i)) != (size_t) -1, return -1);
+        ASSERT(_diff(d, nbt_node_get_child_at(from, i), nbt_node_get_child_at(to, i)) == 0, return -1);
+        _path_pop(&d->path, mark);
+    }
+
+    /* surplus elements all sit at the same index as each removal shifts the rest */
+    for (size_t i = nt; i < nf; i++) {
+        ASSERT((mark = _path_push(&d->path, NULL, head + common)) != (size_t) -1, return -1);
+        ASSERT(_emit(d, PATCH_REMOVE, NULL) == 0, return -1);
+        _path_pop(&d->path, mark);
+    }
+    for (size_t i = head + common; i < nt - tail; i++) {
+        ASSERT((mark = _path_push(&d->path, NULL, i)) != (size_t) -1, return -1);
+        ASSERT(_emit(d, PATCH_INSERT, nbt_node_get_child_at(to, i)) == 0, return -1);
+        _path_pop(&d->path, mark);
+    }
+    return 0;
+}
+
+/** Records the operations turning one subtree into another at the current path
+ * @param d Diff state
+ * @param from Old subtree
+ * @param to New subtree, with the same name as from
+ * @return 0 on success, -1 on failure
+ */
+static int _diff(_nbt_differ_t *d, nbt_node_t *from, nbt_node_t *to) {
+    nbt_tag_type_t type = nbt_node_get_type(to);
+
+    /* differing hashes settle most subtrees; equal ones are confirmed, as a collision would lose a change */
+    if (nbt_node_equal(from, to)) {
+        return 0;
+    }
+
+    /* numbers and lists of numbers are cheaper to resend than to address piecewise */
+    if (type != nbt_node_get_type(from) || (type != MCNBT_TAG_COMPOUND && type != MCNBT_TAG_LIST)) {
+        return _emit(d, PATCH_SET, to);
+    }
+
+    if (type == MCNBT_TAG_COMPOUND) {
+        return _diff_compound(d, from, to);
+    }
+
+    if (nbt_node_get_list_type(from) != nbt_node_get_list_type(to) ||
+        _nbt_fixed_size(nbt_node_get_list_type(to)) != 0) {
+        return _emit(d, PATCH_SET, to);
+    }
+    return _diff_list(d, from, to);
+}
+
+nbt_patch_t *nbt_diff(nbt_node_t *from, nbt_node_t *to) {
+    _nbt_differ_t d;
+    const char *a, *b;
+    size_t alen, blen;
+    int r;
+
+    ASSERT(from != NULL && to != NULL, return NULL);
+
+    memset(&d, 0, sizeof(d));
+    d.patch = _patch_new();
+    ASSERT(d.patch != NULL, return NULL);
+
+    a = nbt_node_get_name_view(from, &alen);
+    b = nbt_node_get_name_view(to, &blen);
+    if (alen != blen || memcmp(a, b, alen) != 0) {
+        r = _emit(&d, PATCH_SET, to);
+    } else {
+        r = _diff(&d, from, to);
+    }
+
+    FREE(d.path.data);
+    ASSERT(r == 0, nbt_patch_free(d.patch); return NULL);
+    return d.patch;
+}
+
+/* a decoded path step */
+typedef struct _nbt_step_t {
+    const char *name;
+    size_t name_len;
+    size_t index;
+} _nbt_step_t;
+
+typedef struct _nbt_op_t {
+    int op;
+    const unsigned char *path;
+    unsigned int depth;
+
+    /* value of set and insert */
+    nbt_tag_type_t type;
+    const char *name;
+    size_t name_len;
+    const unsigned char *value;
+    size_t value_len;
+} _nbt_op_t;
+
+/** Reads one path step
+ * @param data Patch data
+ * @param size Size of data
+ * @param pos Offset of the step, advanced past it
+ * @param step Filled with the step; may be NULL to only check it
+ * @return 0 on success, -1 if the step is malformed
+ */
+static int _read_step(const unsigned char *data, size_t size, size_t *pos, _nbt_step_t *step) {
+    size_t p = *pos;
+    size_t len;
+
+    ASSERT(size - p >= 1, return -1);
+    if (data[p] == STEP_INDEX) {
+        ASSERT(size - p >= 5, return -1);
+        if (step != NULL) {
+            step->name = NULL;
+            step->index = _nbt_be32(data + p + 1);
+        }
+        *pos = p + 5;
+        return 0;
+    }
+
+    ASSERT(data[p] == STEP_NAME && size - p >= 3, return -1);
+    len = _nbt_be16(data + p + 1);
+    ASSERT(size - p - 3 >= len, return -1);
+    if (step != NULL) {
+        step->name = (const char *) data + p + 3;
+        step->name_len = len;
+    }
+    *pos = p + 3 + len;
+    return 0;
+}
+
+/** Decodes and checks the framing of one operation
+ * @param data Patch data
+ * @param size Size of data
+ * @param pos Offset of the operation, advanced past it
+ * @param op Filled with the operation
+ * @return 0 on success, -1 if the operation is malformed
+ */
+static int _read_op(const unsigned char *data, size_t size, size_t *pos, _nbt_op_t *op) {
+    size_t p = *pos;
+    size_t start;
+
+    ASSERT(size - p >= 3, return -1);
+    op->op = data[p];
+    op->depth = _nbt_be16(data + p + 1);
+    p += 3;
+    ASSERT(op->op == PATCH_SET || op->op == PATCH_REMOVE || op->op == PATCH_INSERT, return -1);
+    ASSERT(op->op == PATCH_SET || op->depth > 0, return -1);
+
+    op->path = data + p;
+    for (unsigned int i = 0; i < op->depth; i++) {
+        ASSERT(_read_step(data, size, &p, NULL) == 0, return -1);
+    }
+
+    op->name = NULL;
+    op->name_len = 0;
+    if (op->op != PATCH_REMOVE) {
+        ASSERT(size - p >= 1, return -1);
+        op->type = (nbt_tag_type_t) data[p++];
+
+        if (op->depth == 0) {
+            ASSERT(size - p >= 2, return -1);
+            op->name_len = _nbt_be16(data + p);
+            ASSERT(size - p - 2 >= op->name_len, return -1);
+            op->name = (const char *) data + p + 2;
+            p += 2 + op->name_len;
+        }
+
+        start = p;
+        ASSERT(_nbt_skip_payload(data, size, &p, op->type, 0) == 0, return -1);
+        op->value = data + start;
+        op->value_len = p - start;
+    }
+
+    *pos = p;
+    return 0;
+}
+
+/* what an applied operation changed, so a failing patch can be rolled back */
+typedef struct _nbt_undo_t {
+    int op;
+    /* NULL when the operation set the root */
+    nbt_node_t *parent;
+    /* node replaced or removed, freed once the whole patch has applied */
+    nbt_node_t *old;
+    /* sibling a removed node sat in front of, NULL if it was the last child */
+    nbt_node_t *next;
+    /* node the operation added */
+    nbt_node_t *value;
+} _nbt_undo_t;
+
+typedef struct _nbt_undo_log_t {
+    _nbt_undo_t *entries;
+    size_t count;
+    size_t cap;
+} _nbt_undo_log_t;
+
+/** Carries out one operation
+ * @param root Root of the tree; replaced, but not freed, when the operation sets the root
+ * @param op Operation to apply
+ * @param undo Filled in with what the operation changed
+ * @return 0 on success, -1 if the tree does not have the shape the patch expects
+ */
+static int _apply_op(nbt_node_t **root, const _nbt_op_t *op, _nbt_undo_t *undo) {
+    nbt_node_t *parent = NULL, *node = *root, *value = NULL;
+    _nbt_step_t step;
+    size_t pos = 0;
+
+    memset(&step, 0, sizeof(step));
+    for (unsigned int i = 0; i < op->depth; i++) {
+        /* the framing was checked by _read_op() */
+        ASSERT(_read_step(op->path, (size_t) -1, &pos, &step) == 0, return -1);
+        parent = node;
+
+        if (step.name != NULL) {
+            ASSERT(nbt_node_get_type(parent) == MCNBT_TAG_COMPOUND, return -1);
+            node = _nbt_node_find_child_len(parent, step.name, step.name_len);
+        } else {
+            ASSERT(nbt_node_get_type(parent) == MCNBT_TAG_LIST, return -1);
+            node = step.index < nbt_node_get_len(parent) ? nbt_node_get_child_at(parent, step.index) : NULL;
+        }
+
+        /* only the last step may name a child that does not exist yet */
+        ASSERT(node != NULL || (i + 1 == op->depth && op->op != PATCH_REMOVE), return -1);
+    }
+
+    if (op->op != PATCH_REMOVE) {
+        value = _nbt_parse_value(op->value, op->value_len, op->type,
+                                 op->depth == 0 ? op->name : step.name,
+                                 op->depth == 0 ? op->name_len : step.name != NULL ? step.name_len : 0,
+                                 _nbt_node_get_arena(parent != NULL ? parent : *root));
+        ASSERT(value != NULL, return -1);
+    }
+
+    memset(undo, 0, sizeof(*undo));
+    undo->op = op->op;
+    undo->parent = parent;
+    undo->value = value;
+
+    switch (op->op) {
+        case PATCH_SET:
+            if (parent == NULL) {
+                undo->old = *root;
+                *root = value;
+                return 0;
+            }
+            if (node == NULL) {
+                ASSERT(step.name != NULL && nbt_node_append_child(parent, value) == 0, goto fail);
+                return 0;
+            }
+            ASSERT(nbt_node_replace(node, value) == 0, goto fail);
+            undo->old = node;
+            return 0;
+        case PATCH_REMOVE:
+            undo->next = nbt_node_get_next_child(node);
+            ASSERT(nbt_node_unlink(node) == 0, return -1);
+            undo->old = node;
+            return 0;
+        case PATCH_INSERT:
+            ASSERT(step.name == NULL, goto fail);
+            if (node == NULL) {
+                ASSERT(step.index == nbt_node_get_len(parent) && nbt_node_append_child(parent, value) == 0, goto fail);
+                return 0;
+            }
+            ASSERT(nbt_node_insert_before(node, value) == 0, goto fail);
+            return 0;
+        default:
+            break;
+    }
+
+fail:
+    nbt_node_free(value);
+    return -1;
+}
+
+/** Reverts one applied operation; done newest first, every sibling is back where it was
+ * @param root Root of the tree, restored when the operation set it
+ * @param undo What the operation changed
+ */
+static void _undo_op(nbt_node_t **root, const _nbt_undo_t *undo) {
+    if (undo->op == PATCH_REMOVE) {
+        if (undo->next != NULL) {
+            nbt_node_insert_before(undo->next, undo->old);
+        } else {
+            nbt_node_append_child(undo->parent, undo->old);
+        }
+        return;
+    }
+
+    if (undo->parent == NULL) {
+        *root = undo->old;
+    } else if (undo->old != NULL) {
+        nbt_node_replace(undo->value, undo->old);
+    } else {
+        nbt_node_unlink(undo->value);
+    }
+    nbt_node_free(undo->value);
+}
+
+nbt_node_t *nbt_patch_apply(nbt_node_t *tree, const nbt_patch_t *patch) {
+    const unsigned char *data;
+    size_t size, pos = PATCH_MAGIC_LEN;
+    nbt_node_t *root = tree;
+    _nbt_undo_log_t log;
+    _nbt_op_t op;
+    int r = 0;
+
+    ASSERT(tree != NULL && patch != NULL, return NULL);
+    data = patch->out.start;
+    size = (size_t) (patch->out.pos - patch->out.start);
+    memset(&log, 0, sizeof(log));
+
+    while (r == 0 && pos < size) {
+        if (log.count == log.cap) {
+            size_t cap = log.cap ? log.cap * 2 : 16;
+            REALLOC(log.entries, cap * sizeof(_nbt_undo_t), r = -1; break);
+            log.cap = cap;
+        }
+
+        r = _read_op(data, size, &pos, &op) == 0 ? _apply_op(&root, &op, &log.entries[log.count]) : -1;
+        if (r == 0) {
+            log.count++;
+        }
+    }
+
+    /* a patch applies completely or not at all */
+    if (r != 0) {
+        while (log.count > 0) {
+            _undo_op(&root, &log.entries[--log.count]);
+        }
+        FREE(log.entries);
+        return NULL;
+    }
+
+    /* the caller's root is among these if the patch replaced it */
+    for (size_t i = 0; i < log.count; i++) {
+        if (log.entries[i].old != NULL) {
+            nbt_node_free(log.entries[i].old);
+        }
+    }
+    FREE(log.entries);
+    return root;
+}
+
+const void *nbt_patch_get_data(const nbt_patch_t *patch, size_t *len) {
+    ASSERT(patch != NULL, return NULL);
+    *len = (size_t) (patch->out.pos - patch->out.start);
+    return patch->out.start;
+}
+
+nbt_patch_t *nbt_patch_load(const void *data, size_t len) {
+    nbt_patch_t *ret;
+    size_t pos = PATCH_MAGIC_LEN;
+    _nbt_op_t op;
+
+    ASSERT(data != NULL, return NULL);
+    ASSERT(len >= PATCH_MAGIC_LEN && memcmp(data, PATCH_MAGIC, PATCH_MAGIC_LEN) == 0, return NULL);
+
+    ret = _patch_new();
+    ASSERT(ret != NULL, return NULL);
+    ASSERT(_put(&ret->out, (const char *) data + PATCH_MAGIC_LEN, len - PATCH_MAGIC_LEN) == 0,
+           nbt_patch_free(ret); return NULL);
+
+    /* every operation is checked here so that apply only meets well-formed ones */
+    while (pos < len) {
+        ASSERT(_read_op(ret->out.start, len, &pos, &op) == 0, nbt_patch_free(ret); return NULL);
+        ret->ops++;
+    }
+    return ret;
+}
+
+size_t nbt_patch_count_ops(const nbt_patch_t *patch) {
+    ASSERT(patch != NULL, return 0);
+    return patch->ops;
+}
+
+void nbt_patch_free(nbt_patch_t *patch) {
+    ASSERT(patch != NULL, return);
+    FREE(patch->out.start);
+    FREE(patch);
+}
@@ -0,0 +1,637 @@
+/*
+ *  pool.c
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Every worker owns a range of chunk indices within one region and eats
+ * it from the front. A worker that runs dry steals the back half of the
+ * largest range it can find, and only opens the next region once there
+ * is nothing left to steal, so all threads tend to work on the same few
+ * regions at a time.
+ *
+ * In ordered mode finished chunks are parked in their region's result
+ * table and handed to the callback strictly in region order, then file
+ * order within a region. Whichever worker finds the next result ready
+ * delivers it, so the callback never runs on two threads at once. At most
+ * ORDERED_WINDOW chunks per thread may be taken and not yet delivered; a
+ * worker past that waits, unless its chunk is the next one due.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "mcnbt.h"
+#include "region.h"
+#include "tree.h"
+#include "util.h"
+
+#define INFLATE_BUFFER 1048576
+#define ORDERED_WINDOW 4
+
+typedef struct _pool_result_t {
+    nbt_node_t *tree;
+    nbt_arena_t *arena;
+    int x;
+    int z;
+    int ready;
+} _pool_result_t;
+
+typedef struct _pool_region_t {
+    nbt_region_t *region;
+    size_t count;
+    int opened;
+
+    /* chunks not finished yet; the region is closed when this reaches 0 */
+    size_t pending;
+
+    /* ordered mode only */
+    _pool_result_t *results;
+    size_t delivered;
+} _pool_region_t;
+
+struct _nbt_pool_t;
+
+typedef struct _pool_worker_t {
+    struct _nbt_pool_t *pool;
+    size_t id;
+    pthread_t thread;
+
+    /* the range of chunks this worker still has to do; guarded by lock */
+    pthread_mutex_t lock;
+    size_t region;
+    size_t begin;
+    size_t end;
+
+    /* decoder state reused from chunk to chunk */
+    z_stream z;
+    unsigned char *buf;
+    size_t cap;
+    nbt_arena_t *arena;
+    int stop;
+} _pool_worker_t;
+
+typedef struct _nbt_pool_t {
+    const char *const *filenames;
+    size_t count;
+    _pool_region_t *regions;
+    _pool_worker_t *workers;
+    size_t threads;
+    nbt_chunk_fn fn;
+    void *userdata;
+    int flags;
+
+    /* guards everything below as well as the region table */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t next_region;
+    size_t opening;
+    int stop;
+    int ret;
+
+    /* ordered mode: next region to deliver, chunks taken and not delivered
+     * yet, and arenas free for reuse */
+    size_t head;
+    size_t in_flight;
+    int delivering;
+    nbt_arena_t **free_arenas;
+    size_t free_count;
+    size_t free_cap;
+} _nbt_pool_t;
+
+static ssize_t _inflate_chunk(_pool_worker_t *w, const unsigned char *data, size_t len) {
+    size_t n = 0;
+    int r;
+
+    ASSERT(inflateReset(&w->z) == Z_OK, return -1);
+    w->z.next_in = (unsigned char *) data;
+    w->z.avail_in = (uInt) len;
+
+    for (;;) {
+        if (n == w->cap) {
+            REALLOC(w->buf, w->cap * 2, return -1);
+            w->cap *= 2;
+        }
+
+        w->z.next_out = w->buf + n;
+        w->z.avail_out = (uInt) (w->cap - n);
+        r = inflate(&w->z, Z_NO_FLUSH);
+        n = w->cap - w->z.avail_out;
+
+        if (r == Z_STREAM_END) {
+            return (ssize_t) n;
+        }
+
+        /* running out of input before the end means the chunk is truncated */
+        ASSERT(r == Z_OK || (r == Z_BUF_ERROR && w->z.avail_out == 0), return -1);
+    }
+}
+
+static nbt_node_t *_decode(_pool_worker_t *w, nbt_region_t *region, int x, int z, nbt_arena_t *arena) {
+    const unsigned char *data;
+    size_t len;
+    ssize_t n;
+    int type;
+
+    ASSERT(_nbt_region_get_raw(region, x, z, &data, &len, &type) == 0, return NULL);
+
+    /* the mapping outlives delivery in either mode */
+    if (type == REGION_NONE) {
+        return _nbt_parse((void *) data, len, arena, MCNBT_PARSE_BORROW);
+    }
+    ASSERT(type == REGION_GZIP || type == REGION_ZLIB, return NULL);
+
+    n = _inflate_chunk(w, data, len);
+    ASSERT(n >= 0, return NULL);
+
+    /* the inflate buffer is reused for the next chunk, so only an unordered
+     * tree, which is gone once the callback returns, may point into it */
+    return _nbt_parse(w->buf, (size_t) n, arena, (w->pool->flags & MCNBT_POOL_ORDERED) ? 0 : MCNBT_PARSE_BORROW);
+}
+
+static void _deliver(_nbt_pool_t *pool);
+
+/** Opens the next region nobody has started on yet
+ * @param w Worker asking for work
+ * @param region Set to the index of the region
+ * @return 1 if a region with chunks was opened, 0 if there are none left, -1 to try again
+ */
+static int _open_next(_pool_worker_t *w, size_t *region) {
+    _nbt_pool_t *pool = w->pool;
+    _pool_region_t *r;
+    nbt_region_t *handle;
+    size_t count = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stop || pool->next_region == pool->count) {
+        /* somebody still opening a region may yet have something to steal */
+        if (!pool->stop && pool->opening > 0) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            pthread_mutex_unlock(&pool->lock);
+            return -1;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+    }
+    *region = pool->next_region++;
+    pool->opening++;
+    pthread_mutex_unlock(&pool->lock);
+
+    handle = nbt_region_open(pool->filenames[*region]);
+    if (handle != NULL) {
+        count = nbt_region_count_chunks(handle);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    r = &pool->regions[*region];
+    r->region = handle;
+    r->count = count;
+    r->pending = count;
+    if (count > 0 && (pool->flags & MCNBT_POOL_ORDERED)) {
+        CALLOC(r->results, count, sizeof(_pool_result_t), r->count = 0; r->pending = 0);
+    }
+    if (r->count == 0 && handle != NULL) {
+        nbt_region_close(handle);
+        r->region = NULL;
+    }
+    r->opened = 1;
+
+    /* results parked behind a region that turned out empty are due now */
+    if (pool->flags & MCNBT_POOL_ORDERED) {
+        _deliver(pool);
+    }
+
+    if (r->count > 0) {
+        pthread_mutex_lock(&w->lock);
+        w->region = *region;
+        w->begin = 0;
+        w->end = r->count;
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    pool->opening--;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return r->count > 0 ? 1 : -1;
+}
+
+/** Makes room for one more chunk between decoding and delivery in ordered mode
+ * @param pool Pool
+ * @param region Region of the chunk
+ * @param i Index of the chunk in the region's file order
+ * @param wait Whether to wait for room or give up at once
+ * @return 0 once there is room, -1 if there is none and wait is 0
+ */
+static int _window_enter(_nbt_pool_t *pool, size_t region, size_t i, int wait) {
+    if (!(pool->flags & MCNBT_POOL_ORDERED)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+
+    /* the chunk due next always gets in, or nothing would ever be delivered */
+    while (!pool->stop && pool->in_flight >= pool->threads * ORDERED_WINDOW &&
+           !(region == pool->head && i == pool->regions[region].delivered)) {
+        if (!wait) {
+            pthread_mutex_unlock(&pool->lock);
+            return -1;
+        }
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    pool->in_flight++;
+
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+static void _window_leave(_nbt_pool_t *pool) {
+    if (!(pool->flags & MCNBT_POOL_ORDERED)) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->in_flight--;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* waits for a delivery, or anything else that may have made room */
+static void _window_wait(_nbt_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->stop && pool->in_flight >= pool->threads * ORDERED_WINDOW) {
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/** Picks the next chunk for a worker, stealing or opening a region when its own range is empty
+ * @param w Worker asking for work
+ * @param region Set to the index of the region
+ * @param i Set to the index of the chunk in the region's file order
+ * @return 1 if there is a chunk to do, 0 when all work is done
+ */
+static int _take(_pool_worker_t *w, size_t *region, size_t *i) {
+    _nbt_pool_t *pool = w->pool;
+
+    for (;;) {
+        _pool_worker_t *victim = NULL;
+        size_t best = 1;
+        int r;
+
+        pthread_mutex_lock(&w->lock);
+        if (w->begin < w->end) {
+            *region = w->region;
+            *i = w->begin;
+            pthread_mutex_unlock(&w->lock);
+
+            /* thieves only take the back half, so the front stays ours while we wait */
+            _window_enter(pool, *region, *i, 1);
+
+            pthread_mutex_lock(&w->lock);
+            w->begin++;
+            pthread_mutex_unlock(&w->lock);
+            return 1;
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        if (w->stop) {
+            return 0;
+        }
+
+        /* only one worker lock is ever held at a time */
+        for (size_t k = 1; k < pool->threads; k++) {
+            _pool_worker_t *v = &pool->workers[(w->id + k) % pool->threads];
+            pthread_mutex_lock(&v->lock);
+            if (v->end - v->begin > best) {
+                best = v->end - v->begin;
+                victim = v;
+            }
+            pthread_mutex_unlock(&v->lock);
+        }
+
+        if (victim != NULL) {
+            size_t reg, mid, end;
+
+            pthread_mutex_lock(&victim->lock);
+            if (victim->end - victim->begin < 2) {
+                pthread_mutex_unlock(&victim->lock);
+                continue;
+            }
+            reg = victim->region;
+            end = victim->end;
+            mid = victim->begin + (victim->end - victim->begin) / 2;
+            pthread_mutex_unlock(&victim->lock);
+
+            /* a stolen chunk is never the one due next, so a full window means waiting empty-handed */
+            if (_window_enter(pool, reg, mid, 0) != 0) {
+                _window_wait(pool);
+                continue;
+            }
+
+            pthread_mutex_lock(&victim->lock);
+            if (victim->region != reg || victim->end != end || victim->begin >= mid) {
+                pthread_mutex_unlock(&victim->lock);
+                _window_leave(pool);
+                continue;
+            }
+            victim->end = mid;
+            pthread_mutex_unlock(&victim->lock);
+
+            pthread_mutex_lock(&w->lock);
+            w->region = reg;
+            w->begin = mid + 1;
+            w->end = end;
+            pthread_mutex_unlock(&w->lock);
+
+            *region = reg;
+            *i = mid;
+            return 1;
+        }
+
+        r = _open_next(w, region);
+        if (r == 0) {
+            return 0;
+        }
+    }
+}
+
+static nbt_arena_t *_get_arena(_nbt_pool_t *pool) {
+    nbt_arena_t *ret = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_count > 0) {
+        ret = pool->free_arenas[--pool->free_count];
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return ret != NULL ? ret : nbt_arena_new(0, 0);
+}
+
+/* called with the pool lock held */
+static void _put_arena(_nbt_pool_t *pool, nbt_arena_t *arena) {
+    if (arena == NULL) {
+        return;
+    }
+
+    if (pool->free_count == pool->free_cap) {
+        size_t cap = pool->free_cap ? pool->free_cap * 2 : pool->threads * 2;
+        REALLOC(pool->free_arenas, cap * sizeof(nbt_arena_t *), nbt_arena_free(arena); return);
+        pool->free_cap = cap;
+    }
+
+    nbt_arena_reset(arena);
+    pool->free_arenas[pool->free_count++] = arena;
+}
+
+/* called with the pool lock held; drops it while the callback runs */
+static void _deliver(_nbt_pool_t *pool) {
+    if (pool->delivering) {
+        return;
+    }
+    pool->delivering = 1;
+
+    while (pool->head < pool->count) {
+        _pool_region_t *r = &pool->regions[pool->head];
+        _pool_result_t *res;
+        int ret = 0;
+
+        if (!r->opened) {
+            break;
+        }
+
+        if (r->delivered == r->count) {
+            if (r->region != NULL) {
+                nbt_region_close(r->region);
+                r->region = NULL;
+            }
+            FREE(r->results);
+            pool->head++;
+            pthread_cond_broadcast(&pool->cond);
+            continue;
+        }
+
+        res = &r->results[r->delivered];
+        if (!res->ready) {
+            break;
+        }
+
+        if (!pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            ret = pool->fn(pool->userdata, pool->head, res->x, res->z, res->tree);
+            pthread_mutex_lock(&pool->lock);
+
+            if (ret != 0 && !pool->stop) {
+                pool->stop = 1;
+                pool->ret = ret;
+            }
+        }
+
+        _put_arena(pool, res->arena);
+        res->arena = NULL;
+        res->tree = NULL;
+        r->delivered++;
+        pool->in_flight--;
+        pthread_cond_broadcast(&pool->cond);
+    }
+
+    pool->delivering = 0;
+}
+
+static void _finish(_pool_worker_t *w, size_t region, size_t i, int x, int z, nbt_node_t *tree,
+                    nbt_arena_t *arena) {
+    _nbt_pool_t *pool = w->pool;
+    _pool_region_t *r = &pool->regions[region];
+    nbt_region_t *done = NULL;
+    int ret = 0;
+
+    if (pool->flags & MCNBT_POOL_ORDERED) {
+        pthread_mutex_lock(&pool->lock);
+        r->results[i].tree = tree;
+        r->results[i].arena = arena;
+        r->results[i].x = x;
+        r->results[i].z = z;
+        r->results[i].ready = 1;
+        _deliver(pool);
+        w->stop = pool->stop;
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+
+    if (!w->stop) {
+        ret = pool->fn(pool->userdata, region, x, z, tree);
+    }
+    nbt_arena_reset(arena);
+
+    pthread_mutex_lock(&pool->lock);
+    if (ret != 0 && !pool->stop) {
+        pool->stop = 1;
+        pool->ret = ret;
+    }
+    if (--r->pending == 0) {
+        done = r->region;
+        r->region = NULL;
+    }
+    w->stop = pool->stop;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (done != NULL) {
+        nbt_region_close(done);
+    }
+}
+
+static void *_worker(void *arg) {
+    _pool_worker_t *w = arg;
+    _nbt_pool_t *pool = w->pool;
+    size_t region, i;
+
+    while (_take(w, &region, &i)) {
+        nbt_region_t *handle = pool->regions[region].region;
+        nbt_arena_t *arena;
+        nbt_node_t *tree = NULL;
+        int x = 0, z = 0;
+
+        arena = (pool->flags & MCNBT_POOL_ORDERED) ? _get_arena(pool) : w->arena;
+        nbt_region_get_chunk_pos(handle, i, &x, &z);
+
+        /* damaged chunks are still delivered, as NULL */
+        if (arena != NULL && !w->stop) {
+            tree = _decode(w, handle, x, z, arena);
+        }
+        _finish(w, region, i, x, z, tree, arena);
+    }
+
+    return NULL;
+}
+
+static int _worker_init(_nbt_pool_t *pool, size_t id) {
+    _pool_worker_t *w = &pool->workers[id];
+
+    w->pool = pool;
+    w->id = id;
+    w->cap = INFLATE_BUFFER;
+    ASSERT(pthread_mutex_init(&w->lock, NULL) == 0, return -1);
+
+    /* 32 on top of the window bits lets zlib detect either wrapper */
+    w->z.zalloc = _nbt_zalloc;
+    w->z.zfree = _nbt_zfree;
+    ASSERT(inflateInit2(&w->z, 15 + 32) == Z_OK, return -1);
+    MALLOC(w->buf, w->cap, return -1);
+
+    if (!(pool->flags & MCNBT_POOL_ORDERED)) {
+        w->arena = nbt_arena_new(0, 0);
+        ASSERT(w->arena != NULL, return -1);
+    }
+    return 0;
+}
+
+static void _worker_cleanup(_pool_worker_t *w) {
+    if (w->pool == NULL) {
+        return;
+    }
+
+    inflateEnd(&w->z);
+    FREE(w->buf);
+    if (w->arena != NULL) {
+        nbt_arena_free(w->arena);
+    }
+    pthread_mutex_destroy(&w->lock);
+}
+
+int nbt_region_process(const char *const *filenames, size_t count, size_t threads, int flags, nbt_chunk_fn fn,
+                       void *userdata) {
+    _nbt_pool_t pool;
+    size_t started = 0;
+    int ret = -1;
+
+    ASSERT(filenames != NULL || count == 0, return -1);
+    ASSERT(fn != NULL, return -1);
+
+    if (threads == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? (size_t) n : 1;
+    }
+
+    memset(&pool, 0, sizeof(pool));
+    pool.filenames = filenames;
+    pool.count = count;
+    pool.threads = threads;
+    pool.fn = fn;
+    pool.userdata = userdata;
+    pool.flags = flags;
+
+    CALLOC(pool.regions, count ? count : 1, sizeof(_pool_region_t), return -1);
+    CALLOC(pool.workers, threads, sizeof(_pool_worker_t), FREE(pool.regions); return -1);
+    ASSERT(pthread_mutex_init(&pool.lock, NULL) == 0, goto cleanup);
+    ASSERT(pthread_cond_init(&pool.cond, NULL) == 0, pthread_mutex_destroy(&pool.lock); goto cleanup);
+
+    for (size_t i = 0; i < threads; i++) {
+        ASSERT(_worker_init(&pool, i) == 0, goto join);
+    }
+
+    for (; started < threads; started++) {
+        ASSERT(pthread_create(&pool.workers[started].thread, NULL, _worker, &pool.workers[started]) == 0, break);
+    }
+    ret = started > 0 ? 0 : -1;
+
+join:
+    /* without a thread to run them the remaining workers just find nothing to do */
+    if (started == 0) {
+        pthread_mutex_lock(&pool.lock);
+        pool.stop = 1;
+        pthread_mutex_unlock(&pool.lock);
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+    if (ret == 0) {
+        ret = pool.ret;
+    }
+
+    /* a stop leaves regions open and results undelivered */
+    for (size_t i = 0; i < count; i++) {
+        _pool_region_t *r = &pool.regions[i];
+        if (r->results != NULL) {
+            for (size_t j = r->delivered; j < r->count; j++) {
+                if (r->results[j].arena != NULL) {
+                    nbt_arena_free(r->results[j].arena);
+                }
+            }
+            FREE(r->results);
+        }
+        if (r->region != NULL) {
+            nbt_region_close(r->region);
+        }
+    }
+    for (size_t i = 0; i < pool.free_count; i++) {
+        nbt_arena_free(pool.free_arenas[i]);
+    }
+    FREE(pool.free_arenas);
+
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+
+cleanup:
+    for (size_t i = 0; i < threads; i++) {
+        _worker_cleanup(&pool.workers[i]);
+    }
+    FREE(pool.workers);
+    FREE(pool.regions);
+    return ret;
+}
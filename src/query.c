@@ -0,0 +1,467 @@
+/*
+ *  query.c
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+/* Path syntax:
+ *
+ *   Level.Sections[*].Y
+ *   Entities[?id=="minecraft:zombie"].Pos[1]
+ *   "name.with.dots"[0]
+ *
+ * A name selects a child of a compound, [*] every child of a list or
+ * compound, [N] one element of a list, and [?key==literal] (or !=) the
+ * compound elements of a list whose key matches a string or number. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mcnbt.h"
+#include "scan.h"
+#include "util.h"
+
+typedef enum _step_kind_t {
+    STEP_CHILD,
+    STEP_ALL,
+    STEP_INDEX,
+    STEP_FILTER,
+} _step_kind_t;
+
+typedef struct _nbt_query_step_t {
+    _step_kind_t kind;
+    char *name;
+    size_t name_len;
+    size_t index;
+
+    /* filters */
+    int negate;
+    int is_string;
+    char *str;
+    size_t str_len;
+    double num;
+} _nbt_query_step_t;
+
+struct _nbt_query_t {
+    _nbt_query_step_t *steps;
+    size_t num_steps;
+};
+
+typedef struct _nbt_query_run_t {
+    nbt_query_t *q;
+    const unsigned char *data;
+    size_t size;
+    nbt_query_fn callback;
+    void *userdata;
+} _nbt_query_run_t;
+
+static _nbt_query_step_t *_add_step(nbt_query_t *q, _step_kind_t kind) {
+    _nbt_query_step_t *ret;
+
+    REALLOC(q->steps, (q->num_steps + 1) * sizeof(_nbt_query_step_t), return NULL);
+    ret = &q->steps[q->num_steps++];
+    memset(ret, 0, sizeof(_nbt_query_step_t));
+    ret->kind = kind;
+    return ret;
+}
+
+/* reads a bare or quoted identifier, returning a copy */
+static char *_parse_ident(const char **path, size_t *len) {
+    const char *s = *path;
+    const char *start;
+    char *ret;
+
+    if (*s == '"') {
+        start = ++s;
+        while (*s != '\0' && *s != '"') {
+            s++;
+        }
+        ASSERT(*s == '"', return NULL);
+        *len = (size_t) (s - start);
+        s++;
+    } else {
+        start = s;
+        while (*s != '\0' && *s != '.' && *s != '[' && *s != ']' && *s != '=' && *s != '!') {
+            s++;
+        }
+        *len = (size_t) (s - start);
+    }
+
+    MALLOC(ret, *len + 1, return NULL);
+    memcpy(ret, start, *len);
+    ret[*len] = '\0';
+    *path = s;
+    return ret;
+}
+
+static int _parse_selector(nbt_query_t *q, const char **path) {
+    const char *s = *path + 1;
+    _nbt_query_step_t *step;
+    char *end;
+
+    if (*s == '*') {
+        ASSERT(_add_step(q, STEP_ALL) != NULL, return -1);
+        s++;
+    } else if (*s == '?') {
+        s++;
+        ASSERT((step = _add_step(q, STEP_FILTER)) != NULL, return -1);
+        step->name = _parse_ident(&s, &step->name_len);
+        ASSERT(step->name != NULL && step->name_len > 0, return -1);
+
+        if (s[0] == '=' && s[1] == '=') {
+            step->negate = 0;
+        } else if (s[0] == '!' && s[1] == '=') {
+            step->negate = 1;
+        } else {
+            return -1;
+        }
+        s += 2;
+
+        if (*s == '"') {
+            step->is_string = 1;
+            step->str = _parse_ident(&s, &step->str_len);
+            ASSERT(step->str != NULL, return -1);
+        } else {
+            step->num = strtod(s, &end);
+            ASSERT(end != s, return -1);
+            s = end;
+        }
+    } else {
+        ASSERT((step = _add_step(q, STEP_INDEX)) != NULL, return -1);
+        step->index = strtoul(s, &end, 10);
+        ASSERT(end != s, return -1);
+        s = end;
+    }
+
+    ASSERT(*s == ']', return -1);
+    *path = s + 1;
+    return 0;
+}
+
+nbt_query_t *nbt_query_compile(const char *path) {
+    nbt_query_t *ret;
+    _nbt_query_step_t *step;
+    const char *s = path;
+
+    ASSERT(path != NULL, return NULL);
+    CALLOC(ret, 1, sizeof(nbt_query_t), return NULL);
+
+    while (*s != '\0') {
+        if (*s != '[') {
+            ASSERT(*s != '.', goto fail);
+            ASSERT((step = _add_step(ret, STEP_CHILD)) != NULL, goto fail);
+            step->name = _parse_ident(&s, &step->name_len);
+            ASSERT(step->name != NULL, goto fail);
+        }
+
+        while (*s == '[') {
+            ASSERT(_parse_selector(ret, &s) == 0, goto fail);
+        }
+
+        if (*s == '.') {
+            s++;
+            ASSERT(*s != '\0', goto fail);
+        } else {
+            ASSERT(*s == '\0', goto fail);
+        }
+    }
+
+    return ret;
+
+fail:
+    nbt_query_free(ret);
+    return NULL;
+}
+
+void nbt_query_free(nbt_query_t *query) {
+    ASSERT(query != NULL, return);
+
+    for (size_t i = 0; i < query->num_steps; i++) {
+        FREE(query->steps[i].name);
+        FREE(query->steps[i].str);
+    }
+    FREE(query->steps);
+    FREE(query);
+}
+
+static int _emit(_nbt_query_run_t *r, nbt_tag_type_t type, const char *name, size_t name_len, size_t pos) {
+    nbt_query_result_t res;
+    const unsigned char *b = r->data + pos;
+    size_t end = pos;
+    union {
+        uint32_t u32;
+        uint64_t u64;
+        float f;
+        double d;
+    } u;
+
+    ASSERT(_nbt_skip_payload(r->data, r->size, &end, type, 0) == 0, return -1);
+
+    memset(&res, 0, sizeof(res));
+    res.type = type;
+    res.name = name;
+    res.name_len = name_len;
+    res.data = b;
+    res.len = end - pos;
+
+    switch (type) {
+        case MCNBT_TAG_BYTE:
+            res.value.b = (char) b[0];
+            break;
+        case MCNBT_TAG_SHORT:
+            res.value.s = (short) _nbt_be16(b);
+            break;
+        case MCNBT_TAG_INT:
+            res.value.i = (int) _nbt_be32(b);
+            break;
+        case MCNBT_TAG_FLOAT:
+            u.u32 = _nbt_be32(b);
+            res.value.f = u.f;
+            break;
+        case MCNBT_TAG_LONG:
+            res.value.l = (long) _nbt_be64(b);
+            break;
+        case MCNBT_TAG_DOUBLE:
+            u.u64 = _nbt_be64(b);
+            res.value.d = u.d;
+            break;
+        case MCNBT_TAG_STRING:
+            res.data = b + 2;
+            res.len = _nbt_be16(b);
+            break;
+        case MCNBT_TAG_BYTE_ARRAY:
+        case MCNBT_TAG_INT_ARRAY:
+        case MCNBT_TAG_LONG_ARRAY:
+            res.data = b + 4;
+            res.len = _nbt_be32(b);
+            break;
+        case MCNBT_TAG_LIST:
+            res.list_type = (nbt_tag_type_t) b[0];
+            res.data = b + 5;
+            res.len = _nbt_be32(b + 1);
+            break;
+        default:
+            break;
+    }
+
+    return r->callback(r->userdata, &res) != 0 ? 1 : 0;
+}
+
+/* looks up key in the compound at pos and compares it against the filter */
+static int _filter_match(_nbt_query_run_t *r, _nbt_query_step_t *step, size_t pos) {
+    nbt_tag_type_t type;
+    size_t name_len;
+    const unsigned char *b;
+    double v;
+    int match = 0;
+
+    for (;;) {
+        ASSERT(r->size - pos >= 1, return -1);
+        type = (nbt_tag_type_t) r->data[pos++];
+        if (type == MCNBT_TAG_END) {
+            break;
+        }
+
+        ASSERT(r->size - pos >= 2, return -1);
+        name_len = _nbt_be16(r->data + pos);
+        ASSERT(r->size - pos - 2 >= name_len, return -1);
+        pos += 2;
+
+        if (name_len != step->name_len || memcmp(r->data + pos, step->name, name_len) != 0) {
+            pos += name_len;
+            ASSERT(_nbt_skip_payload(r->data, r->size, &pos, type, 0) == 0, return -1);
+            continue;
+        }
+        pos += name_len;
+
+        b = r->data + pos;
+        ASSERT(r->size - pos >= (type == MCNBT_TAG_STRING ? 2 : _nbt_fixed_size(type)), return -1);
+        if (step->is_string) {
+            match = type == MCNBT_TAG_STRING && r->size - pos - 2 >= _nbt_be16(b) &&
+                    _nbt_be16(b) == step->str_len && memcmp(b + 2, step->str, step->str_len) == 0;
+        } else if (_nbt_fixed_size(type) != 0) {
+            union {
+                uint32_t u32;
+                uint64_t u64;
+                float f;
+                double d;
+            } u;
+
+            switch (type) {
+                case MCNBT_TAG_BYTE:
+                    v = (signed char) b[0];
+                    break;
+                case MCNBT_TAG_SHORT:
+                    v = (short) _nbt_be16(b);
+                    break;
+                case MCNBT_TAG_INT:
+                    v = (int) _nbt_be32(b);
+                    break;
+                case MCNBT_TAG_LONG:
+                    v = (double) (long) _nbt_be64(b);
+                    break;
+                case MCNBT_TAG_FLOAT:
+                    u.u32 = _nbt_be32(b);
+                    v = u.f;
+                    break;
+                default:
+                    u.u64 = _nbt_be64(b);
+                    v = u.d;
+                    break;
+            }
+            match = v == step->num;
+        }
+        break;
+    }
+
+    return step->negate ? !match : match;
+}
+
+static int _run(_nbt_query_run_t *r, size_t step_idx, nbt_tag_type_t type, const char *name, size_t name_len,
+                size_t pos, int depth);
+
+static int _run_list(_nbt_query_run_t *r, size_t step_idx, size_t pos, int depth) {
+    _nbt_query_step_t *step = &r->q->steps[step_idx];
+    nbt_tag_type_t type;
+    uint32_t count;
+    size_t width;
+    int ret;
+
+    ASSERT(r->size - pos >= 5, return -1);
+    type = (nbt_tag_type_t) r->data[pos];
+    count = _nbt_be32(r->data + pos + 1);
+    pos += 5;
+    width = _nbt_fixed_size(type);
+
+    if (step->kind == STEP_INDEX) {
+        if (step->index >= count) {
+            return 0;
+        }
+
+        /* fixed-width elements are addressed directly */
+        if (width != 0) {
+            ASSERT((r->size - pos) / width > step->index, return -1);
+            return _run(r, step_idx + 1, type, NULL, 0, pos + step->index * width, depth + 1);
+        }
+
+        for (size_t i = 0; i < step->index; i++) {
+            ASSERT(_nbt_skip_payload(r->data, r->size, &pos, type, depth + 1) == 0, return -1);
+        }
+        return _run(r, step_idx + 1, type, NULL, 0, pos, depth + 1);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        size_t start = pos;
+        ASSERT(_nbt_skip_payload(r->data, r->size, &pos, type, depth + 1) == 0, return -1);
+
+        if (step->kind == STEP_FILTER) {
+            if (type != MCNBT_TAG_COMPOUND) {
+                return 0;
+            }
+
+            ret = _filter_match(r, step, start);
+            if (ret < 0) {
+                return -1;
+            } else if (ret == 0) {
+                continue;
+            }
+        }
+
+        if ((ret = _run(r, step_idx + 1, type, NULL, 0, start, depth + 1)) != 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static int _run_compound(_nbt_query_run_t *r, size_t step_idx, size_t pos, int depth) {
+    _nbt_query_step_t *step = &r->q->steps[step_idx];
+    nbt_tag_type_t type;
+    const char *name;
+    size_t name_len;
+    int ret;
+
+    for (;;) {
+        ASSERT(r->size - pos >= 1, return -1);
+        type = (nbt_tag_type_t) r->data[pos++];
+        if (type == MCNBT_TAG_END) {
+            return 0;
+        }
+
+        ASSERT(r->size - pos >= 2, return -1);
+        name_len = _nbt_be16(r->data + pos);
+        ASSERT(r->size - pos - 2 >= name_len, return -1);
+        name = (const char *) r->data + pos + 2;
+        pos += 2 + name_len;
+
+        if (step->kind == STEP_ALL) {
+            if ((ret = _run(r, step_idx + 1, type, name, name_len, pos, depth + 1)) != 0) {
+                return ret;
+            }
+        } else if (name_len == step->name_len && memcmp(name, step->name, name_len) == 0) {
+            /* names are unique within a compound */
+            return _run(r, step_idx + 1, type, name, name_len, pos, depth + 1);
+        }
+
+        ASSERT(_nbt_skip_payload(r->data, r->size, &pos, type, depth + 1) == 0, return -1);
+    }
+}
+
+static int _run(_nbt_query_run_t *r, size_t step_idx, nbt_tag_type_t type, const char *name, size_t name_len,
+                size_t pos, int depth) {
+    ASSERT(depth < MAX_DEPTH, return -1);
+
+    if (step_idx == r->q->num_steps) {
+        return _emit(r, type, name, name_len, pos);
+    }
+
+    switch (r->q->steps[step_idx].kind) {
+        case STEP_CHILD:
+            return type == MCNBT_TAG_COMPOUND ? _run_compound(r, step_idx, pos, depth) : 0;
+        case STEP_ALL:
+            if (type == MCNBT_TAG_COMPOUND) {
+                return _run_compound(r, step_idx, pos, depth);
+            }
+            return type == MCNBT_TAG_LIST ? _run_list(r, step_idx, pos, depth) : 0;
+        case STEP_INDEX:
+        case STEP_FILTER:
+            return type == MCNBT_TAG_LIST ? _run_list(r, step_idx, pos, depth) : 0;
+        default:
+            return -1;
+    }
+}
+
+int nbt_query_run(nbt_query_t *query, void *data, size_t size, nbt_query_fn callback, void *userdata) {
+    _nbt_query_run_t r;
+    size_t name_len;
+
+    ASSERT(query != NULL, return -1);
+    ASSERT(data != NULL, return -1);
+    ASSERT(callback != NULL, return -1);
+
+    r.q = query;
+    r.data = data;
+    r.size = size;
+    r.callback = callback;
+    r.userdata = userdata;
+
+    /* paths are relative to the root tag */
+    ASSERT(size >= 3, return -1);
+    name_len = _nbt_be16(r.data + 1);
+    ASSERT(size - 3 >= name_len, return -1);
+
+    return _run(&r, 0, (nbt_tag_type_t) r.data[0], (const char *) r.data + 3, name_len, 3 + name_len, 0);
+}
@@ -0,0 +1,548 @@
+/*
+ *  region.c
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Anvil region files start with two 4 KiB tables of 1024 big-endian
+ * entries each, indexed by (x & 31) + (z & 31) * 32. The first holds
+ * the chunk's sector offset in its upper three bytes and its sector
+ * count in the lowest; the second holds the time it was last saved.
+ * A chunk is a four byte length, one byte compression type and the
+ * compressed tree, padded to a whole number of 4 KiB sectors.
+ *
+ * Regions opened for writing also track which sectors are in use. A
+ * rewritten chunk that still fits its sectors is written over them in
+ * place, so a crash during that write can lose the chunk; one that has
+ * grown goes to the first free run large enough. Header entries are only
+ * written for chunks that changed, on nbt_region_flush(), so until then
+ * the header on disk still points at the old runs; those, and the sectors
+ * a chunk shrank out of, stay reserved until the flush has synced the new
+ * header.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "mcnbt.h"
+#include "region.h"
+#include "scan.h"
+#include "stream.h"
+#include "tree.h"
+#include "util.h"
+
+struct _nbt_region_t {
+    unsigned char *map;
+    size_t size;
+
+    uint32_t offsets[REGION_CHUNKS];
+    uint32_t timestamps[REGION_CHUNKS];
+
+    /* indices of present chunks, sorted by position in the file */
+    uint16_t order[REGION_CHUNKS];
+    size_t count;
+    int unsorted;
+
+    /* the rest is only used when opened for writing */
+    int fd;
+    unsigned char *used;
+    size_t sectors;
+    size_t used_cap;
+    uint32_t dirty[REGION_CHUNKS / 32];
+
+    /* runs given up since the last flush, as header entries */
+    uint32_t *pending;
+    size_t pending_count;
+    size_t pending_cap;
+
+    /* compressed chunk being written, reused between writes */
+    unsigned char *buf;
+    size_t buf_len;
+    size_t buf_cap;
+};
+
+static int _cmp_u64(const void *a, const void *b) {
+    uint64_t x = *((const uint64_t *) a);
+    uint64_t y = *((const uint64_t *) b);
+    return x < y ? -1 : x > y;
+}
+
+static void _region_sort(nbt_region_t *region) {
+    uint64_t keys[REGION_CHUNKS];
+
+    region->count = 0;
+    for (size_t i = 0; i < REGION_CHUNKS; i++) {
+        if (region->offsets[i] != 0) {
+            keys[region->count++] = ((uint64_t) REGION_OFFSET(region->offsets[i]) << 10) | i;
+        }
+    }
+
+    qsort(keys, region->count, sizeof(uint64_t), _cmp_u64);
+    for (size_t i = 0; i < region->count; i++) {
+        region->order[i] = (uint16_t) (keys[i] & (REGION_CHUNKS - 1));
+    }
+    region->unsorted = 0;
+}
+
+static int _region_map(nbt_region_t *region, int fd) {
+    struct stat st;
+    void *map;
+
+    ASSERT(fstat(fd, &st) == 0 && (size_t) st.st_size >= REGION_HEADER, return -1);
+
+    /* shared, so chunks written through the descriptor show up in the mapping */
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ASSERT(map != MAP_FAILED, return -1);
+
+    if (region->map != NULL) {
+        munmap(region->map, region->size);
+    }
+    region->map = map;
+    region->size = (size_t) st.st_size;
+    return 0;
+}
+
+static nbt_region_t *_region_open(const char *filename, int writable) {
+    nbt_region_t *ret;
+    struct stat st;
+    int fd;
+
+    ASSERT(filename != NULL, return NULL);
+
+    fd = open(filename, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    ASSERT(fd >= 0, return NULL);
+
+    /* a new region starts out as an empty header */
+    if (writable && fstat(fd, &st) == 0 && st.st_size == 0) {
+        ASSERT(ftruncate(fd, REGION_HEADER) == 0, close(fd); return NULL);
+    }
+
+    CALLOC(ret, 1, sizeof(nbt_region_t), close(fd); return NULL);
+    ret->fd = -1;
+    ASSERT(_region_map(ret, fd) == 0, close(fd); FREE(ret); return NULL);
+
+    for (size_t i = 0; i < REGION_CHUNKS; i++) {
+        ret->offsets[i] = _nbt_be32(ret->map + i * 4);
+        ret->timestamps[i] = _nbt_be32(ret->map + REGION_SECTOR + i * 4);
+
+        /* entries pointing into the header or past the end are treated as absent */
+        if (REGION_OFFSET(ret->offsets[i]) < 2 || REGION_COUNT(ret->offsets[i]) == 0 ||
+            REGION_OFFSET(ret->offsets[i]) * (size_t) REGION_SECTOR + 5 > ret->size) {
+            ret->offsets[i] = 0;
+        }
+    }
+    _region_sort(ret);
+
+    if (!writable) {
+        close(fd);
+        return ret;
+    }
+
+    ret->fd = fd;
+    ret->sectors = (ret->size + REGION_SECTOR - 1) / REGION_SECTOR;
+    ret->used_cap = ret->sectors;
+    CALLOC(ret->used, ret->used_cap, 1, nbt_region_close(ret); return NULL);
+    ret->used[0] = 1;
+    ret->used[1] = 1;
+
+    for (size_t i = 0; i < REGION_CHUNKS; i++) {
+        size_t start = REGION_OFFSET(ret->offsets[i]);
+        size_t end = start + REGION_COUNT(ret->offsets[i]);
+
+        if (ret->offsets[i] == 0) {
+            continue;
+        }
+        for (size_t j = start; j < end && j < ret->sectors; j++) {
+            ret->used[j] = 1;
+        }
+    }
+
+    return ret;
+}
+
+nbt_region_t *nbt_region_open(const char *filename) {
+    return _region_open(filename, 0);
+}
+
+nbt_region_t *nbt_region_open_rw(const char *filename) {
+    return _region_open(filename, 1);
+}
+
+void nbt_region_close(nbt_region_t *region) {
+    ASSERT(region != NULL, return);
+
+    if (region->fd >= 0) {
+        nbt_region_flush(region);
+        close(region->fd);
+    }
+    munmap(region->map, region->size);
+    FREE(region->used);
+    FREE(region->pending);
+    FREE(region->buf);
+    FREE(region);
+}
+
+size_t nbt_region_count_chunks(nbt_region_t *region) {
+    ASSERT(region != NULL, return 0);
+
+    if (region->unsorted) {
+        _region_sort(region);
+    }
+    return region->count;
+}
+
+int nbt_region_get_chunk_pos(nbt_region_t *region, size_t i, int *x, int *z) {
+    ASSERT(region != NULL, return -1);
+
+    if (region->unsorted) {
+        _region_sort(region);
+    }
+    ASSERT(i < region->count, return -1);
+
+    if (x != NULL) {
+        *x = region->order[i] & 31;
+    }
+    if (z != NULL) {
+        *z = region->order[i] >> 5;
+    }
+    return 0;
+}
+
+int nbt_region_has_chunk(nbt_region_t *region, int x, int z) {
+    ASSERT(region != NULL, return 0);
+    return region->offsets[REGION_INDEX(x, z)] != 0;
+}
+
+unsigned int nbt_region_get_timestamp(nbt_region_t *region, int x, int z) {
+    ASSERT(region != NULL, return 0);
+    return region->timestamps[REGION_INDEX(x, z)];
+}
+
+typedef struct _nbt_inflate_t {
+    z_stream z;
+    int done;
+} _nbt_inflate_t;
+
+static ssize_t _inflate_read(void *ctx, void *buf, size_t len) {
+    _nbt_inflate_t *in = ctx;
+    int r;
+
+    if (in->done) {
+        return 0;
+    }
+
+    in->z.next_out = buf;
+    in->z.avail_out = (uInt) len;
+    r = inflate(&in->z, Z_NO_FLUSH);
+    if (r == Z_STREAM_END) {
+        in->done = 1;
+    } else if (r != Z_OK) {
+        return -1;
+    }
+    return (ssize_t) (len - in->z.avail_out);
+}
+
+/** Parses a chunk straight out of its compressed payload
+ * @param data Payload following the compression type byte
+ * @param len Length of the payload
+ * @param type Compression type from the chunk header
+ * @param arena Arena to allocate from, or NULL for the heap
+ * @return The chunk's tree or NULL
+ */
+nbt_node_t *_nbt_region_decode(const unsigned char *data, size_t len, int type, nbt_arena_t *arena) {
+    _nbt_inflate_t in;
+    nbt_node_t *ret = NULL;
+    int scope;
+
+    if (type == REGION_NONE) {
+        return _nbt_parse((void *) data, len, arena, 0);
+    }
+    ASSERT(type == REGION_GZIP || type == REGION_ZLIB, return NULL);
+
+    memset(&in, 0, sizeof(in));
+    in.z.next_in = (unsigned char *) data;
+    in.z.avail_in = (uInt) len;
+    in.z.zalloc = _nbt_zalloc;
+    in.z.zfree = _nbt_zfree;
+
+    /* 32 on top of the window bits lets zlib detect either wrapper */
+    scope = _nbt_alloc_enter(MCNBT_ALLOC_PARSE);
+    if (inflateInit2(&in.z, 15 + 32) == Z_OK) {
+        ret = _nbt_parse_stream(_inflate_read, &in, arena);
+        inflateEnd(&in.z);
+    }
+    _nbt_alloc_leave(scope);
+    return ret;
+}
+
+/** Locates the compressed payload of a chunk
+ * @param region Region to look in
+ * @param x Chunk x coordinate
+ * @param z Chunk z coordinate
+ * @param data Set to the payload following the compression type byte
+ * @param len Set to the length of the payload
+ * @param type Set to the compression type
+ * @return 0 on success, -1 if the chunk is absent or damaged
+ */
+int _nbt_region_get_raw(nbt_region_t *region, int x, int z, const unsigned char **data, size_t *len, int *type) {
+    uint32_t entry;
+    size_t pos, n;
+
+    ASSERT(region != NULL, return -1);
+    entry = region->offsets[REGION_INDEX(x, z)];
+    ASSERT(entry != 0, return -1);
+
+    pos = REGION_OFFSET(entry) * (size_t) REGION_SECTOR;
+
+    /* chunks written since the file was mapped may lie past the end of the mapping */
+    if (pos + 5 > region->size && region->fd >= 0) {
+        ASSERT(_region_map(region, region->fd) == 0, return -1);
+    }
+    ASSERT(pos + 5 <= region->size, return -1);
+    n = _nbt_be32(region->map + pos);
+
+    if (pos + 4 + n > region->size && region->fd >= 0) {
+        ASSERT(_region_map(region, region->fd) == 0, return -1);
+    }
+
+    /* the length counts the compression type byte */
+    ASSERT(n >= 1 && n <= REGION_COUNT(entry) * (size_t) REGION_SECTOR - 4, return -1);
+    ASSERT(pos + 4 + n <= region->size, return -1);
+
+    *data = region->map + pos + 5;
+    *len = n - 1;
+    *type = region->map[pos + 4];
+    return 0;
+}
+
+nbt_node_t *nbt_region_read_chunk_arena(nbt_region_t *region, int x, int z, nbt_arena_t *arena) {
+    const unsigned char *data;
+    size_t len;
+    int type;
+
+    ASSERT(_nbt_region_get_raw(region, x, z, &data, &len, &type) == 0, return NULL);
+    return _nbt_region_decode(data, len, type, arena);
+}
+
+nbt_node_t *nbt_region_read_chunk(nbt_region_t *region, int x, int z) {
+    return nbt_region_read_chunk_arena(region, x, z, NULL);
+}
+
+static int _buf_reserve(nbt_region_t *region, size_t len) {
+    if (len <= region->buf_cap) {
+        return 0;
+    }
+
+    size_t cap = region->buf_cap ? region->buf_cap * 2 : 16 * REGION_SECTOR;
+    while (cap < len) {
+        cap *= 2;
+    }
+    REALLOC(region->buf, cap, return -1);
+    region->buf_cap = cap;
+    return 0;
+}
+
+static int _buf_write(void *userdata, const void *buf, size_t len) {
+    nbt_region_t *region = userdata;
+
+    ASSERT(_buf_reserve(region, region->buf_len + len) == 0, return -1);
+    memcpy(region->buf + region->buf_len, buf, len);
+    region->buf_len += len;
+    return 0;
+}
+
+static void _mark(nbt_region_t *region, size_t start, size_t count, unsigned char used) {
+    for (size_t i = start; i < start + count && i < region->sectors; i++) {
+        region->used[i] = used;
+    }
+}
+
+/** Finds a run of free sectors, extending the file if there is none
+ * @param region Region opened for writing
+ * @param count Number of sectors needed
+ * @return First sector of the run, or 0 on failure
+ */
+static size_t _alloc_sectors(nbt_region_t *region, size_t count) {
+    size_t run = 0;
+    size_t start;
+
+    for (size_t i = 2; i < region->sectors; i++) {
+        run = region->used[i] ? 0 : run + 1;
+        if (run == count) {
+            _mark(region, i + 1 - count, count, 1);
+            return i + 1 - count;
+        }
+    }
+
+    /* free sectors at the end of the file are reused before growing it */
+    start = region->sectors - run;
+    if (start + count > region->used_cap) {
+        size_t cap = region->used_cap * 2 > start + count ? region->used_cap * 2 : start + count;
+        REALLOC(region->used, cap, return 0);
+        memset(region->used + region->used_cap, 0, cap - region->used_cap);
+        region->used_cap = cap;
+    }
+
+    region->sectors = start + count;
+    _mark(region, start, count, 1);
+    return start;
+}
+
+/** Gives up the sectors of a header entry once the next flush has synced
+ * @param region Region opened for writing
+ * @param entry Header entry whose run is no longer needed
+ * @return 0 on success, -1 on failure
+ */
+static int _release_run(nbt_region_t *region, uint32_t entry) {
+    if (region->pending_count == region->pending_cap) {
+        size_t cap = region->pending_cap ? region->pending_cap * 2 : 64;
+        REALLOC(region->pending, cap * sizeof(uint32_t), return -1);
+        region->pending_cap = cap;
+    }
+    region->pending[region->pending_count++] = entry;
+    return 0;
+}
+
+static void _set_entry(nbt_region_t *region, size_t idx, uint32_t offset, uint32_t timestamp) {
+    region->offsets[idx] = offset;
+    region->timestamps[idx] = timestamp;
+    region->dirty[idx / 32] |= (uint32_t) 1 << (idx % 32);
+    region->unsorted = 1;
+}
+
+static int _write_chunk(nbt_region_t *region, int x, int z, nbt_node_t *chunk, unsigned int timestamp) {
+    size_t idx, count, start, len;
+    uint32_t old;
+
+    ASSERT(region != NULL, return -1);
+    ASSERT(chunk != NULL, return -1);
+    ASSERT(region->fd >= 0, return -1);
+
+    /* the length and compression type are filled in once the size is known */
+    region->buf_len = 5;
+    ASSERT(_buf_reserve(region, region->buf_len) == 0, return -1);
+    ASSERT(nbt_write_sink(chunk, _buf_write, region, MCNBT_COMPRESS_ZLIB) == 0, return -1);
+
+    len = region->buf_len;
+    count = (len + REGION_SECTOR - 1) / REGION_SECTOR;
+    /* the sector count has to fit in one byte */
+    ASSERT(count <= 255, return -1);
+
+    _nbt_put_be32(region->buf, (uint32_t) (len - 4));
+    region->buf[4] = REGION_ZLIB;
+    ASSERT(_buf_reserve(region, count * REGION_SECTOR) == 0, return -1);
+    memset(region->buf + len, 0, count * REGION_SECTOR - len);
+
+    idx = REGION_INDEX(x, z);
+    old = region->offsets[idx];
+
+    if (old != 0 && count <= REGION_COUNT(old)) {
+        start = REGION_OFFSET(old);
+        ASSERT(pwrite(region->fd, region->buf, count * REGION_SECTOR, (off_t) (start * REGION_SECTOR)) ==
+               (ssize_t) (count * REGION_SECTOR), return -1);
+
+        /* if the sectors left over cannot be given up they stay with the chunk */
+        if (count < REGION_COUNT(old) &&
+            _release_run(region, (uint32_t) ((start + count) << 8 | (REGION_COUNT(old) - count))) != 0) {
+            count = REGION_COUNT(old);
+        }
+    } else {
+        start = _alloc_sectors(region, count);
+        ASSERT(start != 0, return -1);
+
+        ASSERT(pwrite(region->fd, region->buf, count * REGION_SECTOR, (off_t) (start * REGION_SECTOR)) ==
+               (ssize_t) (count * REGION_SECTOR), _mark(region, start, count, 0); return -1);
+        ASSERT(old == 0 || _release_run(region, old) == 0, _mark(region, start, count, 0); return -1);
+    }
+
+    _set_entry(region, idx, (uint32_t) (start << 8 | count), timestamp ? timestamp : (uint32_t) time(NULL));
+    return 0;
+}
+
+int nbt_region_write_chunk(nbt_region_t *region, int x, int z, nbt_node_t *chunk, unsigned int timestamp) {
+    int scope = _nbt_alloc_enter(MCNBT_ALLOC_SERIALIZE);
+    int ret = _write_chunk(region, x, z, chunk, timestamp);
+    _nbt_alloc_leave(scope);
+    return ret;
+}
+
+int nbt_region_delete_chunk(nbt_region_t *region, int x, int z) {
+    size_t idx;
+    ASSERT(region != NULL, return -1);
+    ASSERT(region->fd >= 0, return -1);
+
+    idx = REGION_INDEX(x, z);
+    if (region->offsets[idx] != 0) {
+        ASSERT(_release_run(region, region->offsets[idx]) == 0, return -1);
+        _set_entry(region, idx, 0, 0);
+    }
+    return 0;
+}
+
+static int _write_entries(int fd, const uint32_t *table, size_t from, size_t to, size_t base) {
+    unsigned char tmp[REGION_SECTOR];
+
+    for (size_t i = from; i < to; i++) {
+        _nbt_put_be32(tmp + (i - from) * 4, table[i]);
+    }
+    ASSERT(pwrite(fd, tmp, (to - from) * 4, (off_t) (base + from * 4)) == (ssize_t) ((to - from) * 4), return -1);
+    return 0;
+}
+
+int nbt_region_flush(nbt_region_t *region) {
+    size_t i = 0, j;
+    ASSERT(region != NULL, return -1);
+    ASSERT(region->fd >= 0, return -1);
+
+    /* chunks reach the disk before any header entry that points at them */
+    for (i = 0; i < REGION_CHUNKS / 32 && region->dirty[i] == 0; i++);
+    if (i < REGION_CHUNKS / 32) {
+        ASSERT(fdatasync(region->fd) == 0, return -1);
+    }
+    i = 0;
+
+#define DIRTY(n) (region->dirty[(n) / 32] & ((uint32_t) 1 << ((n) % 32)))
+    /* runs of neighbouring entries go out in one write per table */
+    while (i < REGION_CHUNKS) {
+        if (!DIRTY(i)) {
+            i++;
+            continue;
+        }
+        for (j = i; j < REGION_CHUNKS && DIRTY(j); j++);
+
+        ASSERT(_write_entries(region->fd, region->offsets, i, j, 0) == 0, return -1);
+        ASSERT(_write_entries(region->fd, region->timestamps, i, j, REGION_SECTOR) == 0, return -1);
+        i = j;
+    }
+#undef DIRTY
+
+    memset(region->dirty, 0, sizeof(region->dirty));
+    ASSERT(fdatasync(region->fd) == 0, return -1);
+
+    /* nothing on disk refers to these runs any more */
+    for (i = 0; i < region->pending_count; i++) {
+        _mark(region, REGION_OFFSET(region->pending[i]), REGION_COUNT(region->pending[i]), 0);
+    }
+    region->pending_count = 0;
+    return 0;
+}
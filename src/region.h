@@ -0,0 +1,40 @@
+/*
+ *  region.h
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBMCNBT_REGION_H
+#define LIBMCNBT_REGION_H
+
+#include "mcnbt.h"
+
+#define REGION_SECTOR 4096
+#define REGION_CHUNKS 1024
+#define REGION_HEADER (2 * REGION_SECTOR)
+
+#define REGION_INDEX(x, z) (((unsigned) (x) & 31) + ((unsigned) (z) & 31) * 32)
+#define REGION_OFFSET(e) ((e) >> 8)
+#define REGION_COUNT(e) ((e) & 0xff)
+
+/* compression types stored in front of each chunk */
+#define REGION_GZIP 1
+#define REGION_ZLIB 2
+#define REGION_NONE 3
+
+int _nbt_region_get_raw(nbt_region_t *region, int x, int z, const unsigned char **data, size_t *len, int *type);
+nbt_node_t *_nbt_region_decode(const unsigned char *data, size_t len, int type, nbt_arena_t *arena);
+
+#endif //LIBMCNBT_REGION_H
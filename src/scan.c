@@ -0,0 +1,158 @@
+/*
+ *  scan.c
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+#include "scan.h"
+#include "util.h"
+
+/** Walks a payload, checking every length against size
+ * @param data Serialized data
+ * @param size Size of data
+ * @param pos Offset of the payload, advanced past it on success
+ * @param type Type of the payload
+ * @param depth Current nesting depth
+ * @param stats Totals to add the payload's nodes to, or NULL
+ * @return 0 on success, -1 if the payload is malformed or runs past size
+ */
+static int _scan(const unsigned char *data, size_t size, size_t *pos, nbt_tag_type_t type, int depth,
+                 _nbt_scan_t *stats) {
+    size_t p = *pos;
+    size_t n;
+    uint32_t count;
+    nbt_tag_type_t t;
+
+    ASSERT(depth < MAX_DEPTH, return -1);
+
+    switch (type) {
+        case MCNBT_TAG_BYTE:
+        case MCNBT_TAG_SHORT:
+        case MCNBT_TAG_INT:
+        case MCNBT_TAG_FLOAT:
+        case MCNBT_TAG_LONG:
+        case MCNBT_TAG_DOUBLE:
+            n = _nbt_fixed_size(type);
+            break;
+        case MCNBT_TAG_STRING:
+            ASSERT(size - p >= 2, return -1);
+            n = 2 + (size_t) _nbt_be16(data + p);
+            if (stats != NULL) {
+                stats->allocs++;
+                stats->bytes += n - 1;
+            }
+            break;
+        case MCNBT_TAG_BYTE_ARRAY:
+        case MCNBT_TAG_INT_ARRAY:
+        case MCNBT_TAG_LONG_ARRAY:
+            ASSERT(size - p >= 4, return -1);
+            count = _nbt_be32(data + p);
+            n = 4 + (size_t) count * (type == MCNBT_TAG_BYTE_ARRAY ? 1 : type == MCNBT_TAG_INT_ARRAY ? 4 : 8);
+            if (stats != NULL) {
+                stats->allocs++;
+                stats->bytes += n - 4;
+            }
+            break;
+        case MCNBT_TAG_LIST:
+            ASSERT(size - p >= 5, return -1);
+            t = (nbt_tag_type_t) data[p];
+            count = _nbt_be32(data + p + 1);
+            p += 5;
+
+            /* lists of fixed-width values are skipped in one step */
+            if ((n = _nbt_fixed_size(t)) != 0) {
+                ASSERT((size - p) / n >= count, return -1);
+                if (stats != NULL && count > 0) {
+                    stats->allocs++;
+                    stats->bytes += (size_t) count * n;
+                }
+                *pos = p + (size_t) count * n;
+                return 0;
+            }
+
+            /* elements are nodes of their own, tracked in an array of pointers */
+            if (stats != NULL && count > 0) {
+                ASSERT(size - p >= count, return -1);
+                stats->nodes += count;
+                stats->allocs++;
+                stats->bytes += (size_t) count * sizeof(void *);
+            }
+
+            for (uint32_t i = 0; i < count; i++) {
+                ASSERT(_scan(data, size, &p, t, depth + 1, stats) == 0, return -1);
+            }
+            *pos = p;
+            return 0;
+        case MCNBT_TAG_COMPOUND:
+            for (;;) {
+                ASSERT(size - p >= 1, return -1);
+                t = (nbt_tag_type_t) data[p++];
+                if (t == MCNBT_TAG_END) {
+                    break;
+                }
+
+                ASSERT(size - p >= 2, return -1);
+                n = _nbt_be16(data + p);
+                ASSERT(size - p - 2 >= n, return -1);
+                p += 2 + n;
+
+                if (stats != NULL) {
+                    stats->nodes++;
+                    stats->allocs++;
+                    stats->bytes += n + 1;
+                }
+                ASSERT(_scan(data, size, &p, t, depth + 1, stats) == 0, return -1);
+            }
+            *pos = p;
+            return 0;
+        default:
+            return -1;
+    }
+
+    ASSERT(size - p >= n, return -1);
+    *pos = p + n;
+    return 0;
+}
+
+/** Moves past a payload without looking at its contents
+ * @param data Serialized data
+ * @param size Size of data
+ * @param pos Offset of the payload, advanced past it on success
+ * @param type Type of the payload
+ * @param depth Current nesting depth
+ * @return 0 on success, -1 if the payload is malformed or runs past size
+ */
+int _nbt_skip_payload(const unsigned char *data, size_t size, size_t *pos, nbt_tag_type_t type, int depth) {
+    return _scan(data, size, pos, type, depth, NULL);
+}
+
+/** Validates a whole tree and totals what parsing it will allocate
+ * @param data Serialized tree, starting with the root tag
+ * @param size Size of data
+ * @param stats Filled with the totals
+ * @return 0 if the tree is well formed and ends within size, -1 otherwise
+ */
+int _nbt_scan_tree(const unsigned char *data, size_t size, _nbt_scan_t *stats) {
+    size_t pos;
+
+    ASSERT(size >= 3 && data[0] != MCNBT_TAG_END, return -1);
+    pos = 3 + (size_t) _nbt_be16(data + 1);
+    ASSERT(pos <= size, return -1);
+
+    stats->nodes = 1;
+    stats->allocs = 1;
+    stats->bytes = pos - 2;
+    return _scan(data, size, &pos, (nbt_tag_type_t) data[0], 0, stats);
+}
@@ -0,0 +1,87 @@
+/*
+ *  scan.h
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBMCNBT_SCAN_H
+#define LIBMCNBT_SCAN_H
+
+#include <stdint.h>
+
+#include "mcnbt.h"
+
+#define MAX_DEPTH 512
+#define MAX_SHORT_LEN 65535
+
+static inline uint16_t _nbt_be16(const unsigned char *b) {
+    return (uint16_t) ((b[0] << 8) | b[1]);
+}
+
+static inline uint32_t _nbt_be32(const unsigned char *b) {
+    return ((uint32_t) b[0] << 24) | ((uint32_t) b[1] << 16) | ((uint32_t) b[2] << 8) | (uint32_t) b[3];
+}
+
+static inline uint64_t _nbt_be64(const unsigned char *b) {
+    return ((uint64_t) _nbt_be32(b) << 32) | _nbt_be32(b + 4);
+}
+
+static inline void _nbt_put_be16(unsigned char *b, uint16_t v) {
+    b[0] = (unsigned char) (v >> 8);
+    b[1] = (unsigned char) v;
+}
+
+static inline void _nbt_put_be32(unsigned char *b, uint32_t v) {
+    b[0] = (unsigned char) (v >> 24);
+    b[1] = (unsigned char) (v >> 16);
+    b[2] = (unsigned char) (v >> 8);
+    b[3] = (unsigned char) v;
+}
+
+static inline void _nbt_put_be64(unsigned char *b, uint64_t v) {
+    _nbt_put_be32(b, (uint32_t) (v >> 32));
+    _nbt_put_be32(b + 4, (uint32_t) v);
+}
+
+/* encoded size of a number, or 0 for types without a fixed size */
+static inline size_t _nbt_fixed_size(nbt_tag_type_t type) {
+    switch (type) {
+        case MCNBT_TAG_BYTE:
+            return 1;
+        case MCNBT_TAG_SHORT:
+            return 2;
+        case MCNBT_TAG_INT:
+        case MCNBT_TAG_FLOAT:
+            return 4;
+        case MCNBT_TAG_LONG:
+        case MCNBT_TAG_DOUBLE:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+/* what parsing a tree allocates; bytes and allocs are upper bounds since
+ * borrowed names and payloads are not copied */
+typedef struct _nbt_scan_t {
+    size_t nodes;
+    size_t allocs;
+    size_t bytes;
+} _nbt_scan_t;
+
+int _nbt_skip_payload(const unsigned char *data, size_t size, size_t *pos, nbt_tag_type_t type, int depth);
+int _nbt_scan_tree(const unsigned char *data, size_t size, _nbt_scan_t *stats);
+
+#endif //LIBMCNBT_SCAN_H
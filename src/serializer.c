@@ -16,746 +16,535 @@
  *  License along with this library; if not see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
 #include "mcnbt.h"
+#include "scan.h"
+#include "swap.h"
+#include "stream.h"
+#include "tree.h"
 #include "util.h"
 
-static unsigned long _lpow(long a, long b) {
-    unsigned long ret = 1;
-    for (long i = b; b; b >>= 1) {
-        if (b & 1) {
-            ret *= a;
-        }
-        a *= a;
-    }
-
-    return ret;
-}
-
-static char *_serialize_numerical_value(void *num, size_t bytes) {
-    char *ret = NULL;
-    CALLOC(ret, bytes, sizeof(char), return NULL);
+/*
+ * Serialization runs in two passes: _payload_size() computes the exact
+ * encoded size of a tree, then _write_payload() fills a single buffer of
+ * that size front to back. The same writer also feeds the streaming
+ * output in writer.c, flushing a small buffer whenever it fills up.
+ * Subtrees that were never materialized after a lazy parse are copied
+ * straight from the source buffer, and so are subtrees that have not
+ * changed since they were last written or loaded: serializing into a
+ * buffer logs every compound and list it writes and afterwards keeps a
+ * copy of those at least LOG_MIN_SIZE bytes long, see _log_commit().
+ */
 
-    for (int i = 0; i < bytes; i++) {
-        ret[bytes - i - 1] = (char)((*((long*)num) & (_lpow(2, bytes * 8) - 1)) >> (8 * i));
+#define LOG_NONE ((size_t) -1)
+#define LOG_MIN_CAP 64
+
+/* smaller subtrees are written again rather than kept */
+#define LOG_MIN_SIZE 1024
+
+/* a compound or list written by one serialization */
+typedef struct _nbt_log_entry_t {
+    nbt_node_t *node;
+    size_t pos;
+    size_t len;
+
+    /* entry of the enclosing compound or list, or LOG_NONE */
+    size_t parent;
+
+    /* cleared for arena nodes, which cannot hold heap buffers, and for everything above them */
+    int ok;
+} _nbt_log_entry_t;
+
+/* entries in the order their nodes were started, so parents precede their children */
+typedef struct _nbt_log_t {
+    _nbt_log_entry_t *entries;
+    size_t count;
+    size_t cap;
+    int failed;
+} _nbt_log_t;
+
+static size_t _payload_size(nbt_node_t *node, int depth) {
+    const unsigned char *raw;
+    size_t ret, len, sub;
+
+    ASSERT(depth < MAX_DEPTH, return 0);
+
+    switch (nbt_node_get_type(node)) {
+        case MCNBT_TAG_BYTE:
+            return 1;
+        case MCNBT_TAG_SHORT:
+            return 2;
+        case MCNBT_TAG_INT:
+        case MCNBT_TAG_FLOAT:
+            return 4;
+        case MCNBT_TAG_LONG:
+        case MCNBT_TAG_DOUBLE:
+            return 8;
+        case MCNBT_TAG_BYTE_ARRAY:
+            return 4 + nbt_node_get_len(node);
+        case MCNBT_TAG_STRING:
+            len = nbt_node_get_len(node);
+            ASSERT(len <= MAX_SHORT_LEN, return 0);
+            return 2 + len;
+        case MCNBT_TAG_INT_ARRAY:
+            return 4 + nbt_node_get_len(node) * 4;
+        case MCNBT_TAG_LONG_ARRAY:
+            return 4 + nbt_node_get_len(node) * 8;
+        case MCNBT_TAG_LIST:
+            if (_nbt_node_get_raw(node, &raw, &len)) {
+                return len;
+            }
+
+            if (_nbt_node_get_packed(node, &len) != NULL) {
+                return 5 + len * _nbt_fixed_size(nbt_node_get_list_type(node));
+            }
+
+            ret = 5;
+            for (nbt_node_t *c = nbt_node_get_first_child(node); c; c = nbt_node_get_next_child(c)) {
+                ASSERT(nbt_node_get_type(c) == nbt_node_get_list_type(node), return 0);
+                sub = _payload_size(c, depth + 1);
+                ASSERT(sub != 0, return 0);
+                ret += sub;
+            }
+            return ret;
+        case MCNBT_TAG_COMPOUND:
+            if (_nbt_node_get_raw(node, &raw, &len)) {
+                return len;
+            }
+
+            ret = 1;
+            for (nbt_node_t *c = nbt_node_get_first_child(node); c; c = nbt_node_get_next_child(c)) {
+                nbt_node_get_name_view(c, &len);
+                ASSERT(len <= MAX_SHORT_LEN, return 0);
+                sub = _payload_size(c, depth + 1);
+                ASSERT(sub != 0, return 0);
+                ret += 3 + len + sub;
+            }
+            return ret;
+        default:
+            return 0;
     }
-
-    return ret;
 }
 
-static char *_serialize_byte(nbt_node_t *node, size_t *len) {
-    ASSERT(node != NULL, return NULL);
-    ASSERT(nbt_node_get_type(node) == MCNBT_TAG_BYTE, return NULL);
-    char *ret = NULL;
-    size_t ret_size = 2;
-    char *name_size = NULL;
-    char byte = nbt_node_get_data_byte(node);
-
-    char *name = nbt_node_get_name(node);
-    size_t name_len;
-    if (name != NULL) {
-        ret_size += 2;
-        name_len = strlen(name);
-    } else {
-        name_len = 0;
-    }
-
-    name_size = _serialize_numerical_value(&name_len, 2);
-
-    ret_size += name_len;
-    CALLOC(ret, ret_size, sizeof(char), return NULL);
-
-    ret[0] = MCNBT_TAG_BYTE;
-    if (name != NULL) {
-        _mcnbt_memcat(ret, name_size, 2, 1);
-        _mcnbt_memcat(ret, name, strlen(name), 3);
-        _mcnbt_memcat(ret, &byte, 1, 3 + (int) strlen(name));
-    } else {
-        _mcnbt_memcat(ret, &byte, 1, 1);
-    }
-
-    if (len != NULL) {
-        *len = ret_size;
-    }
-
-    FREE(name_size);
-
-    return ret;
+/* bytes written in one piece before the variable part of each payload */
+static const size_t _fixed_size[] = {
+    [MCNBT_TAG_BYTE] = 1,
+    [MCNBT_TAG_SHORT] = 2,
+    [MCNBT_TAG_INT] = 4,
+    [MCNBT_TAG_LONG] = 8,
+    [MCNBT_TAG_FLOAT] = 4,
+    [MCNBT_TAG_DOUBLE] = 8,
+    [MCNBT_TAG_BYTE_ARRAY] = 4,
+    [MCNBT_TAG_STRING] = 2,
+    [MCNBT_TAG_LIST] = 0,
+    [MCNBT_TAG_COMPOUND] = 0,
+    [MCNBT_TAG_INT_ARRAY] = 4,
+    [MCNBT_TAG_LONG_ARRAY] = 4,
+};
+
+static int _reserve(_nbt_out_t *out, size_t n) {
+    if ((size_t) (out->end - out->pos) >= n) {
+        return 0;
+    }
+    ASSERT(out->flush != NULL && out->flush(out) == 0, return -1);
+    ASSERT((size_t) (out->end - out->pos) >= n, return -1);
+    return 0;
 }
 
-static char *_serialize_short(nbt_node_t *node, size_t *len) {
-    ASSERT(node != NULL, return NULL);
-    ASSERT(nbt_node_get_type(node) == MCNBT_TAG_SHORT, return NULL);
-    char *ret = NULL;
-    size_t ret_size = 3;
-    char *name_size = NULL;
-    short data = nbt_node_get_data_short(node);
-    char *sdata = _serialize_numerical_value(&data, 2);
-
-    char *name = nbt_node_get_name(node);
-    size_t name_len;
-    if (name != NULL) {
-        ret_size += 2;
-        name_len = strlen(name);
-    } else {
-        name_len = 0;
-    }
+static int _write_bytes(_nbt_out_t *out, const void *data, size_t len) {
+    const unsigned char *p = data;
 
-    name_size = _serialize_numerical_value(&name_len, 2);
-
-    ret_size += name_len;
-    CALLOC(ret, ret_size, sizeof(char), return NULL);
-
-    ret[0] = MCNBT_TAG_SHORT;
-    if (name != NULL) {
-        _mcnbt_memcat(ret, name_size, 2, 1);
-        _mcnbt_memcat(ret, name, strlen(name), 3);
-        _mcnbt_memcat(ret, sdata, 2, 3 + (int) strlen(name));
-    } else {
-        _mcnbt_memcat(ret, sdata, 2, 1);
-    }
-
-    if (len != NULL) {
-        *len = ret_size;
-    }
-
-    FREE(name_size);
-    FREE(sdata);
-
-    return ret;
-}
-
-static char *_serialize_int(nbt_node_t *node, size_t *len) {
-    ASSERT(node != NULL, return NULL);
-    ASSERT(nbt_node_get_type(node) == MCNBT_TAG_INT, return NULL);
-    char *ret = NULL;
-    size_t ret_size = 5;
-    char *name_size = NULL;
-    int data = nbt_node_get_data_int(node);
-    char *sdata = _serialize_numerical_value(&data, 4);
-
-    char *name = nbt_node_get_name(node);
-    size_t name_len;
-    if (name != NULL) {
-        ret_size += 2;
-        name_len = strlen(name);
-    } else {
-        name_len = 0;
-    }
-
-    name_size = _serialize_numerical_value(&name_len, 2);
-
-    ret_size += name_len;
-    CALLOC(ret, ret_size, sizeof(char), return NULL);
-
-    ret[0] = MCNBT_TAG_INT;
-    if (name != NULL) {
-        _mcnbt_memcat(ret, name_size, 2, 1);
-        _mcnbt_memcat(ret, name, strlen(name), 3);
-        _mcnbt_memcat(ret, sdata, 4, 3 + (int) strlen(name));
-    } else {
-        _mcnbt_memcat(ret, sdata, 4, 1);
-    }
+    while (len > 0) {
+        size_t n = (size_t) (out->end - out->pos);
+        if (n == 0) {
+            ASSERT(_reserve(out, 1) == 0, return -1);
+            n = (size_t) (out->end - out->pos);
+        }
+        if (n > len) {
+            n = len;
+        }
 
-    if (len != NULL) {
-        *len = ret_size;
+        memcpy(out->pos, p, n);
+        out->pos += n;
+        p += n;
+        len -= n;
     }
-
-    FREE(name_size);
-    FREE(sdata);
-
-    return ret;
+    return 0;
 }
 
-static char *_serialize_long(nbt_node_t *node, size_t *len) {
-    ASSERT(node != NULL, return NULL);
-    ASSERT(nbt_node_get_type(node) == MCNBT_TAG_LONG, return NULL);
-    char *ret = NULL;
-    size_t ret_size = 9;
-    char *name_size = NULL;
-    long data = nbt_node_get_data_long(node);
-    char *sdata = _serialize_numerical_value(&data, 8);
-
-    char *name = nbt_node_get_name(node);
-    size_t name_len;
-    if (name != NULL) {
-        ret_size += 2;
-        name_len = strlen(name);
-    } else {
-        name_len = 0;
-    }
-
-    name_size = _serialize_numerical_value(&name_len, 2);
-
-    ret_size += name_len;
-    CALLOC(ret, ret_size, sizeof(char), return NULL);
-
-    ret[0] = MCNBT_TAG_LONG;
-    if (name != NULL) {
-        _mcnbt_memcat(ret, name_size, 2, 1);
-        _mcnbt_memcat(ret, name, strlen(name), 3);
-        _mcnbt_memcat(ret, sdata, 8, 3 + (int) strlen(name));
-    } else {
-        _mcnbt_memcat(ret, sdata, 8, 1);
-    }
-
-    if (len != NULL) {
-        *len = ret_size;
-    }
-
-    FREE(name_size);
-    FREE(sdata);
+static int _write_name(nbt_node_t *node, _nbt_out_t *out) {
+    size_t len;
+    const char *name = nbt_node_get_name_view(node, &len);
 
-    return ret;
+    ASSERT(len <= MAX_SHORT_LEN, return -1);
+    ASSERT(_reserve(out, 3) == 0, return -1);
+    out->pos[0] = (unsigned char) nbt_node_get_type(node);
+    _nbt_put_be16(out->pos + 1, (uint16_t) len);
+    out->pos += 3;
+    return _write_bytes(out, name, len);
 }
 
-static char *_serialize_float(nbt_node_t *node, size_t *len) {
-    ASSERT(node != NULL, return NULL);
-    ASSERT(nbt_node_get_type(node) == MCNBT_TAG_FLOAT, return NULL);
-    char *ret = NULL;
-    size_t ret_size = 5;
-    char *name_size = NULL;
-    float data = nbt_node_get_data_float(node);
-    char *sdata = _serialize_numerical_value(&data, 4);
-
-    char *name = nbt_node_get_name(node);
-    size_t name_len;
-    if (name != NULL) {
-        ret_size += 2;
-        name_len = strlen(name);
-    } else {
-        name_len = 0;
-    }
-
-    name_size = _serialize_numerical_value(&name_len, 2);
-
-    ret_size += name_len;
-    CALLOC(ret, ret_size, sizeof(char), return NULL);
-
-    ret[0] = MCNBT_TAG_FLOAT;
-    if (name != NULL) {
-        _mcnbt_memcat(ret, name_size, 2, 1);
-        _mcnbt_memcat(ret, name, strlen(name), 3);
-        _mcnbt_memcat(ret, sdata, 4, 3 + (int) strlen(name));
-    } else {
-        _mcnbt_memcat(ret, sdata, 4, 1);
-    }
-
-    if (len != NULL) {
-        *len = ret_size;
-    }
-
-    FREE(name_size);
-    FREE(sdata);
-
-    return ret;
-}
+/** Writes host-order numbers in big-endian order, as many per step as fit
+ * @param out Output cursor
+ * @param data Numbers to write
+ * @param width Size of one number: 1, 2, 4 or 8
+ * @param count Number of numbers
+ * @return 0 on success, -1 on failure
+ */
+static int _write_swapped(_nbt_out_t *out, const void *data, size_t width, size_t count) {
+    const char *src = data;
+    size_t n;
 
-static char *_serialize_double(nbt_node_t *node, size_t *len) {
-    ASSERT(node != NULL, return NULL);
-    ASSERT(nbt_node_get_type(node) == MCNBT_TAG_DOUBLE, return NULL);
-    char *ret = NULL;
-    size_t ret_size = 9;
-    char *name_size = NULL;
-    double data = nbt_node_get_data_double(node);
-    char *sdata = _serialize_numerical_value(&data, 8);
-
-    char *name = nbt_node_get_name(node);
-    size_t name_len;
-    if (name != NULL) {
-        ret_size += 2;
-        name_len = strlen(name);
-    } else {
-        name_len = 0;
+    if (width == 1) {
+        return _write_bytes(out, data, count);
     }
 
-    name_size = _serialize_numerical_value(&name_len, 2);
-
-    ret_size += name_len;
-    CALLOC(ret, ret_size, sizeof(char), return NULL);
-
-    ret[0] = MCNBT_TAG_DOUBLE;
-    if (name != NULL) {
-        _mcnbt_memcat(ret, name_size, 2, 1);
-        _mcnbt_memcat(ret, name, strlen(name), 3);
-        _mcnbt_memcat(ret, sdata, 8, 3 + (int) strlen(name));
-    } else {
-        _mcnbt_memcat(ret, sdata, 8, 1);
-    }
+    while (count > 0) {
+        ASSERT(_reserve(out, width) == 0, return -1);
+        n = (size_t) (out->end - out->pos) / width;
+        if (n > count) {
+            n = count;
+        }
 
-    if (len != NULL) {
-        *len = ret_size;
+        switch (width) {
+            case 2:
+                _nbt_swap16(out->pos, src, n);
+                break;
+            case 4:
+                _nbt_swap32(out->pos, src, n);
+                break;
+            case 8:
+                _nbt_swap64(out->pos, src, n);
+                break;
+            default:
+                return -1;
+        }
+        out->pos += n * width;
+        src += n * width;
+        count -= n;
     }
-
-    FREE(name_size);
-    FREE(sdata);
-
-    return ret;
+    return 0;
 }
 
-static char *_serialize_byte_array(nbt_node_t *node, size_t *len) {
-    ASSERT(node != NULL, return NULL);
-    ASSERT(nbt_node_get_type(node) == MCNBT_TAG_BYTE_ARRAY, return NULL);
-    char *ret = NULL;
-    size_t ret_size = 5;
-    char *name_size = NULL;
-    char *data = nbt_node_get_data_str(node);
-    size_t dlen = nbt_node_get_len(node);
-    char *sdlen = _serialize_numerical_value(&dlen, 4);
-
-    char *name = nbt_node_get_name(node);
-    size_t name_len;
-    if (name != NULL) {
-        ret_size += 2;
-        name_len = strlen(name);
-    } else {
-        name_len = 0;
-    }
-
-    name_size = _serialize_numerical_value(&name_len, 2);
-
-    ret_size += name_len + dlen;
-    CALLOC(ret, ret_size, sizeof(char), return NULL);
+/** Starts the entry of a compound or list
+ * @param log Log to add to, or NULL
+ * @param node Node being written
+ * @param parent Entry of the enclosing compound or list
+ * @param pos Offset of the payload in the output
+ * @return Index of the entry, or LOG_NONE
+ */
+static size_t _log_start(_nbt_log_t *log, nbt_node_t *node, size_t parent, size_t pos) {
+    _nbt_log_entry_t *e;
 
-    ret[0] = MCNBT_TAG_BYTE_ARRAY;
-    if (name != NULL) {
-        _mcnbt_memcat(ret, name_size, 2, 1);
-        _mcnbt_memcat(ret, name, strlen(name), 3);
-        _mcnbt_memcat(ret, sdlen, 4, 3 + (int) strlen(name));
-        _mcnbt_memcat(ret, data, dlen, 7 + (int) strlen(name));
-    } else {
-        _mcnbt_memcat(ret, sdlen, 4, 1);
-        _mcnbt_memcat(ret, data, dlen, 5);
+    if (log == NULL || log->failed) {
+        return LOG_NONE;
     }
 
-    if (len != NULL) {
-        *len = ret_size;
+    if (log->count == log->cap) {
+        size_t cap = log->cap ? log->cap * 2 : LOG_MIN_CAP;
+        REALLOC(log->entries, cap * sizeof(_nbt_log_entry_t), log->failed = 1; return LOG_NONE);
+        log->cap = cap;
     }
 
-    FREE(name_size);
-    FREE(sdlen);
-
-    return ret;
+    e = &log->entries[log->count];
+    e->node = node;
+    e->pos = pos;
+    e->len = 0;
+    e->parent = parent;
+    e->ok = _nbt_node_get_arena(node) == NULL;
+    return log->count++;
 }
 
-static char *_serialize_string(nbt_node_t *node, size_t *len) {
-    ASSERT(node != NULL, return NULL);
-    ASSERT(nbt_node_get_type(node) == MCNBT_TAG_STRING, return NULL);
-    char *ret = NULL;
-    size_t ret_size = 3;
-    char *name_size = NULL;
-    char *data = nbt_node_get_data_str(node);
-    size_t dlen = strlen(data);
-    char *sdlen = _serialize_numerical_value(&dlen, 2);
-
-    char *name = nbt_node_get_name(node);
-    size_t name_len;
-    if (name != NULL) {
-        ret_size += 2;
-        name_len = strlen(name);
-    } else {
-        name_len = 0;
-    }
-
-    name_size = _serialize_numerical_value(&name_len, 2);
+static void _log_end(_nbt_log_t *log, size_t i, size_t len) {
+    _nbt_log_entry_t *e;
 
-    ret_size += name_len + dlen;
-    CALLOC(ret, ret_size, sizeof(char), return NULL);
-
-    ret[0] = MCNBT_TAG_STRING;
-    if (name != NULL) {
-        _mcnbt_memcat(ret, name_size, 2, 1);
-        _mcnbt_memcat(ret, name, strlen(name), 3);
-        _mcnbt_memcat(ret, sdlen, 2, 3 + (int) strlen(name));
-        _mcnbt_memcat(ret, data, dlen, 5 + (int) strlen(name));
-    } else {
-        _mcnbt_memcat(ret, sdlen, 2, 1);
-        _mcnbt_memcat(ret, data, dlen, 3);
+    if (i == LOG_NONE) {
+        return;
     }
 
-    if (len != NULL) {
-        *len = ret_size;
+    e = &log->entries[i];
+    e->len = len;
+    if (!e->ok && e->parent != LOG_NONE) {
+        log->entries[e->parent].ok = 0;
     }
-
-    FREE(name_size);
-    FREE(sdlen);
-
-    return ret;
 }
 
-static char *_serialize_compound(nbt_node_t *node, size_t *len);
-static char *_serialize_int_array(nbt_node_t *node, size_t *len);
-static char *_serialize_long_array(nbt_node_t *node, size_t *len);
+/** Caches the encodings of the logged nodes that are big enough to be worth keeping
+ * @param log Log of a serialization that succeeded
+ * @param buf The output
+ */
+static void _log_commit(_nbt_log_t *log, const unsigned char *buf) {
+    _nbt_source_t *src;
 
-static char *_serialize_list(nbt_node_t *node, size_t *len) {
-    ASSERT(node != NULL, return NULL);
-    ASSERT(nbt_node_get_type(node) == MCNBT_TAG_LIST, return NULL);
-    char *ret = NULL;
-    size_t ret_size = 6;
-    char *name_size = NULL;
-    size_t l = nbt_node_get_len(node);
-    char *sl = _serialize_numerical_value(&l, 4);
-    char **tmp = NULL;
-    char *t = NULL;
-    nbt_node_t *tmpnode;
-    size_t sizes[l];
-    size_t tmplen = 0;
-    size_t content_len = 0;
-    int cur_pos;
-
-    char *name = nbt_node_get_name(node);
-    size_t name_len;
-    if (name != NULL) {
-        ret_size += 2;
-        name_len = strlen(name);
-    } else {
-        name_len = 0;
+    if (log->failed) {
+        return;
     }
 
-    name_size = _serialize_numerical_value(&name_len, 2);
+    /* the buffers the unchanged nodes were copied from are let go of before new ones are made */
+    for (size_t i = 0; i < log->count; i++) {
+        _nbt_log_entry_t *e = &log->entries[i];
 
-    CALLOC(tmp, l, sizeof(char *), return NULL);
-    tmpnode = nbt_node_get_first_child(node);
-    for (int i = 0; i < l; i++) {
-        if (tmpnode == NULL) {
-            fprintf(stderr, "too few nodes in list\n");
-            goto free;
+        if (!e->ok) {
+            continue;
         }
 
-        switch (nbt_node_get_type(tmpnode)) {
-            case MCNBT_TAG_BYTE:
-                t = _serialize_byte(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_SHORT:
-                t = _serialize_short(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_INT:
-                t = _serialize_int(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_LONG:
-                t = _serialize_long(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_FLOAT:
-                t = _serialize_float(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_DOUBLE:
-                t = _serialize_double(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_BYTE_ARRAY:
-                t = _serialize_byte_array(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_STRING:
-                t = _serialize_string(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_LIST:
-                t = _serialize_list(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_COMPOUND:
-                t = _serialize_compound(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_INT_ARRAY:
-                t = _serialize_int_array(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_LONG_ARRAY:
-                t = _serialize_long_array(tmpnode, &tmplen);
-                break;
-            default:
-                break;
+        if (e->len < LOG_MIN_SIZE && (e->parent == LOG_NONE || !log->entries[e->parent].ok)) {
+            e->ok = 0;
+            _nbt_node_drop_encoded(e->node);
+        } else {
+            _nbt_node_set_encoded(e->node, NULL, 0, 0);
         }
-
-        *(tmp + i) = t;
-        sizes[i] = tmplen;
-        content_len += tmplen;
-        tmpnode = nbt_node_get_next_child(tmpnode);
     }
 
-    ret_size += name_len + content_len - l;
-    CALLOC(ret, ret_size, sizeof(char), return NULL);
-    ret[0] = MCNBT_TAG_LIST;
-    if (name != NULL) {
-        _mcnbt_memcat(ret, name_size, 2, 1);
-        _mcnbt_memcat(ret, name, strlen(name), 3);
-        ret[3 + strlen(name)] = nbt_node_get_list_type(node);
-        _mcnbt_memcat(ret, sl, 4, 4 + (int) strlen(name));
-
-        cur_pos = 8 + (int) strlen(name);
-        for (int i = 0; i < l; i++) {
-            _mcnbt_memcat(ret, (tmp[i] + 1), sizes[i] - 1, cur_pos);
-            cur_pos += sizes[i] - 1;
+    /* each node kept on its own gets a copy of its payload, the nodes inside it point into that copy */
+    for (size_t i = 0; i < log->count; i++) {
+        _nbt_log_entry_t *e = &log->entries[i];
+
+        if (!e->ok) {
+            continue;
         }
-    } else {
-        ret[1] = nbt_node_get_list_type(node);
-        _mcnbt_memcat(ret, sl, 4, 2);
-
-        cur_pos = 6;
-        for (int i = 0; i < l; i++) {
-            _mcnbt_memcat(ret, (tmp[i] + 1), sizes[i] - 1, cur_pos);
-            cur_pos += sizes[i] - 1;
+
+        if (e->parent != LOG_NONE && log->entries[e->parent].ok) {
+            _nbt_node_set_encoded(e->node, NULL, e->pos - log->entries[e->parent].pos, e->len);
+            continue;
         }
-    }
 
-    if (len != NULL) {
-        *len = ret_size;
-    }
+        MALLOC(src, sizeof(_nbt_source_t) + e->len, e->ok = 0; _nbt_node_drop_encoded(e->node); continue);
+        src->data = (unsigned char *) (src + 1);
+        src->size = e->len;
+        src->arena = NULL;
+        src->create = 0;
+        src->refs = 1;
+        memcpy(src + 1, buf + e->pos, e->len);
 
-free:
-    FREE(name_size);
-    FREE(sl);
-    for (int i = 0; i < l; i++) {
-        FREE(tmp[i]);
+        _nbt_node_set_encoded(e->node, src, 0, e->len);
+        _nbt_source_unref(src);
     }
-    FREE(tmp);
-    return ret;
 }
 
-static char *_serialize_int_array(nbt_node_t *node, size_t *len) {
-    ASSERT(node != NULL, return NULL);
-    ASSERT(nbt_node_get_type(node) == MCNBT_TAG_INT_ARRAY, return NULL);
-    char *ret = NULL;
-    size_t ret_size = 5;
-    char *name_size = NULL;
-    int *data = nbt_node_get_data_int_array(node);
-    size_t dlen = nbt_node_get_len(node);
-    char *sdlen = _serialize_numerical_value(&dlen, 4);
-    int pos;
-    char *tmp;
-
-    char *name = nbt_node_get_name(node);
-    size_t name_len;
-    if (name != NULL) {
-        ret_size += 2;
-        name_len = strlen(name);
-    } else {
-        name_len = 0;
-    }
-
-    name_size = _serialize_numerical_value(&name_len, 2);
+static int _write_payload(nbt_node_t *node, _nbt_out_t *out, _nbt_log_t *log, size_t parent);
 
-    ret_size += name_len + dlen * 4;
-    CALLOC(ret, ret_size, sizeof(char), return NULL);
-
-    ret[0] = MCNBT_TAG_INT_ARRAY;
-    if (name != NULL) {
-        _mcnbt_memcat(ret, name_size, 2, 1);
-        _mcnbt_memcat(ret, name, strlen(name), 3);
-        _mcnbt_memcat(ret, sdlen, 4, 3 + (int) strlen(name));
+/** Copies the payload of a deferred or unchanged compound or list
+ * @param out Output cursor
+ * @param node Node being written
+ * @param raw Its payload
+ * @param len Length of the payload
+ * @param log Log to add an unchanged node to, or NULL for a deferred one
+ * @param parent Entry of the enclosing compound or list
+ * @return 0 on success, -1 on failure
+ */
+static int _write_raw(_nbt_out_t *out, nbt_node_t *node, const unsigned char *raw, size_t len, _nbt_log_t *log,
+                      size_t parent) {
+    /* a node copied at the top keeps the encoding it has */
+    size_t entry = parent != LOG_NONE ? _log_start(log, node, parent, (size_t) (out->pos - out->start)) : LOG_NONE;
+
+    ASSERT(_write_bytes(out, raw, len) == 0, return -1);
+    _log_end(log, entry, len);
+    return 0;
+}
 
-        pos = 7 + (int) strlen(name);
-        for (int i = 0; i < dlen; i++) {
-            tmp = _serialize_numerical_value(&data[i], 4);
-            _mcnbt_memcat(ret, tmp, 4, pos);
-            pos += 4;
-            FREE(tmp);
+static int _write_payload(nbt_node_t *node, _nbt_out_t *out, _nbt_log_t *log, size_t parent) {
+    nbt_tag_type_t type = nbt_node_get_type(node);
+    const unsigned char *raw;
+    const char *str;
+    size_t len, start, entry;
+    int cached;
+    union {
+        float f;
+        double d;
+        uint32_t u32;
+        uint64_t u64;
+    } v;
+
+    ASSERT(type > MCNBT_TAG_END && type <= MCNBT_TAG_LONG_ARRAY, return -1);
+    ASSERT(_reserve(out, _fixed_size[type]) == 0, return -1);
+
+    switch (type) {
+        case MCNBT_TAG_BYTE:
+            *out->pos++ = (unsigned char) nbt_node_get_data_byte(node);
+            return 0;
+        case MCNBT_TAG_SHORT:
+            _nbt_put_be16(out->pos, (uint16_t) nbt_node_get_data_short(node));
+            out->pos += 2;
+            return 0;
+        case MCNBT_TAG_INT:
+            _nbt_put_be32(out->pos, (uint32_t) nbt_node_get_data_int(node));
+            out->pos += 4;
+            return 0;
+        case MCNBT_TAG_LONG:
+            _nbt_put_be64(out->pos, (uint64_t) nbt_node_get_data_long(node));
+            out->pos += 8;
+            return 0;
+        case MCNBT_TAG_FLOAT:
+            v.f = nbt_node_get_data_float(node);
+            _nbt_put_be32(out->pos, v.u32);
+            out->pos += 4;
+            return 0;
+        case MCNBT_TAG_DOUBLE:
+            v.d = nbt_node_get_data_double(node);
+            _nbt_put_be64(out->pos, v.u64);
+            out->pos += 8;
+            return 0;
+        case MCNBT_TAG_BYTE_ARRAY:
+            str = nbt_node_get_data_str_view(node, &len);
+            _nbt_put_be32(out->pos, (uint32_t) len);
+            out->pos += 4;
+            return _write_bytes(out, str, len);
+        case MCNBT_TAG_STRING:
+            str = nbt_node_get_data_str_view(node, &len);
+            ASSERT(len <= MAX_SHORT_LEN, return -1);
+            _nbt_put_be16(out->pos, (uint16_t) len);
+            out->pos += 2;
+            return _write_bytes(out, str, len);
+        case MCNBT_TAG_INT_ARRAY: {
+            const int *data = nbt_node_get_data_int_array_view(node, &len);
+            _nbt_put_be32(out->pos, (uint32_t) len);
+            out->pos += 4;
+            return _write_swapped(out, data, 4, len);
         }
-    } else {
-        _mcnbt_memcat(ret, sdlen, 4, 1);
-
-        pos = 5;
-        for (int i = 0; i < dlen; i++) {
-            tmp = _serialize_numerical_value(&data[i], 4);
-            _mcnbt_memcat(ret, tmp, 4, pos);
-            pos += 4;
-            FREE(tmp);
+        case MCNBT_TAG_LONG_ARRAY: {
+            const long *data = nbt_node_get_data_long_array_view(node, &len);
+            _nbt_put_be32(out->pos, (uint32_t) len);
+            out->pos += 4;
+            return _write_swapped(out, data, 8, len);
         }
+        case MCNBT_TAG_LIST:
+            if ((cached = _nbt_node_get_raw(node, &raw, &len)) != 0) {
+                return _write_raw(out, node, raw, len, cached == 2 ? log : NULL, parent);
+            }
+
+            start = (size_t) (out->pos - out->start);
+            entry = _log_start(log, node, parent, start);
+            ASSERT(_reserve(out, 5) == 0, return -1);
+            out->pos[0] = (unsigned char) nbt_node_get_list_type(node);
+            _nbt_put_be32(out->pos + 1, (uint32_t) nbt_node_get_len(node));
+            out->pos += 5;
+            if ((raw = _nbt_node_get_packed(node, &len)) != NULL) {
+                ASSERT(_write_swapped(out, raw, _nbt_fixed_size(nbt_node_get_list_type(node)), len) == 0, return -1);
+            } else {
+                for (nbt_node_t *c = nbt_node_get_first_child(node); c; c = nbt_node_get_next_child(c)) {
+                    ASSERT(nbt_node_get_type(c) == nbt_node_get_list_type(node), return -1);
+                    ASSERT(_write_payload(c, out, log, entry) == 0, return -1);
+                }
+            }
+            _log_end(log, entry, (size_t) (out->pos - out->start) - start);
+            return 0;
+        case MCNBT_TAG_COMPOUND:
+            if ((cached = _nbt_node_get_raw(node, &raw, &len)) != 0) {
+                return _write_raw(out, node, raw, len, cached == 2 ? log : NULL, parent);
+            }
+
+            start = (size_t) (out->pos - out->start);
+            entry = _log_start(log, node, parent, start);
+            for (nbt_node_t *c = nbt_node_get_first_child(node); c; c = nbt_node_get_next_child(c)) {
+                ASSERT(_write_name(c, out) == 0, return -1);
+                ASSERT(_write_payload(c, out, log, entry) == 0, return -1);
+            }
+            ASSERT(_reserve(out, 1) == 0, return -1);
+            *out->pos++ = MCNBT_TAG_END;
+            _log_end(log, entry, (size_t) (out->pos - out->start) - start);
+            return 0;
+        default:
+            return -1;
     }
-
-    if (len != NULL) {
-        *len = ret_size;
-    }
-
-    FREE(name_size);
-    FREE(sdlen);
-
-    return ret;
 }
 
-static char *_serialize_long_array(nbt_node_t *node, size_t *len) {
-    ASSERT(node != NULL, return NULL);
-    ASSERT(nbt_node_get_type(node) == MCNBT_TAG_LONG_ARRAY, return NULL);
-    char *ret = NULL;
-    size_t ret_size = 5;
-    char *name_size = NULL;
-    long *data = nbt_node_get_data_long_array(node);
-    size_t dlen = nbt_node_get_len(node);
-    char *sdlen = _serialize_numerical_value(&dlen, 4);
-    char *tmp;
-    int pos;
-
-    char *name = nbt_node_get_name(node);
-    size_t name_len;
-    if (name != NULL) {
-        ret_size += 2;
-        name_len = strlen(name);
-    } else {
-        name_len = 0;
-    }
+/** Computes the size of a payload without its type and name
+ * @param node Tag to measure
+ * @return Size in bytes, or 0 if the tree cannot be serialized
+ */
+size_t _nbt_payload_size(nbt_node_t *node) {
+    return _payload_size(node, 0);
+}
 
-    name_size = _serialize_numerical_value(&name_len, 2);
+/** Writes a payload without its type and name through an output buffer
+ * @param node Tag to write
+ * @param out Buffer to write to; flushed whenever it fills up
+ * @return 0 on success, -1 on failure
+ */
+int _nbt_write_payload(nbt_node_t *node, _nbt_out_t *out) {
+    return _write_payload(node, out, NULL, LOG_NONE);
+}
 
-    ret_size += name_len + dlen * 8;
-    CALLOC(ret, ret_size, sizeof(char), return NULL);
+/** Writes a named tag through an output buffer
+ * @param node Tag to write
+ * @param out Buffer to write to; flushed whenever it fills up
+ * @return 0 on success, -1 on failure
+ */
+int _nbt_serialize_out(nbt_node_t *node, _nbt_out_t *out) {
+    ASSERT(_write_name(node, out) == 0, return -1);
+    return _write_payload(node, out, NULL, LOG_NONE);
+}
 
-    ret[0] = MCNBT_TAG_LONG_ARRAY;
-    if (name != NULL) {
-        _mcnbt_memcat(ret, name_size, 2, 1);
-        _mcnbt_memcat(ret, name, strlen(name), 3);
-        _mcnbt_memcat(ret, sdlen, 4, 3 + (int) strlen(name));
+size_t nbt_node_serialized_size(nbt_node_t *node) {
+    size_t name_len, payload;
+    ASSERT(node != NULL, return 0);
 
-        pos = 7 + (int) strlen(name);
-        for (int i = 0; i < dlen; i++) {
-            tmp = _serialize_numerical_value(&data[i], 8);
-            _mcnbt_memcat(ret, tmp, 8, pos);
-            pos += 8;
-            FREE(tmp);
-        }
-    } else {
-        _mcnbt_memcat(ret, sdlen, 4, 1);
-
-        pos = 5;
-        for (int i = 0; i < dlen; i++) {
-            tmp = _serialize_numerical_value(&data[i], 8);
-            _mcnbt_memcat(ret, tmp, 8, pos);
-            pos += 8;
-            FREE(tmp);
-        }
-    }
+    nbt_node_get_name_view(node, &name_len);
+    ASSERT(name_len <= MAX_SHORT_LEN, return 0);
 
-    if (len != NULL) {
-        *len = ret_size;
-    }
+    payload = _payload_size(node, 0);
+    ASSERT(payload != 0, return 0);
+    return 3 + name_len + payload;
+}
 
-    FREE(name_size);
-    FREE(sdlen);
+static size_t _serialize_into(nbt_node_t *node, void *buf, size_t size) {
+    _nbt_out_t out;
+    _nbt_log_t log;
+    size_t need;
+    ASSERT(buf != NULL, return 0);
+
+    need = nbt_node_serialized_size(node);
+    ASSERT(need != 0 && need <= size, return 0);
+
+    out.start = buf;
+    out.pos = buf;
+    out.end = out.start + size;
+    out.flush = NULL;
+    memset(&log, 0, sizeof(log));
+    ASSERT(_write_name(node, &out) == 0 && _write_payload(node, &out, &log, LOG_NONE) == 0,
+           FREE(log.entries); return 0);
+
+    _log_commit(&log, buf);
+    FREE(log.entries);
+    return need;
+}
 
+size_t nbt_node_serialize_into(nbt_node_t *node, void *buf, size_t size) {
+    int scope = _nbt_alloc_enter(MCNBT_ALLOC_SERIALIZE);
+    size_t ret = _serialize_into(node, buf, size);
+    _nbt_alloc_leave(scope);
     return ret;
 }
 
-static char *_serialize_compound(nbt_node_t *node, size_t *len) {
+static char *_serialize(nbt_node_t *node, size_t *len) {
+    char *ret;
+    size_t size;
     ASSERT(node != NULL, return NULL);
-    ASSERT(nbt_node_get_type(node) == MCNBT_TAG_COMPOUND, return NULL);
-    char *ret = NULL;
-    size_t ret_size = 2;
-    char *name_size = NULL;
-    size_t l = nbt_node_get_len(node);
-    char **tmp = NULL;
-    char *t = NULL;
-    nbt_node_t *tmpnode;
-    size_t sizes[l];
-    size_t tmplen = 0;
-    size_t content_len = 0;
-    int cur_pos;
-
-    char *name = nbt_node_get_name(node);
-    size_t name_len;
-    if (name != NULL) {
-        ret_size += 2;
-        name_len = strlen(name);
-    } else {
-        name_len = 0;
-    }
-
-    name_size = _serialize_numerical_value(&name_len, 2);
-
-    CALLOC(tmp, l, sizeof(char *), return NULL);
-    tmpnode = nbt_node_get_first_child(node);
-    for (int i = 0; i < l; i++) {
-        if (tmpnode == NULL) {
-            fprintf(stderr, "too few nodes in list\n");
-            goto free;
-        }
 
-        switch (nbt_node_get_type(tmpnode)) {
-            case MCNBT_TAG_BYTE:
-                t = _serialize_byte(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_SHORT:
-                t = _serialize_short(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_INT:
-                t = _serialize_int(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_LONG:
-                t = _serialize_long(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_FLOAT:
-                t = _serialize_float(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_DOUBLE:
-                t = _serialize_double(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_BYTE_ARRAY:
-                t = _serialize_byte_array(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_STRING:
-                t = _serialize_string(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_LIST:
-                t = _serialize_list(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_COMPOUND:
-                t = _serialize_compound(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_INT_ARRAY:
-                t = _serialize_int_array(tmpnode, &tmplen);
-                break;
-            case MCNBT_TAG_LONG_ARRAY:
-                t = _serialize_long_array(tmpnode, &tmplen);
-                break;
-            default:
-                break;
-        }
-
-        *(tmp + i) = t;
-        sizes[i] = tmplen;
-        content_len += tmplen;
-        tmpnode = nbt_node_get_next_child(tmpnode);
+    if (nbt_node_get_type(node) != MCNBT_TAG_COMPOUND) {
+        fprintf(stderr, "root node must be compound\n");
+        return NULL;
     }
 
-    ret_size += name_len + content_len;
-    CALLOC(ret, ret_size, sizeof(char), return NULL);
-    ret[0] = MCNBT_TAG_COMPOUND;
-    if (name != NULL) {
-        _mcnbt_memcat(ret, name_size, 2, 1);
-        _mcnbt_memcat(ret, name, strlen(name), 3);
-
-        cur_pos = 3 + (int) strlen(name);
-        for (int i = 0; i < l; i++) {
-            _mcnbt_memcat(ret, tmp[i], sizes[i], cur_pos);
-            cur_pos += sizes[i];
-        }
-    } else {
-        cur_pos = 1;
-        for (int i = 0; i < l; i++) {
-            _mcnbt_memcat(ret, tmp[i], sizes[i], cur_pos);
-            cur_pos += sizes[i];
-        }
-    }
-    ret[cur_pos] = MCNBT_TAG_END;
+    *len = 0;
+    size = nbt_node_serialized_size(node);
+    ASSERT(size != 0, return NULL);
 
-    if (len != NULL) {
-        *len = ret_size;
-    }
+    MALLOC(ret, size, return NULL);
+    ASSERT(_serialize_into(node, ret, size) == size, FREE(ret); return NULL);
 
-    free:
-    FREE(name_size);
-    for (int i = 0; i < l; i++) {
-        FREE(tmp[i]);
-    }
-    FREE(tmp);
+    *len = size;
     return ret;
 }
 
 char *nbt_node_serialize(nbt_node_t *node, size_t *len) {
-    ASSERT(node != NULL, return NULL);
-
-    if (nbt_node_get_type(node) != MCNBT_TAG_COMPOUND) {
-        fprintf(stderr, "root node must be compound\n");
-        return NULL;
-    }
-
-    *len = 0;
-    return _serialize_compound(node, len);
-}
\ No newline at end of file
+    int scope = _nbt_alloc_enter(MCNBT_ALLOC_SERIALIZE);
+    char *ret = _serialize(node, len);
+    _nbt_alloc_leave(scope);
+    return ret;
+}
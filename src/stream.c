@@ -0,0 +1,165 @@
+/*
+ *  stream.c
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stream.h"
+#include "util.h"
+
+/* Two blocks are decompressed by a background thread while the parser
+ * consumes the other one. */
+struct _nbt_readahead_t {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    _nbt_read_fn read;
+    void *ctx;
+
+    char *buf[2];
+    ssize_t len[2];
+    size_t block_size;
+
+    int head;
+    int count;
+    size_t off;
+
+    int done;
+    int error;
+    int stop;
+};
+
+static void *_readahead_run(void *arg) {
+    _nbt_readahead_t *ra = arg;
+    ssize_t r;
+    int slot;
+
+    for (;;) {
+        pthread_mutex_lock(&ra->lock);
+        while (ra->count == 2 && !ra->stop) {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        }
+        if (ra->stop) {
+            pthread_mutex_unlock(&ra->lock);
+            break;
+        }
+        slot = (ra->head + ra->count) % 2;
+        pthread_mutex_unlock(&ra->lock);
+
+        r = ra->read(ra->ctx, ra->buf[slot], ra->block_size);
+
+        pthread_mutex_lock(&ra->lock);
+        if (r <= 0) {
+            ra->done = 1;
+            ra->error = r < 0;
+        } else {
+            ra->len[slot] = r;
+            ra->count++;
+        }
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+
+        if (r <= 0) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+_nbt_readahead_t *_nbt_readahead_new(_nbt_read_fn read, void *ctx, size_t block_size) {
+    _nbt_readahead_t *ret;
+    CALLOC(ret, 1, sizeof(_nbt_readahead_t), return NULL);
+
+    ret->read = read;
+    ret->ctx = ctx;
+    ret->block_size = block_size;
+
+    MALLOC(ret->buf[0], block_size, goto fail);
+    MALLOC(ret->buf[1], block_size, goto fail);
+
+    pthread_mutex_init(&ret->lock, NULL);
+    pthread_cond_init(&ret->cond, NULL);
+
+    if (pthread_create(&ret->thread, NULL, _readahead_run, ret) != 0) {
+        pthread_cond_destroy(&ret->cond);
+        pthread_mutex_destroy(&ret->lock);
+        goto fail;
+    }
+
+    return ret;
+
+fail:
+    FREE(ret->buf[0]);
+    FREE(ret->buf[1]);
+    FREE(ret);
+    return NULL;
+}
+
+ssize_t _nbt_readahead_read(void *ctx, void *buf, size_t len) {
+    _nbt_readahead_t *ra = ctx;
+    ssize_t ret;
+    size_t n;
+
+    pthread_mutex_lock(&ra->lock);
+    while (ra->count == 0 && !ra->done) {
+        pthread_cond_wait(&ra->cond, &ra->lock);
+    }
+
+    if (ra->count == 0) {
+        ret = ra->error ? -1 : 0;
+        pthread_mutex_unlock(&ra->lock);
+        return ret;
+    }
+
+    n = (size_t) ra->len[ra->head] - ra->off;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(buf, ra->buf[ra->head] + ra->off, n);
+    ra->off += n;
+
+    if (ra->off == (size_t) ra->len[ra->head]) {
+        ra->head = (ra->head + 1) % 2;
+        ra->count--;
+        ra->off = 0;
+        pthread_cond_broadcast(&ra->cond);
+    }
+
+    pthread_mutex_unlock(&ra->lock);
+    return (ssize_t) n;
+}
+
+void _nbt_readahead_free(_nbt_readahead_t *ra) {
+    ASSERT(ra != NULL, return);
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = 1;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+
+    pthread_join(ra->thread, NULL);
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+
+    FREE(ra->buf[0]);
+    FREE(ra->buf[1]);
+    FREE(ra);
+}
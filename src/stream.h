@@ -0,0 +1,50 @@
+/*
+ *  stream.h
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBMCNBT_STREAM_H
+#define LIBMCNBT_STREAM_H
+
+#include <sys/types.h>
+
+#include "mcnbt.h"
+
+#define READAHEAD_BLOCK 262144
+
+typedef ssize_t (*_nbt_read_fn)(void *ctx, void *buf, size_t len);
+
+typedef struct _nbt_readahead_t _nbt_readahead_t;
+
+_nbt_readahead_t *_nbt_readahead_new(_nbt_read_fn read, void *ctx, size_t block_size);
+ssize_t _nbt_readahead_read(void *ra, void *buf, size_t len);
+void _nbt_readahead_free(_nbt_readahead_t *ra);
+
+nbt_node_t *_nbt_parse_stream(_nbt_read_fn read, void *ctx, nbt_arena_t *arena);
+
+/* output buffer of the serializer; flush empties it, or is NULL when the buffer is sized up front */
+typedef struct _nbt_out_t {
+    unsigned char *start;
+    unsigned char *pos;
+    unsigned char *end;
+    int (*flush)(struct _nbt_out_t *out);
+} _nbt_out_t;
+
+int _nbt_serialize_out(nbt_node_t *node, _nbt_out_t *out);
+size_t _nbt_payload_size(nbt_node_t *node);
+int _nbt_write_payload(nbt_node_t *node, _nbt_out_t *out);
+
+#endif //LIBMCNBT_STREAM_H
@@ -0,0 +1,237 @@
+/*
+ *  swap.c
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SWAP_X86 1
+#include <immintrin.h>
+#endif
+
+#include "scan.h"
+#include "swap.h"
+
+typedef void (*_nbt_swap_fn)(void *dst, const void *src, size_t count);
+
+static struct {
+    _nbt_swap_fn swap16;
+    _nbt_swap_fn swap32;
+    _nbt_swap_fn swap64;
+} _kernels;
+
+static pthread_once_t _kernels_once = PTHREAD_ONCE_INIT;
+
+/* the portable kernels also serve the tails left over by the vector ones */
+static void _swap16_scalar(void *dst, const void *src, size_t count) {
+    const unsigned char *s = src;
+    unsigned char *d = dst;
+
+    for (size_t i = 0; i < count; i++) {
+        uint16_t v = _nbt_be16(s + i * 2);
+        memcpy(d + i * 2, &v, 2);
+    }
+}
+
+static void _swap32_scalar(void *dst, const void *src, size_t count) {
+    const unsigned char *s = src;
+    unsigned char *d = dst;
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t v = _nbt_be32(s + i * 4);
+        memcpy(d + i * 4, &v, 4);
+    }
+}
+
+static void _swap64_scalar(void *dst, const void *src, size_t count) {
+    const unsigned char *s = src;
+    unsigned char *d = dst;
+
+    for (size_t i = 0; i < count; i++) {
+        uint64_t v = _nbt_be64(s + i * 8);
+        memcpy(d + i * 8, &v, 8);
+    }
+}
+
+#ifdef SWAP_X86
+static const unsigned char _mask16[16] = {1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14};
+static const unsigned char _mask32[16] = {3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12};
+static const unsigned char _mask64[16] = {7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8};
+
+/** Swaps the bytes of every 16-bit lane of a vector
+ * @param v Vector to swap
+ * @return The swapped vector
+ */
+__attribute__((target("sse2")))
+static inline __m128i _bswap16_sse2(__m128i v) {
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+__attribute__((target("sse2")))
+static void _swap16_sse2(void *dst, const void *src, size_t count) {
+    const char *s = src;
+    char *d = dst;
+    size_t n = count / 8;
+
+    for (size_t i = 0; i < n; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + i * 16));
+        _mm_storeu_si128((__m128i *) (d + i * 16), _bswap16_sse2(v));
+    }
+    _swap16_scalar(d + n * 16, s + n * 16, count - n * 8);
+}
+
+__attribute__((target("sse2")))
+static void _swap32_sse2(void *dst, const void *src, size_t count) {
+    const char *s = src;
+    char *d = dst;
+    size_t n = count / 4;
+
+    for (size_t i = 0; i < n; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + i * 16));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i *) (d + i * 16), _bswap16_sse2(v));
+    }
+    _swap32_scalar(d + n * 16, s + n * 16, count - n * 4);
+}
+
+__attribute__((target("sse2")))
+static void _swap64_sse2(void *dst, const void *src, size_t count) {
+    const char *s = src;
+    char *d = dst;
+    size_t n = count / 2;
+
+    for (size_t i = 0; i < n; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + i * 16));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        _mm_storeu_si128((__m128i *) (d + i * 16), _bswap16_sse2(v));
+    }
+    _swap64_scalar(d + n * 16, s + n * 16, count - n * 2);
+}
+
+/** Shuffles whole 16-byte blocks with pshufb
+ * @param dst Destination
+ * @param src Source
+ * @param size Number of bytes available
+ * @param mask Byte order of one block
+ * @return Number of bytes converted, a multiple of 16
+ */
+__attribute__((target("ssse3")))
+static size_t _shuffle_ssse3(char *dst, const char *src, size_t size, const unsigned char *mask) {
+    __m128i m = _mm_loadu_si128((const __m128i *) mask);
+    size_t n = size / 16;
+
+    for (size_t i = 0; i < n; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + i * 16));
+        _mm_storeu_si128((__m128i *) (dst + i * 16), _mm_shuffle_epi8(v, m));
+    }
+    return n * 16;
+}
+
+/** Shuffles whole 64-byte blocks with vpshufb, two registers at a time
+ * @param dst Destination
+ * @param src Source
+ * @param size Number of bytes available
+ * @param mask Byte order of one 16-byte lane
+ * @return Number of bytes converted, a multiple of 64
+ */
+__attribute__((target("avx2")))
+static size_t _shuffle_avx2(char *dst, const char *src, size_t size, const unsigned char *mask) {
+    __m256i m = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) mask));
+    size_t n = size / 64;
+
+    for (size_t i = 0; i < n; i++) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (src + i * 64));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (src + i * 64 + 32));
+        _mm256_storeu_si256((__m256i *) (dst + i * 64), _mm256_shuffle_epi8(a, m));
+        _mm256_storeu_si256((__m256i *) (dst + i * 64 + 32), _mm256_shuffle_epi8(b, m));
+    }
+    return n * 64;
+}
+
+static void _swap16_ssse3(void *dst, const void *src, size_t count) {
+    size_t done = _shuffle_ssse3(dst, src, count * 2, _mask16);
+    _swap16_scalar((char *) dst + done, (const char *) src + done, count - done / 2);
+}
+
+static void _swap32_ssse3(void *dst, const void *src, size_t count) {
+    size_t done = _shuffle_ssse3(dst, src, count * 4, _mask32);
+    _swap32_scalar((char *) dst + done, (const char *) src + done, count - done / 4);
+}
+
+static void _swap64_ssse3(void *dst, const void *src, size_t count) {
+    size_t done = _shuffle_ssse3(dst, src, count * 8, _mask64);
+    _swap64_scalar((char *) dst + done, (const char *) src + done, count - done / 8);
+}
+
+static void _swap16_avx2(void *dst, const void *src, size_t count) {
+    size_t done = _shuffle_avx2(dst, src, count * 2, _mask16);
+    _swap16_ssse3((char *) dst + done, (const char *) src + done, count - done / 2);
+}
+
+static void _swap32_avx2(void *dst, const void *src, size_t count) {
+    size_t done = _shuffle_avx2(dst, src, count * 4, _mask32);
+    _swap32_ssse3((char *) dst + done, (const char *) src + done, count - done / 4);
+}
+
+static void _swap64_avx2(void *dst, const void *src, size_t count) {
+    size_t done = _shuffle_avx2(dst, src, count * 8, _mask64);
+    _swap64_ssse3((char *) dst + done, (const char *) src + done, count - done / 8);
+}
+#endif
+
+/* picks the widest kernels the running CPU supports */
+static void _kernels_select(void) {
+    _kernels.swap16 = _swap16_scalar;
+    _kernels.swap32 = _swap32_scalar;
+    _kernels.swap64 = _swap64_scalar;
+
+#ifdef SWAP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        _kernels.swap16 = _swap16_avx2;
+        _kernels.swap32 = _swap32_avx2;
+        _kernels.swap64 = _swap64_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        _kernels.swap16 = _swap16_ssse3;
+        _kernels.swap32 = _swap32_ssse3;
+        _kernels.swap64 = _swap64_ssse3;
+    } else if (__builtin_cpu_supports("sse2")) {
+        _kernels.swap16 = _swap16_sse2;
+        _kernels.swap32 = _swap32_sse2;
+        _kernels.swap64 = _swap64_sse2;
+    }
+#endif
+}
+
+void _nbt_swap16(void *dst, const void *src, size_t count) {
+    pthread_once(&_kernels_once, _kernels_select);
+    _kernels.swap16(dst, src, count);
+}
+
+void _nbt_swap32(void *dst, const void *src, size_t count) {
+    pthread_once(&_kernels_once, _kernels_select);
+    _kernels.swap32(dst, src, count);
+}
+
+void _nbt_swap64(void *dst, const void *src, size_t count) {
+    pthread_once(&_kernels_once, _kernels_select);
+    _kernels.swap64(dst, src, count);
+}
@@ -0,0 +1,31 @@
+/*
+ *  swap.h
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBMCNBT_SWAP_H
+#define LIBMCNBT_SWAP_H
+
+#include <stddef.h>
+
+/* Convert count elements between big-endian and host order. The same call
+ * works in both directions; src and dst need no particular alignment but
+ * must not overlap unless they are equal. */
+void _nbt_swap16(void *dst, const void *src, size_t count);
+void _nbt_swap32(void *dst, const void *src, size_t count);
+void _nbt_swap64(void *dst, const void *src, size_t count);
+
+#endif //LIBMCNBT_SWAP_H
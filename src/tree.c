@@ -16,10 +16,15 @@
  *  License along with this library; if not see <http://www.gnu.org/licenses/>.
  */
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "mcnbt.h"
+#include "arena.h"
+#include "intern.h"
+#include "scan.h"
 #include "tree.h"
 #include "util.h"
 
@@ -36,6 +41,7 @@ struct _nbt_node_t {
     } data;
 
     char *name;
+    size_t name_len;
 
     struct _nbt_node_t *parent;
     struct _nbt_node_t *first_child;
@@ -43,20 +49,491 @@ struct _nbt_node_t {
     struct _nbt_node_t *next_child;
     struct _nbt_node_t *prev_child;
 
-    /* for byte arrays and strings */
+    /* maintained for compounds and lists */
+    size_t child_count;
+
+    /* lists also keep their children in order for random access */
+    struct _nbt_node_t **children;
+    size_t children_cap;
+
+    /* for byte arrays and strings, and the element count of packed lists */
     size_t len;
 
     /* used only for Lists */
     nbt_tag_type_t list_type;
+
+    /* set when the node, its name and its payload live in an arena */
+    nbt_arena_t *arena;
+
+    int flags;
+
+    /* children not parsed yet, see _nbt_node_materialize(); with NODE_ENCODED the encoding of a clean subtree */
+    _nbt_source_t *src;
+    size_t src_pos;
+    size_t src_len;
+
+    /* name lookup table for large compounds, see nbt_node_find_child() */
+    struct _nbt_child_index_t *index;
+
+    /* valid while NODE_HASHED is set, see nbt_node_hash() */
+    uint64_t hash;
+};
+
+struct _nbt_index_slot_t {
+    size_t hash;
+    nbt_node_t *node;
+};
+
+/* open addressing with linear probing; cap is a power of two */
+struct _nbt_child_index_t {
+    size_t cap;
+    size_t count;
+
+    /* set when two children share a name; removals then drop the index */
+    int dups;
+    struct _nbt_index_slot_t slots[];
 };
 
+/* name or payload point into a caller-owned buffer and are not terminated */
+#define NODE_BORROWED_NAME 0x1
+#define NODE_BORROWED_DATA 0x2
+
+/* a list of numbers keeping its elements in data.str instead of child nodes */
+#define NODE_PACKED 0x4
+
+/* hash holds the hash of the subtree; cleared on the way up by _touch() */
+#define NODE_HASHED 0x8
+
+/* data.str points into an _nbt_shared_t and is copied before it is written */
+#define NODE_SHARED_DATA 0x10
+
+/* children are being added by _nbt_node_materialize(), which changes nothing visible */
+#define NODE_LOADING 0x20
+
+/* name or string payload is shared through the intern table and must not be written */
+#define NODE_INTERNED_NAME 0x40
+#define NODE_INTERNED_DATA 0x80
+
+/* src, src_pos and src_len hold the payload of a loaded subtree as last written or read; src is NULL
+ * when src_pos is relative to the payload of the parent, which is then encoded as well. Only compounds
+ * and lists are encoded, and an encoded node has only encoded or deferred compounds and lists below it */
+#define NODE_ENCODED 0x100
+
+/* heap nodes intern every name but only strings up to this length */
+#define INTERN_MAX_NAME ((size_t) -1)
+#define INTERN_MAX_STRING 64
+
+#define SHARED_BLOCK(p) ((_nbt_shared_t *) ((char *) (p) - offsetof(_nbt_shared_t, data)))
+
+#define DEFERRED(n) ((n)->src != NULL && !((n)->flags & NODE_ENCODED))
+
+/* makes the children of a node available as nodes */
+#define MATERIALIZE(n) do { if (DEFERRED(n) || ((n)->flags & NODE_PACKED)) { _nbt_node_materialize(n); } } while (0)
+
+/* parses deferred children but leaves packed lists packed */
+#define LOAD(n) do { if (DEFERRED(n)) { _load(n); } } while (0)
+
+/* compounds with more children than this get an index on first lookup */
+#define INDEX_THRESHOLD 8
+#define INDEX_MIN_CAP 16
+
+#define CHILDREN_MIN_CAP 4
+
+static void *_node_alloc(nbt_arena_t *arena, size_t size) {
+    void *ret;
+
+    if (arena != NULL) {
+        ret = _nbt_arena_alloc(arena, size);
+        ASSERT(ret != NULL, _mcnbt_alloc_fail(size));
+        return ret;
+    }
+
+    MALLOC(ret, size, return NULL);
+    return ret;
+}
+
+/** Copies a name or string for a node, through the intern table for heap nodes
+ * @param arena Arena of the node, or NULL for the heap
+ * @param str String to copy, need not be NUL terminated
+ * @param len Length of str
+ * @param max Longest string to intern
+ * @param interned Set to 1 if the copy is interned, 0 otherwise
+ * @return A NUL terminated copy, or NULL on failure
+ */
+static char *_copy_str(nbt_arena_t *arena, const char *str, size_t len, size_t max, int *interned) {
+    char *ret;
+
+    *interned = 0;
+    if (arena == NULL && len <= max && (ret = _nbt_intern(str, len)) != NULL) {
+        *interned = 1;
+        return ret;
+    }
+
+    ret = _node_alloc(arena, len + 1);
+    ASSERT(ret != NULL, return NULL);
+    memcpy(ret, str, len);
+    ret[len] = '\0';
+    return ret;
+}
+
+static void _release_name(nbt_node_t *node) {
+    if (node->flags & NODE_INTERNED_NAME) {
+        _nbt_intern_release(node->name);
+    } else if (node->arena == NULL && !(node->flags & NODE_BORROWED_NAME)) {
+        FREE(node->name);
+    }
+    node->name = NULL;
+    node->name_len = 0;
+    node->flags &= ~(NODE_BORROWED_NAME | NODE_INTERNED_NAME);
+}
+
+/** Frees a payload buffer unless it is borrowed, in an arena or still shared
+ * @param node Node the buffer belongs to
+ * @param data Buffer to free
+ */
+static void _free_data(nbt_node_t *node, void *data) {
+    if (node->flags & NODE_SHARED_DATA) {
+        _nbt_shared_unref(SHARED_BLOCK(data));
+    } else if (node->flags & NODE_INTERNED_DATA) {
+        _nbt_intern_release(data);
+    } else if (node->arena == NULL && !(node->flags & NODE_BORROWED_DATA)) {
+        FREE(data);
+    }
+    node->flags &= ~(NODE_BORROWED_DATA | NODE_SHARED_DATA | NODE_INTERNED_DATA);
+}
+
+static void _release_data(nbt_node_t *node) {
+    _free_data(node, node->data.str);
+    node->data.str = NULL;
+}
+
+/** Gives a node a private copy of a payload it shares with other nodes
+ * @param node Node about to have its payload written
+ * @return 1 if the payload was copied, 0 if it was private already, -1 on failure
+ */
+static int _unshare(nbt_node_t *node) {
+    const void *data = node->data.str;
+    size_t size;
+    char *tmp;
+
+    if (node->flags & NODE_SHARED_DATA) {
+        size = SHARED_BLOCK(data)->size;
+    } else if (node->flags & NODE_INTERNED_DATA) {
+        size = _nbt_intern_len(data) + 1;
+    } else {
+        return 0;
+    }
+
+    MALLOC(tmp, size, return -1);
+    memcpy(tmp, data, size);
+
+    _release_data(node);
+    node->data.str = tmp;
+    return 1;
+}
+
+/** Drops the cached encoding of a node, handing the encoded children their own first
+ * @param node Encoded node about to change
+ */
+static void _unencode(nbt_node_t *node) {
+    if (node->src == NULL) {
+        _unencode(node->parent);
+    }
+
+    for (nbt_node_t *c = node->first_child; c != NULL; c = c->next_child) {
+        if ((c->flags & NODE_ENCODED) && c->src == NULL) {
+            REF_INC(node->src->refs);
+            c->src = node->src;
+            c->src_pos += node->src_pos;
+        }
+    }
+
+    _nbt_source_unref(node->src);
+    node->src = NULL;
+    node->flags &= ~NODE_ENCODED;
+}
+
+/** Drops the cached hashes and encodings of a node and of every ancestor that still has one
+ * @param node Node whose subtree changed
+ */
+static void _touch(nbt_node_t *node) {
+    if (node->flags & NODE_LOADING) {
+        return;
+    }
+
+    node->flags &= ~NODE_HASHED;
+    if (node->flags & NODE_ENCODED) {
+        _unencode(node);
+    }
+
+    for (nbt_node_t *p = node->parent; p != NULL && (p->flags & (NODE_HASHED | NODE_ENCODED)); p = p->parent) {
+        p->flags &= ~NODE_HASHED;
+        if (p->flags & NODE_ENCODED) {
+            _unencode(p);
+        }
+    }
+}
+
+/* interned names carry their hash */
+static size_t _child_hash(nbt_node_t *child) {
+    if (child->flags & NODE_INTERNED_NAME) {
+        return _nbt_intern_hash(child->name);
+    }
+    return _nbt_name_hash(child->name, child->name_len);
+}
+
+static int _name_eq(nbt_node_t *node, const char *name, size_t len) {
+    /* a caller holding the interned name gets away with the pointer comparison */
+    return node->name_len == len && (node->name == name || len == 0 || memcmp(node->name, name, len) == 0);
+}
+
+static void _index_drop(nbt_node_t *node) {
+    if (node->arena == NULL) {
+        FREE(node->index);
+    }
+    node->index = NULL;
+}
+
+static struct _nbt_index_slot_t *_index_probe(struct _nbt_child_index_t *idx, const char *name, size_t len,
+                                              size_t hash) {
+    size_t mask = idx->cap - 1;
+    size_t i = hash & mask;
+
+    while (idx->slots[i].node != NULL) {
+        if (idx->slots[i].hash == hash && _name_eq(idx->slots[i].node, name, len)) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &idx->slots[i];
+}
+
+/** Allocates an index and fills it with the children of a compound
+ * @param node Compound to index
+ * @param cap Number of slots, a power of two large enough for every child
+ * @return 0 on success, -1 on failure
+ */
+static int _index_fill(nbt_node_t *node, size_t cap) {
+    struct _nbt_child_index_t *idx;
+    struct _nbt_index_slot_t *s;
+    size_t size = sizeof(struct _nbt_child_index_t) + cap * sizeof(struct _nbt_index_slot_t);
+
+    idx = _node_alloc(node->arena, size);
+    ASSERT(idx != NULL, return -1);
+    memset(idx, 0, size);
+    idx->cap = cap;
+
+    /* in list order, so the first of several equally named children wins */
+    for (nbt_node_t *c = node->first_child; c; c = c->next_child) {
+        size_t hash = _child_hash(c);
+        s = _index_probe(idx, c->name, c->name_len, hash);
+        if (s->node != NULL) {
+            idx->dups = 1;
+            continue;
+        }
+        s->hash = hash;
+        s->node = c;
+        idx->count++;
+    }
+
+    _index_drop(node);
+    node->index = idx;
+    return 0;
+}
+
+static int _index_build(nbt_node_t *node) {
+    size_t n = 0;
+    size_t cap = INDEX_MIN_CAP;
+
+    for (nbt_node_t *c = node->first_child; c; c = c->next_child) {
+        n++;
+    }
+    while (cap * 3 < n * 4) {
+        cap *= 2;
+    }
+    return _index_fill(node, cap);
+}
+
+/** Records a child that was just linked into an indexed compound
+ * @param parent Compound the child was linked into
+ * @param child The new child
+ */
+static void _index_add(nbt_node_t *parent, nbt_node_t *child) {
+    struct _nbt_child_index_t *idx = parent->index;
+    struct _nbt_index_slot_t *s;
+    size_t hash;
+
+    if (idx == NULL) {
+        return;
+    }
+
+    if ((idx->count + 1) * 4 > idx->cap * 3) {
+        if (_index_fill(parent, idx->cap * 2) != 0) {
+            _index_drop(parent);
+        }
+        return;
+    }
+
+    hash = _child_hash(child);
+    s = _index_probe(idx, child->name, child->name_len, hash);
+    if (s->node != NULL) {
+        /* only an append keeps the existing entry the first one by that name */
+        if (parent->last_child == child) {
+            idx->dups = 1;
+        } else {
+            _index_drop(parent);
+        }
+        return;
+    }
+    s->hash = hash;
+    s->node = child;
+    idx->count++;
+}
+
+/** Points the slot of a child at the node taking its place under the same name
+ * @param parent Compound the child belongs to
+ * @param old The child being replaced
+ * @param new The node taking its place
+ */
+static void _index_replace(nbt_node_t *parent, nbt_node_t *old, nbt_node_t *new) {
+    struct _nbt_index_slot_t *s;
+
+    if (parent->index == NULL) {
+        return;
+    }
+
+    /* an earlier child by the same name keeps the slot if old never had it */
+    s = _index_probe(parent->index, old->name, old->name_len, _child_hash(old));
+    if (s->node == old) {
+        s->node = new;
+    }
+}
+
+/** Forgets a child that is about to be unlinked or renamed
+ * @param parent Compound the child belongs to
+ * @param child The child
+ */
+static void _index_remove(nbt_node_t *parent, nbt_node_t *child) {
+    struct _nbt_child_index_t *idx = parent->index;
+    size_t mask, i, j, k;
+
+    if (idx == NULL) {
+        return;
+    }
+
+    /* another child by the same name may have to take over the slot */
+    if (idx->dups) {
+        _index_drop(parent);
+        return;
+    }
+
+    mask = idx->cap - 1;
+    i = (size_t) (_index_probe(idx, child->name, child->name_len, _child_hash(child))
+                  - idx->slots);
+    if (idx->slots[i].node != child) {
+        _index_drop(parent);
+        return;
+    }
+
+    /* backward shift deletion keeps probe sequences unbroken without tombstones */
+    for (j = (i + 1) & mask; idx->slots[j].node != NULL; j = (j + 1) & mask) {
+        k = idx->slots[j].hash & mask;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        idx->slots[i] = idx->slots[j];
+        i = j;
+    }
+    idx->slots[i].node = NULL;
+    idx->count--;
+}
+
+/** Makes room in the child array of a list
+ * @param node List to grow
+ * @param count Number of children the array must be able to hold
+ * @return 0 on success, -1 on failure
+ */
+static int _children_reserve(nbt_node_t *node, size_t count) {
+    nbt_node_t **tmp;
+    size_t cap;
+
+    if (count <= node->children_cap) {
+        return 0;
+    }
+
+    cap = node->children_cap ? node->children_cap * 2 : CHILDREN_MIN_CAP;
+    if (cap < count) {
+        cap = count;
+    }
+
+    if (node->arena == NULL) {
+        REALLOC(node->children, cap * sizeof(nbt_node_t *), return -1);
+    } else {
+        tmp = _nbt_arena_alloc(node->arena, cap * sizeof(nbt_node_t *));
+        ASSERT(tmp != NULL, return -1);
+        if (node->child_count) {
+            memcpy(tmp, node->children, node->child_count * sizeof(nbt_node_t *));
+        }
+        node->children = tmp;
+    }
+
+    node->children_cap = cap;
+    return 0;
+}
+
+static size_t _children_find(nbt_node_t *parent, nbt_node_t *child) {
+    size_t i = parent->child_count - 1;
+
+    /* appending and popping from the back is the common case */
+    if (parent->children[i] == child) {
+        return i;
+    }
+    for (i = 0; parent->children[i] != child; i++);
+    return i;
+}
+
+static void _children_insert(nbt_node_t *parent, nbt_node_t *child, size_t at) {
+    if (parent->type == MCNBT_TAG_LIST) {
+        memmove(parent->children + at + 1, parent->children + at,
+                (parent->child_count - at) * sizeof(nbt_node_t *));
+        parent->children[at] = child;
+    }
+    parent->child_count++;
+}
+
+static void _children_remove(nbt_node_t *parent, nbt_node_t *child) {
+    if (parent->type == MCNBT_TAG_LIST) {
+        size_t at = _children_find(parent, child);
+        memmove(parent->children + at, parent->children + at + 1,
+                (parent->child_count - at - 1) * sizeof(nbt_node_t *));
+    }
+    parent->child_count--;
+}
+
 void nbt_node_free(nbt_node_t *tree) {
     nbt_node_t *item;
     ASSERT(tree != NULL, return);
 
+    if (tree->src != NULL) {
+        _nbt_source_unref(tree->src);
+        tree->src = NULL;
+    }
+
+    if (tree->index != NULL) {
+        _index_drop(tree);
+    }
+
+    if (tree->children != NULL && tree->arena == NULL) {
+        FREE(tree->children);
+    }
+
     switch (tree->type) {
-        case MCNBT_TAG_COMPOUND:
         case MCNBT_TAG_LIST:
+            if (tree->flags & NODE_PACKED) {
+                _release_data(tree);
+            }
+            /* fallthrough */
+        case MCNBT_TAG_COMPOUND:
             item = tree->first_child;
             while (item != NULL) {
                 nbt_node_t *tmp = item->next_child;
@@ -66,106 +543,709 @@ void nbt_node_free(nbt_node_t *tree) {
             break;
         case MCNBT_TAG_STRING:
         case MCNBT_TAG_BYTE_ARRAY:
-            FREE(tree->data.str);
+        case MCNBT_TAG_INT_ARRAY:
+        case MCNBT_TAG_LONG_ARRAY:
+            _release_data(tree);
+        default:
+            break;
+    }
+
+    _release_name(tree);
+
+    /* arena nodes go away with nbt_arena_reset() or nbt_arena_free() */
+    if (tree->arena == NULL) {
+        FREE(tree);
+    }
+}
+
+nbt_node_t *nbt_node_initialize(nbt_tag_type_t type, const char *name, void *data) {
+    return nbt_node_initialize_len(type, name, data, 0);
+}
+
+nbt_node_t *nbt_node_initialize_len(nbt_tag_type_t type, const char *name, void *data, size_t data_size) {
+    if (type == MCNBT_TAG_STRING) {
+        data_size = data != NULL ? strlen(data) : 0;
+    }
+
+    return _nbt_node_create(NULL, type, name, name != NULL ? strlen(name) : 0, data, data_size, 0);
+}
+
+nbt_node_t *nbt_node_initialize_arena(nbt_arena_t *arena, nbt_tag_type_t type, const char *name, void *data,
+                                      size_t data_size) {
+    ASSERT(arena != NULL, return NULL);
+
+    if (type == MCNBT_TAG_STRING) {
+        data_size = data != NULL ? strlen(data) : 0;
+    }
+
+    return _nbt_node_create(arena, type, name, name != NULL ? strlen(name) : 0, data, data_size, 0);
+}
+
+/** Sets aside one stretch of an arena for a tree about to be parsed
+ * @param arena Arena the tree will be built in
+ * @param stats Totals from _nbt_scan_tree()
+ * @return 0 on success, -1 on failure
+ */
+int _nbt_node_reserve_tree(nbt_arena_t *arena, const _nbt_scan_t *stats) {
+    size_t node = (sizeof(nbt_node_t) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    return _nbt_arena_reserve(arena, stats->nodes * node + stats->allocs * ARENA_ALIGN + stats->bytes);
+}
+
+/** Creates a node, optionally inside an arena
+ * @param arena Arena to allocate from, or NULL for the heap
+ * @param type Tag type
+ * @param name Name of the tag, need not be NUL terminated
+ * @param name_len Length of name
+ * @param data Payload; for arrays this may be NULL to leave the payload uninitialized
+ * @param data_size Payload size in bytes (for strings, the length without the terminator)
+ * @param flags NBT_CREATE_BORROW to point the name, strings and byte arrays at the caller's memory
+ * @return The new node
+ */
+nbt_node_t *_nbt_node_create(nbt_arena_t *arena, nbt_tag_type_t type, const char *name, size_t name_len,
+                             const void *data, size_t data_size, int flags) {
+    nbt_node_t *ret = _node_alloc(arena, sizeof(nbt_node_t));
+    int interned;
+    ASSERT(ret != NULL, return NULL);
+
+    ret->type = type;
+    ret->arena = arena;
+    ret->flags = 0;
+    ret->data.l = 0;
+    ret->len = 0;
+    ret->list_type = MCNBT_TAG_END;
+    ret->name_len = name_len;
+
+    if (name != NULL && (flags & NBT_CREATE_BORROW)) {
+        ret->name = (char *) name;
+        ret->flags |= NODE_BORROWED_NAME;
+    } else if (name != NULL) {
+        ret->name = _copy_str(arena, name, name_len, INTERN_MAX_NAME, &interned);
+        ASSERT(ret->name != NULL, goto fail);
+        if (interned) {
+            ret->flags |= NODE_INTERNED_NAME;
+        }
+    } else {
+        ret->name = NULL;
+    }
+
+    switch (type) {
+        case MCNBT_TAG_BYTE:
+            ret->data.b = *((char *) data);
+            break;
+        case MCNBT_TAG_SHORT:
+            ret->data.s = *((short *) data);
+            break;
+        case MCNBT_TAG_INT:
+            ret->data.i = *((int *) data);
+            break;
+        case MCNBT_TAG_LONG:
+            ret->data.l = *((long *) data);
+            break;
+        case MCNBT_TAG_FLOAT:
+            ret->data.f = *((float *) data);
+            break;
+        case MCNBT_TAG_DOUBLE:
+            ret->data.d = *((double *) data);
+            break;
+        case MCNBT_TAG_BYTE_ARRAY:
+        case MCNBT_TAG_STRING:
+            if (data != NULL && (flags & NBT_CREATE_BORROW)) {
+                ret->data.str = (void *) data;
+                ret->flags |= NODE_BORROWED_DATA;
+                ret->len = data_size;
+                break;
+            }
+
+            if (type == MCNBT_TAG_BYTE_ARRAY) {
+                ret->data.str = _node_alloc(arena, data_size ? data_size : 1);
+                ASSERT(ret->data.str != NULL, goto fail);
+                if (data != NULL) {
+                    memcpy(ret->data.str, data, data_size);
+                }
+                ret->len = data_size;
+                break;
+            }
+
+            if (data != NULL) {
+                ret->data.str = _copy_str(arena, data, data_size, INTERN_MAX_STRING, &interned);
+                ASSERT(ret->data.str != NULL, goto fail);
+                if (interned) {
+                    ret->flags |= NODE_INTERNED_DATA;
+                }
+            } else {
+                ret->data.str = _node_alloc(arena, data_size + 1);
+                ASSERT(ret->data.str != NULL, goto fail);
+                ((char *) ret->data.str)[data_size] = '\0';
+            }
+            ret->len = data_size;
+            break;
+        case MCNBT_TAG_INT_ARRAY:
+            ret->data.str = _node_alloc(arena, data_size ? data_size : 1);
+            ASSERT(ret->data.str != NULL, goto fail);
+            if (data != NULL) {
+                memcpy(ret->data.str, data, data_size);
+            }
+            ret->len = data_size / 4;
+            break;
+        case MCNBT_TAG_LONG_ARRAY:
+            ret->data.str = _node_alloc(arena, data_size ? data_size : 1);
+            ASSERT(ret->data.str != NULL, goto fail);
+            if (data != NULL) {
+                memcpy(ret->data.str, data, data_size);
+            }
+            ret->len = data_size / 8;
+            break;
+        case MCNBT_TAG_LIST:
+        case MCNBT_TAG_END:
+        case MCNBT_TAG_COMPOUND:
         default:
+            ret->data.str = NULL;
             break;
     }
 
-    if (tree->name != NULL) {
-        FREE(tree->name);
+    ret->parent = NULL;
+    ret->first_child = NULL;
+    ret->last_child = NULL;
+    ret->next_child = NULL;
+    ret->prev_child = NULL;
+
+    ret->src = NULL;
+    ret->src_pos = 0;
+    ret->src_len = 0;
+
+    ret->index = NULL;
+
+    ret->child_count = 0;
+    ret->children = NULL;
+    ret->children_cap = 0;
+
+    return ret;
+
+fail:
+    if (arena == NULL) {
+        _release_name(ret);
+        FREE(ret);
+    }
+    return NULL;
+}
+
+/** Defers parsing the children of a compound or list
+ * @param node Node whose payload starts at pos in src
+ * @param src Buffer the payload lives in
+ * @param pos Offset of the payload
+ * @param len Length of the payload
+ */
+void _nbt_node_set_lazy(nbt_node_t *node, _nbt_source_t *src, size_t pos, size_t len) {
+    REF_INC(src->refs);
+    node->src = src;
+    node->src_pos = pos;
+    node->src_len = len;
+}
+
+/** Parses the deferred children of a node
+ * @param node Node to load
+ * @return 0 on success, -1 on failure
+ */
+static int _load(nbt_node_t *node) {
+    _nbt_source_t *src = node->src;
+    int ret, scope;
+
+    if (!DEFERRED(node)) {
+        return 0;
+    }
+
+    /* cleared first since the parser appends through the public API */
+    node->src = NULL;
+    node->flags |= NODE_LOADING;
+    scope = _nbt_alloc_enter(MCNBT_ALLOC_PARSE);
+    ret = _nbt_parse_children(node, src, node->src_pos, node->src_len);
+    _nbt_alloc_leave(scope);
+    node->flags &= ~NODE_LOADING;
+
+    /* the source still holds the payload of the subtree until it changes */
+    if (ret == 0) {
+        node->src = src;
+        node->flags |= NODE_ENCODED;
+    } else {
+        _nbt_source_unref(src);
+    }
+    return ret;
+}
+
+/* host size of one element of a packed list, or 0 if the type cannot be packed */
+static size_t _packed_width(nbt_tag_type_t type) {
+    switch (type) {
+        case MCNBT_TAG_BYTE:
+            return sizeof(char);
+        case MCNBT_TAG_SHORT:
+            return sizeof(short);
+        case MCNBT_TAG_INT:
+            return sizeof(int);
+        case MCNBT_TAG_LONG:
+            return sizeof(long);
+        case MCNBT_TAG_FLOAT:
+            return sizeof(float);
+        case MCNBT_TAG_DOUBLE:
+            return sizeof(double);
+        default:
+            return 0;
+    }
+}
+
+/** Turns the elements of a packed list into child nodes
+ * @param node Packed list; left as it was on failure
+ * @return 0 on success, -1 on failure
+ */
+static int _unpack(nbt_node_t *node) {
+    char *data = node->data.str;
+    size_t count = node->len;
+    size_t width = _packed_width(node->list_type);
+
+    /* the children are made before the packed elements are given up */
+    ASSERT(_children_reserve(node, count) == 0, return -1);
+    for (size_t i = 0; i < count; i++) {
+        node->children[i] = _nbt_node_create(node->arena, node->list_type, NULL, 0, data + i * width, 0, 0);
+        if (node->children[i] == NULL) {
+            while (i-- > 0) {
+                nbt_node_free(node->children[i]);
+            }
+            return -1;
+        }
+    }
+
+    node->flags &= ~NODE_PACKED;
+    node->flags |= NODE_LOADING;
+    node->data.str = NULL;
+    node->len = 0;
+
+    /* appending puts each child back into the slot it already occupies */
+    for (size_t i = 0; i < count; i++) {
+        nbt_node_append_child(node, node->children[i]);
+    }
+
+    _free_data(node, data);
+    node->flags &= ~NODE_LOADING;
+    return 0;
+}
+
+/** Parses the deferred children of a node and unpacks packed lists
+ * @param node Node to materialize
+ * @return 0 on success, -1 on failure
+ */
+int _nbt_node_materialize(nbt_node_t *node) {
+    ASSERT(_load(node) == 0, return -1);
+
+    if (node->flags & NODE_PACKED) {
+        return _unpack(node);
+    }
+    return 0;
+}
+
+/** Switches an empty list to packed storage
+ * @param node List without children whose list type is a number type
+ * @param count Number of elements
+ * @return Uninitialized storage for count elements in host order, or NULL
+ */
+void *_nbt_node_pack(nbt_node_t *node, size_t count) {
+    size_t width = _packed_width(node->list_type);
+    void *ret;
+
+    ASSERT(width != 0 && node->first_child == NULL, return NULL);
+    ret = _node_alloc(node->arena, count ? count * width : 1);
+    ASSERT(ret != NULL, return NULL);
+
+    if (node->flags & NODE_PACKED) {
+        _release_data(node);
+    }
+    node->data.str = ret;
+    node->len = count;
+    node->flags |= NODE_PACKED;
+    _touch(node);
+    return ret;
+}
+
+nbt_arena_t *_nbt_node_get_arena(nbt_node_t *node) {
+    return node->arena;
+}
+
+/** Returns the elements of a packed list
+ * @param node Node to look at
+ * @param count Set to the number of elements
+ * @return The elements in host order, or NULL if the node is not a packed list
+ */
+const void *_nbt_node_get_packed(nbt_node_t *node, size_t *count) {
+    if (!(node->flags & NODE_PACKED)) {
+        return NULL;
+    }
+
+    *count = node->len;
+    return node->data.str;
+}
+
+/** Returns the payload buffer of a node still being built, for whoever created it to fill in
+ * @param node Node created without a payload
+ * @return The buffer
+ */
+void *_nbt_node_get_buffer(nbt_node_t *node) {
+    return node->data.str;
+}
+
+/** Returns the payload buffer of a string, array or packed list without making it writable
+ * @param node Node to look at
+ * @param size Set to the size of the payload in bytes, without a string's terminator
+ * @return The payload, or NULL if the node has no payload buffer
+ */
+const void *_nbt_node_get_payload(nbt_node_t *node, size_t *size) {
+    switch (node->type) {
+        case MCNBT_TAG_STRING:
+        case MCNBT_TAG_BYTE_ARRAY:
+            *size = node->len;
+            break;
+        case MCNBT_TAG_INT_ARRAY:
+            *size = node->len * sizeof(int);
+            break;
+        case MCNBT_TAG_LONG_ARRAY:
+            *size = node->len * sizeof(long);
+            break;
+        case MCNBT_TAG_LIST:
+            if (!(node->flags & NODE_PACKED)) {
+                return NULL;
+            }
+            *size = node->len * _packed_width(node->list_type);
+            break;
+        default:
+            return NULL;
+    }
+    return node->data.str;
+}
+
+/** Looks up the cached hash of a subtree
+ * @param node Node to look at
+ * @param hash Set to the cached hash
+ * @return 1 if the node has a cached hash, 0 otherwise
+ */
+int _nbt_node_get_hash(nbt_node_t *node, uint64_t *hash) {
+    if (!(node->flags & NODE_HASHED)) {
+        return 0;
+    }
+
+    *hash = node->hash;
+    return 1;
+}
+
+void _nbt_node_set_hash(nbt_node_t *node, uint64_t hash) {
+    node->hash = hash;
+    node->flags |= NODE_HASHED;
+}
+
+/** Moves the payload of a node into a shared block, unless it is there already
+ * @param node Heap node with a payload buffer of its own
+ * @return The block holding the payload, or NULL if the payload cannot be shared
+ */
+_nbt_shared_t *_nbt_node_share_data(nbt_node_t *node) {
+    _nbt_shared_t *block;
+    size_t size;
+    const void *data = _nbt_node_get_payload(node, &size);
+
+    if (node->flags & NODE_SHARED_DATA) {
+        return SHARED_BLOCK(node->data.str);
+    }
+
+    if (data == NULL || size == 0 || node->arena != NULL || (node->flags & (NODE_BORROWED_DATA | NODE_INTERNED_DATA))) {
+        return NULL;
+    }
+
+    /* strings keep their terminator */
+    MALLOC(block, sizeof(_nbt_shared_t) + size + 1, return NULL);
+    block->refs = 1;
+    block->size = size + (node->type == MCNBT_TAG_STRING);
+    memcpy(block->data, data, size);
+    block->data[size] = '\0';
+
+    _release_data(node);
+    node->data.str = (char *) block->data;
+    node->flags |= NODE_SHARED_DATA;
+    return block;
+}
+
+/** Points a node at a shared payload equal to its own and frees its own
+ * @param node Heap node with a payload buffer of its own
+ * @param block Block to use instead
+ * @return The number of bytes freed
+ */
+size_t _nbt_node_adopt_data(nbt_node_t *node, _nbt_shared_t *block) {
+    size_t size;
+
+    if (_nbt_node_get_payload(node, &size) == NULL || node->arena != NULL ||
+        (node->flags & (NODE_BORROWED_DATA | NODE_INTERNED_DATA)) || node->data.str == (char *) block->data) {
+        return 0;
+    }
+
+    if (node->flags & NODE_SHARED_DATA) {
+        size = 0;
+    }
+
+    _release_data(node);
+    REF_INC(block->refs);
+    node->data.str = (char *) block->data;
+    node->flags |= NODE_SHARED_DATA;
+    return size;
+}
+
+void _nbt_shared_unref(_nbt_shared_t *block) {
+    if (REF_DEC(block->refs) == 0) {
+        FREE(block);
+    }
+}
+
+/** Gives a copy the payload of the node it copies
+ * @param node Node being copied
+ * @param ret Its copy, with data and flags not set up yet
+ * @return 0 on success, -1 on failure
+ */
+static int _clone_data(nbt_node_t *node, nbt_node_t *ret) {
+    _nbt_shared_t *block;
+    size_t size;
+    const void *data = _nbt_node_get_payload(node, &size);
+
+    if (data == NULL) {
+        return 0;
+    }
+
+    /* heap copies share what they can; the buffers of an arena live and die with it */
+    if (ret->arena == NULL && (node->flags & NODE_INTERNED_DATA)) {
+        _nbt_intern_ref(data);
+        ret->flags |= NODE_INTERNED_DATA;
+    } else if (node->flags & NODE_BORROWED_DATA) {
+        ret->flags |= NODE_BORROWED_DATA;
+    } else if (ret->arena == NULL && (block = _nbt_node_share_data(node)) != NULL) {
+        REF_INC(block->refs);
+        ret->flags |= NODE_SHARED_DATA;
+    } else {
+        ret->data.str = _node_alloc(ret->arena, size + 1);
+        ASSERT(ret->data.str != NULL, return -1);
+        memcpy(ret->data.str, data, size);
+        ((char *) ret->data.str)[size] = '\0';
+        return 0;
+    }
+
+    ret->data.str = node->data.str;
+    return 0;
+}
+
+/** Copies a subtree in one pass
+ * @param node Root of the subtree
+ * @param arena Arena to build the copy in, or NULL for the heap
+ * @return The copy, or NULL on failure
+ */
+static nbt_node_t *_clone(nbt_node_t *node, nbt_arena_t *arena) {
+    nbt_node_t *ret, *child;
+    size_t size;
+    int interned;
+
+    /* deferred children are shared only with a copy that cannot outlive their source */
+    if (DEFERRED(node) && node->src->arena != arena) {
+        ASSERT(_load(node) == 0, return NULL);
+    }
+
+    ret = _node_alloc(arena, sizeof(nbt_node_t));
+    ASSERT(ret != NULL, return NULL);
+    *ret = *node;
+    ret->parent = NULL;
+    ret->first_child = NULL;
+    ret->last_child = NULL;
+    ret->next_child = NULL;
+    ret->prev_child = NULL;
+    ret->child_count = 0;
+    ret->children = NULL;
+    ret->children_cap = 0;
+    ret->arena = arena;
+    ret->flags = node->flags & NODE_PACKED;
+    ret->index = NULL;
+    ret->name = NULL;
+    ret->data.l = 0;
+    ret->src = NULL;
+
+    if (node->name == NULL) {
+        ret->name_len = 0;
+    } else if (arena == NULL && (node->flags & NODE_INTERNED_NAME)) {
+        _nbt_intern_ref(node->name);
+        ret->name = node->name;
+        ret->flags |= NODE_INTERNED_NAME;
+    } else if (node->flags & NODE_BORROWED_NAME) {
+        ret->name = node->name;
+        ret->flags |= NODE_BORROWED_NAME;
+    } else {
+        ret->name = _copy_str(arena, node->name, node->name_len, INTERN_MAX_NAME, &interned);
+        ASSERT(ret->name != NULL, ret->name_len = 0; goto fail);
+        if (interned) {
+            ret->flags |= NODE_INTERNED_NAME;
+        }
+    }
+
+    if (_nbt_node_get_payload(node, &size) != NULL) {
+        ASSERT(_clone_data(node, ret) == 0, goto fail);
+    } else if (node->type != MCNBT_TAG_LIST && node->type != MCNBT_TAG_COMPOUND) {
+        ret->data = node->data;
+    }
+
+    if (DEFERRED(node)) {
+        REF_INC(node->src->refs);
+        ret->src = node->src;
+    }
+
+    if (node->type == MCNBT_TAG_LIST && node->child_count != 0) {
+        ASSERT(_children_reserve(ret, node->child_count) == 0, goto fail);
+    }
+
+    for (child = node->first_child; child != NULL; child = child->next_child) {
+        nbt_node_t *c = _clone(child, arena);
+        ASSERT(c != NULL, goto fail);
+        ASSERT(nbt_node_append_child(ret, c) == 0, nbt_node_free(c); goto fail);
     }
-    FREE(tree);
+
+    /* the subtree is unchanged, so its cached hash still holds */
+    ret->flags |= node->flags & NODE_HASHED;
+    return ret;
+
+fail:
+    nbt_node_free(ret);
+    return NULL;
 }
 
-nbt_node_t *nbt_node_initialize(nbt_tag_type_t type, const char *name, void *data) {
-    return nbt_node_initialize_len(type, name, data, 0);
+nbt_node_t *nbt_node_clone(nbt_node_t *node) {
+    ASSERT(node != NULL, return NULL);
+    return _clone(node, NULL);
 }
 
-nbt_node_t *nbt_node_initialize_len(nbt_tag_type_t type, const char *name, void *data, size_t data_size) {
-    nbt_node_t *ret;
-    MALLOC(ret, sizeof(nbt_node_t), return NULL);
+nbt_node_t *nbt_node_clone_arena(nbt_node_t *node, nbt_arena_t *arena) {
+    ASSERT(node != NULL, return NULL);
+    ASSERT(arena != NULL, return NULL);
+    return _clone(node, arena);
+}
 
-    ret->type = type;
+/** Returns the encoded payload of a deferred compound or list, or of a clean one
+ * @param node Node to look at
+ * @param data Set to the start of the payload
+ * @param len Set to the length of the payload
+ * @return 1 if the node is still deferred, 2 if its encoding is cached, 0 otherwise
+ */
+int _nbt_node_get_raw(nbt_node_t *node, const unsigned char **data, size_t *len) {
+    nbt_node_t *n = node;
+    size_t pos = node->src_pos;
 
-    if (name != NULL) {
-        CALLOC(ret->name, strlen(name) + 1, sizeof(char), return NULL);
-        strcpy(ret->name, name);
-    } else {
-        ret->name = NULL;
+    if (node->src == NULL && !(node->flags & NODE_ENCODED)) {
+        return 0;
     }
 
-    switch (type) {
-        case MCNBT_TAG_BYTE:
-            ret->data.b = *((char *) data);
-            break;
-        case MCNBT_TAG_SHORT:
-            ret->data.s = *((short *) data);
-            break;
-        case MCNBT_TAG_INT:
-            ret->data.i = *((int *) data);
-            break;
-        case MCNBT_TAG_LONG:
-            ret->data.l = *((long *) data);
-            break;
-        case MCNBT_TAG_FLOAT:
-            ret->data.f = *((float *) data);
-            break;
-        case MCNBT_TAG_DOUBLE:
-            ret->data.d = *((double *) data);
-            break;
-        case MCNBT_TAG_BYTE_ARRAY:
-            CALLOC(ret->data.str, data_size, sizeof(char), return NULL);
-            memcpy(ret->data.str, (char *) data, data_size);
-            ret->len = data_size;
-            break;
-        case MCNBT_TAG_STRING:
-            CALLOC(ret->data.str, strlen(data) + 1, sizeof(char), return NULL);
-            strncpy(ret->data.str, (char *) data, strlen(data) + 1);
-            ret->len = strlen(ret->data.str);
-            break;
-        case MCNBT_TAG_LIST:
-        case MCNBT_TAG_END:
-        case MCNBT_TAG_COMPOUND:
-        case MCNBT_TAG_INT_ARRAY:
-            CALLOC(ret->data.str, data_size, sizeof(int), return NULL);
-            memcpy(ret->data.str, (char *) data, data_size);
-            ret->len = data_size / 4;
-            break;
-        case MCNBT_TAG_LONG_ARRAY:
-            CALLOC(ret->data.str, data_size, sizeof(long), return NULL);
-            memcpy(ret->data.str, (char *) data, data_size);
-            ret->len = data_size / 8;
-            break;
-        default:
-            break;
+    while (n->src == NULL) {
+        n = n->parent;
+        pos += n->src_pos;
     }
 
-    ret->parent = NULL;
-    ret->first_child = NULL;
-    ret->last_child = NULL;
-    ret->next_child = NULL;
-    ret->prev_child = NULL;
+    *data = n->src->data + pos;
+    *len = node->src_len;
+    return (node->flags & NODE_ENCODED) ? 2 : 1;
+}
 
-    return ret;
+/** Caches the encoding of a compound or list that was just written
+ * @param node Node that has not been deferred
+ * @param src Buffer holding the encoding, or NULL if pos is relative to the payload of the encoded parent
+ * @param pos Offset of the payload
+ * @param len Length of the payload
+ */
+void _nbt_node_set_encoded(nbt_node_t *node, _nbt_source_t *src, size_t pos, size_t len) {
+    if (src != NULL) {
+        REF_INC(src->refs);
+    }
+
+    if (node->src != NULL) {
+        _nbt_source_unref(node->src);
+    }
+
+    node->src = src;
+    node->src_pos = pos;
+    node->src_len = len;
+    node->flags |= NODE_ENCODED;
+}
+
+/** Drops the cached encoding of a subtree along with those of its descendants
+ * @param node Node that may be encoded
+ */
+void _nbt_node_drop_encoded(nbt_node_t *node) {
+    if (!(node->flags & NODE_ENCODED)) {
+        return;
+    }
+
+    for (nbt_node_t *c = node->first_child; c != NULL; c = c->next_child) {
+        _nbt_node_drop_encoded(c);
+    }
+
+    if (node->src != NULL) {
+        _nbt_source_unref(node->src);
+        node->src = NULL;
+    }
+    node->flags &= ~NODE_ENCODED;
 }
 
 nbt_node_t *nbt_node_initialize_list(nbt_tag_type_t type, const char *name, void *data, nbt_tag_type_t list_type) {
     nbt_node_t *ret = nbt_node_initialize(type, name, data);
+    ASSERT(ret != NULL, return NULL);
     ret->list_type = list_type;
     return ret;
 }
 
 char *nbt_node_get_name(nbt_node_t *node) {
     ASSERT(node != NULL, return NULL);
+
+    /* borrowed names are only terminated once somebody asks for a C string */
+    if (node->flags & NODE_BORROWED_NAME) {
+        char *tmp = _node_alloc(node->arena, node->name_len + 1);
+        ASSERT(tmp != NULL, return NULL);
+        memcpy(tmp, node->name, node->name_len);
+        tmp[node->name_len] = '\0';
+
+        node->name = tmp;
+        node->flags &= ~NODE_BORROWED_NAME;
+    }
+
+    return node->name;
+}
+
+const char *nbt_node_get_name_view(nbt_node_t *node, size_t *len) {
+    ASSERT(node != NULL, return NULL);
+
+    if (len != NULL) {
+        *len = node->name_len;
+    }
     return node->name;
 }
 
 int nbt_node_set_name(nbt_node_t *node, const char *name) {
+    char *tmp;
+    int interned;
     ASSERT(node != NULL, return -1);
-    ASSERT(node->type == MCNBT_TAG_LIST, return -1);
+    ASSERT(name != NULL, return -1);
+    ASSERT(node->parent == NULL || node->parent->type != MCNBT_TAG_LIST, return -1);
+
+    tmp = _copy_str(node->arena, name, strlen(name), INTERN_MAX_NAME, &interned);
+    ASSERT(tmp != NULL, return -1);
+
+    if (node->parent != NULL) {
+        _index_remove(node->parent, node);
+    }
 
-    FREE(node->name);
-    strcpy(node->name, name);
+    _release_name(node);
+    node->name = tmp;
+    node->name_len = strlen(name);
+    if (interned) {
+        node->flags |= NODE_INTERNED_NAME;
+    }
+
+    if (node->parent != NULL) {
+        _index_add(node->parent, node);
+    }
+    _touch(node);
     return 0;
 }
 
@@ -187,6 +1267,7 @@ int nbt_node_set_data_byte(nbt_node_t *node, char data) {
     ASSERT(node != NULL, return -1);
     ASSERT(node->type == MCNBT_TAG_BYTE, return -1);
     node->data.b = data;
+    _touch(node);
     return 0;
 }
 
@@ -200,6 +1281,7 @@ int nbt_node_set_data_double(nbt_node_t *node, double data) {
     ASSERT(node != NULL, return -1);
     ASSERT(node->type == MCNBT_TAG_DOUBLE, return -1);
     node->data.d = data;
+    _touch(node);
     return 0;
 }
 
@@ -213,6 +1295,7 @@ int nbt_node_set_data_float(nbt_node_t *node, float data) {
     ASSERT(node != NULL, return -1);
     ASSERT(node->type == MCNBT_TAG_FLOAT, return -1);
     node->data.f = data;
+    _touch(node);
     return 0;
 }
 
@@ -226,6 +1309,7 @@ int nbt_node_set_data_short(nbt_node_t *node, short data) {
     ASSERT(node != NULL, return -1);
     ASSERT(node->type == MCNBT_TAG_SHORT, return -1);
     node->data.s = data;
+    _touch(node);
     return 0;
 }
 
@@ -239,6 +1323,7 @@ int nbt_node_set_data_long(nbt_node_t *node, long data) {
     ASSERT(node != NULL, return -1);
     ASSERT(node->type == MCNBT_TAG_LONG, return -1);
     node->data.l = data;
+    _touch(node);
     return 0;
 }
 
@@ -252,64 +1337,133 @@ int nbt_node_set_data_int(nbt_node_t *node, int data) {
     ASSERT(node != NULL, return -1);
     ASSERT(node->type == MCNBT_TAG_INT, return -1);
     node->data.i = data;
+    _touch(node);
     return 0;
 }
 
 char *nbt_node_get_data_str(nbt_node_t *node) {
     ASSERT(node != NULL, return NULL);
     ASSERT(node->type == MCNBT_TAG_STRING || node->type == MCNBT_TAG_BYTE_ARRAY, return NULL);
+
+    if (node->type == MCNBT_TAG_STRING && (node->flags & NODE_BORROWED_DATA)) {
+        char *tmp = _node_alloc(node->arena, node->len + 1);
+        ASSERT(tmp != NULL, return NULL);
+        memcpy(tmp, node->data.str, node->len);
+        tmp[node->len] = '\0';
+
+        node->data.str = tmp;
+        node->flags &= ~NODE_BORROWED_DATA;
+    }
+
+    /* the caller may write through the pointer */
+    ASSERT(_unshare(node) >= 0, return NULL);
+    _touch(node);
+    return node->data.str;
+}
+
+const char *nbt_node_get_data_str_view(nbt_node_t *node, size_t *len) {
+    ASSERT(node != NULL, return NULL);
+    ASSERT(node->type == MCNBT_TAG_STRING || node->type == MCNBT_TAG_BYTE_ARRAY, return NULL);
+
+    if (len != NULL) {
+        *len = node->len;
+    }
     return node->data.str;
 }
 
 int nbt_node_set_data_str(nbt_node_t *node, char *data) {
     ASSERT(node != NULL, return -1);
     ASSERT(node->type == MCNBT_TAG_STRING, return -1);
-    FREE(node->data.str);
-    CALLOC(node->data.str, strlen(data) + 1, sizeof(char), return -1);
-    strncpy(node->data.str, data, strlen(data) + 1);
-    node->len = strlen(data);
+    size_t len = strlen(data);
+    int interned;
+    char *tmp = _copy_str(node->arena, data, len, INTERN_MAX_STRING, &interned);
+    ASSERT(tmp != NULL, return -1);
+
+    _release_data(node);
+    node->data.str = tmp;
+    node->len = len;
+    if (interned) {
+        node->flags |= NODE_INTERNED_DATA;
+    }
+    _touch(node);
     return 0;
 }
 
 int nbt_node_set_data_byte_array(nbt_node_t *node, char *data, size_t len) {
     ASSERT(node != NULL, return -1);
     ASSERT(node->type == MCNBT_TAG_BYTE_ARRAY, return -1);
-    FREE(node->data.str);
-    CALLOC(node->data.str, len, sizeof(char), return -1);
-    memcpy(node->data.str, data, len);
+    char *tmp = _node_alloc(node->arena, len ? len : 1);
+    ASSERT(tmp != NULL, return -1);
+    memcpy(tmp, data, len);
+
+    _release_data(node);
+    node->data.str = tmp;
     node->len = len;
+    _touch(node);
     return 0;
 }
 
 int *nbt_node_get_data_int_array(nbt_node_t *node) {
     ASSERT(node != NULL, return NULL);
     ASSERT(node->type == MCNBT_TAG_INT_ARRAY, return NULL);
+    ASSERT(_unshare(node) >= 0, return NULL);
+    _touch(node);
+    return node->data.str;
+}
+
+const int *nbt_node_get_data_int_array_view(nbt_node_t *node, size_t *len) {
+    ASSERT(node != NULL, return NULL);
+    ASSERT(node->type == MCNBT_TAG_INT_ARRAY, return NULL);
+
+    if (len != NULL) {
+        *len = node->len;
+    }
     return node->data.str;
 }
 
 int nbt_node_set_data_int_array(nbt_node_t *node, int *data, size_t len) {
     ASSERT(node != NULL, return -1);
-    ASSERT(node->type == MCNBT_TAG_BYTE_ARRAY, return -1);
-    FREE(node->data.str);
-    CALLOC(node->data.str, len, sizeof(int), return -1);
-    memcpy(node->data.str, data, len * sizeof(int));
+    ASSERT(node->type == MCNBT_TAG_INT_ARRAY, return -1);
+    int *tmp = _node_alloc(node->arena, len ? len * sizeof(int) : 1);
+    ASSERT(tmp != NULL, return -1);
+    memcpy(tmp, data, len * sizeof(int));
+
+    _release_data(node);
+    node->data.str = tmp;
     node->len = len;
+    _touch(node);
     return 0;
 }
 
 long *nbt_node_get_data_long_array(nbt_node_t *node) {
     ASSERT(node != NULL, return NULL);
     ASSERT(node->type == MCNBT_TAG_LONG_ARRAY, return NULL);
+    ASSERT(_unshare(node) >= 0, return NULL);
+    _touch(node);
+    return node->data.str;
+}
+
+const long *nbt_node_get_data_long_array_view(nbt_node_t *node, size_t *len) {
+    ASSERT(node != NULL, return NULL);
+    ASSERT(node->type == MCNBT_TAG_LONG_ARRAY, return NULL);
+
+    if (len != NULL) {
+        *len = node->len;
+    }
     return node->data.str;
 }
 
 int nbt_node_set_data_long_array(nbt_node_t *node, long *data, size_t len) {
     ASSERT(node != NULL, return -1);
-    ASSERT(node->type == MCNBT_TAG_BYTE_ARRAY, return -1);
-    FREE(node->data.str);
-    CALLOC(node->data.str, len, sizeof(long), return -1);
-    memcpy(node->data.str, data, len * sizeof(long));
+    ASSERT(node->type == MCNBT_TAG_LONG_ARRAY, return -1);
+    long *tmp = _node_alloc(node->arena, len ? len * sizeof(long) : 1);
+    ASSERT(tmp != NULL, return -1);
+    memcpy(tmp, data, len * sizeof(long));
+
+    _release_data(node);
+    node->data.str = tmp;
     node->len = len;
+    _touch(node);
     return 0;
 }
 
@@ -319,13 +1473,25 @@ nbt_tag_type_t nbt_node_get_list_type(nbt_node_t *node) {
     return node->list_type;
 }
 
+int nbt_node_set_list_type(nbt_node_t *node, nbt_tag_type_t list_type) {
+    ASSERT(node != NULL, return -1);
+    ASSERT(node->type == MCNBT_TAG_LIST, return -1);
+    MATERIALIZE(node);
+    ASSERT(node->first_child == NULL, return -1);
+    node->list_type = list_type;
+    _touch(node);
+    return 0;
+}
+
 nbt_node_t *nbt_node_get_first_child(nbt_node_t *node) {
     ASSERT(node != NULL, return NULL);
+    MATERIALIZE(node);
     return node->first_child;
 }
 
 nbt_node_t *nbt_node_get_last_child(nbt_node_t *node) {
     ASSERT(node != NULL, return NULL);
+    MATERIALIZE(node);
     return node->last_child;
 }
 
@@ -344,16 +1510,217 @@ nbt_node_t *nbt_node_get_prev_child(nbt_node_t *node) {
     return node->prev_child;
 }
 
+nbt_node_t *nbt_node_find_child(nbt_node_t *node, const char *name) {
+    ASSERT(name != NULL, return NULL);
+    return _nbt_node_find_child_len(node, name, strlen(name));
+}
+
+/** Looks up a child of a compound by a name that need not be terminated
+ * @param node Compound to search
+ * @param name Name of the child
+ * @param len Length of name
+ * @return The first child with that name, or NULL
+ */
+nbt_node_t *_nbt_node_find_child_len(nbt_node_t *node, const char *name, size_t len) {
+    ASSERT(node != NULL, return NULL);
+    ASSERT(node->type == MCNBT_TAG_COMPOUND, return NULL);
+    MATERIALIZE(node);
+
+    /* small compounds are cheaper to scan than to index */
+    if (node->index == NULL) {
+        size_t n = 0;
+        for (nbt_node_t *c = node->first_child; c; c = c->next_child) {
+            if (n++ == INDEX_THRESHOLD && _index_build(node) == 0) {
+                break;
+            }
+            if (_name_eq(c, name, len)) {
+                return c;
+            }
+        }
+
+        if (node->index == NULL) {
+            return NULL;
+        }
+    }
+
+    return _index_probe(node->index, name, len, _nbt_name_hash(name, len))->node;
+}
+
+nbt_node_t *nbt_node_get_child_at(nbt_node_t *node, size_t i) {
+    nbt_node_t *ret;
+    ASSERT(node != NULL, return NULL);
+    ASSERT(node->type == MCNBT_TAG_COMPOUND || node->type == MCNBT_TAG_LIST, return NULL);
+    MATERIALIZE(node);
+    ASSERT(i < node->child_count, return NULL);
+
+    if (node->type == MCNBT_TAG_LIST) {
+        return node->children[i];
+    }
+
+    /* compounds are only linked, so walk from the nearer end */
+    if (i < node->child_count / 2) {
+        for (ret = node->first_child; i > 0; i--) {
+            ret = ret->next_child;
+        }
+    } else {
+        for (ret = node->last_child, i = node->child_count - 1 - i; i > 0; i--) {
+            ret = ret->prev_child;
+        }
+    }
+    return ret;
+}
+
+int nbt_node_reserve(nbt_node_t *node, size_t count) {
+    ASSERT(node != NULL, return -1);
+    ASSERT(node->type == MCNBT_TAG_LIST, return -1);
+    MATERIALIZE(node);
+    return _children_reserve(node, count);
+}
+
+/** Copies the elements of a list of numbers, packed or not
+ * @param list List to read
+ * @param type Expected element type
+ * @param out Buffer for up to n elements
+ * @param n Size of out in elements
+ * @return Number of elements copied
+ */
+static size_t _list_get(nbt_node_t *list, nbt_tag_type_t type, void *out, size_t n) {
+    size_t width = _packed_width(type);
+    size_t i = 0;
+
+    ASSERT(list != NULL, return 0);
+    ASSERT(list->type == MCNBT_TAG_LIST && list->list_type == type, return 0);
+    ASSERT(out != NULL || n == 0, return 0);
+    LOAD(list);
+
+    if (list->flags & NODE_PACKED) {
+        i = list->len < n ? list->len : n;
+        memcpy(out, list->data.str, i * width);
+        return i;
+    }
+
+    /* every member of the payload union starts at its beginning */
+    for (nbt_node_t *c = list->first_child; c != NULL && i < n; c = c->next_child, i++) {
+        memcpy((char *) out + i * width, &c->data, width);
+    }
+    return i;
+}
+
+int nbt_list_get_number(nbt_node_t *list, size_t i, void *out) {
+    size_t width;
+    nbt_node_t *c;
+
+    ASSERT(list != NULL, return -1);
+    ASSERT(list->type == MCNBT_TAG_LIST, return -1);
+    ASSERT(out != NULL, return -1);
+    LOAD(list);
+
+    width = _packed_width(list->list_type);
+    ASSERT(width != 0, return -1);
+
+    if (list->flags & NODE_PACKED) {
+        ASSERT(i < list->len, return -1);
+        memcpy(out, (char *) list->data.str + i * width, width);
+        return 0;
+    }
+
+    ASSERT(i < list->child_count, return -1);
+    c = list->children[i];
+    memcpy(out, &c->data, width);
+    return 0;
+}
+
+/** Replaces the elements of a list with packed numbers
+ * @param list List to fill; its old elements are freed
+ * @param type Element type
+ * @param values Elements to copy
+ * @param n Number of elements
+ * @return 0 on success, -1 on failure
+ */
+static int _list_set(nbt_node_t *list, nbt_tag_type_t type, const void *values, size_t n) {
+    void *data;
+
+    ASSERT(list != NULL, return -1);
+    ASSERT(list->type == MCNBT_TAG_LIST, return -1);
+    ASSERT(values != NULL || n == 0, return -1);
+    LOAD(list);
+
+    /* from the back, so the child array never has to shift */
+    while (list->last_child != NULL) {
+        nbt_node_t *c = list->last_child;
+        nbt_node_unlink(c);
+        nbt_node_free(c);
+    }
+
+    list->list_type = type;
+    data = _nbt_node_pack(list, n);
+    ASSERT(data != NULL, return -1);
+    if (n > 0) {
+        memcpy(data, values, n * _packed_width(type));
+    }
+    return 0;
+}
+
+size_t nbt_list_get_bytes(nbt_node_t *list, char *out, size_t n) {
+    return _list_get(list, MCNBT_TAG_BYTE, out, n);
+}
+
+int nbt_list_set_bytes(nbt_node_t *list, const char *values, size_t n) {
+    return _list_set(list, MCNBT_TAG_BYTE, values, n);
+}
+
+size_t nbt_list_get_shorts(nbt_node_t *list, short *out, size_t n) {
+    return _list_get(list, MCNBT_TAG_SHORT, out, n);
+}
+
+int nbt_list_set_shorts(nbt_node_t *list, const short *values, size_t n) {
+    return _list_set(list, MCNBT_TAG_SHORT, values, n);
+}
+
+size_t nbt_list_get_ints(nbt_node_t *list, int *out, size_t n) {
+    return _list_get(list, MCNBT_TAG_INT, out, n);
+}
+
+int nbt_list_set_ints(nbt_node_t *list, const int *values, size_t n) {
+    return _list_set(list, MCNBT_TAG_INT, values, n);
+}
+
+size_t nbt_list_get_longs(nbt_node_t *list, long *out, size_t n) {
+    return _list_get(list, MCNBT_TAG_LONG, out, n);
+}
+
+int nbt_list_set_longs(nbt_node_t *list, const long *values, size_t n) {
+    return _list_set(list, MCNBT_TAG_LONG, values, n);
+}
+
+size_t nbt_list_get_floats(nbt_node_t *list, float *out, size_t n) {
+    return _list_get(list, MCNBT_TAG_FLOAT, out, n);
+}
+
+int nbt_list_set_floats(nbt_node_t *list, const float *values, size_t n) {
+    return _list_set(list, MCNBT_TAG_FLOAT, values, n);
+}
+
+size_t nbt_list_get_doubles(nbt_node_t *list, double *out, size_t n) {
+    return _list_get(list, MCNBT_TAG_DOUBLE, out, n);
+}
+
+int nbt_list_set_doubles(nbt_node_t *list, const double *values, size_t n) {
+    return _list_set(list, MCNBT_TAG_DOUBLE, values, n);
+}
+
 static void _strip_name(nbt_node_t *node) {
     if (node->name != NULL) {
-        FREE(node->name);
-        node->name = NULL;
+        _release_name(node);
     }
 }
 
 static void _add_name(nbt_node_t *node) {
     if (node->name == NULL) {
-        CALLOC(node->name, 1, sizeof(char), return);
+        node->name = _node_alloc(node->arena, 1);
+        ASSERT(node->name != NULL, return);
+        node->name[0] = '\0';
+        node->name_len = 0;
     }
 }
 
@@ -361,8 +1728,10 @@ int nbt_node_append_child(nbt_node_t *parent, nbt_node_t *child) {
     ASSERT(parent != NULL, return -1);
     ASSERT(child != NULL, return -1);
     ASSERT(parent->type == MCNBT_TAG_COMPOUND || parent->type == MCNBT_TAG_LIST, return -1);
+    MATERIALIZE(parent);
 
     if (parent->type == MCNBT_TAG_LIST) {
+        ASSERT(_children_reserve(parent, parent->child_count + 1) == 0, return -1);
         _strip_name(child);
     }
 
@@ -383,6 +1752,9 @@ int nbt_node_append_child(nbt_node_t *parent, nbt_node_t *child) {
     }
 
     child->parent = parent;
+    _children_insert(parent, child, parent->child_count);
+    _index_add(parent, child);
+    _touch(parent);
 
     return 0;
 }
@@ -391,11 +1763,17 @@ int nbt_node_prepend_child(nbt_node_t *parent, nbt_node_t *child) {
     ASSERT(parent != NULL, return -1);
     ASSERT(child != NULL, return -1);
     ASSERT(parent->type == MCNBT_TAG_COMPOUND || parent->type == MCNBT_TAG_LIST, return -1);
+    MATERIALIZE(parent);
 
     if (parent->type == MCNBT_TAG_LIST) {
+        ASSERT(_children_reserve(parent, parent->child_count + 1) == 0, return -1);
         _strip_name(child);
     }
 
+    if (parent->type == MCNBT_TAG_COMPOUND) {
+        _add_name(child);
+    }
+
     if (parent->first_child == NULL) {
         parent->first_child = child;
         parent->last_child = child;
@@ -409,6 +1787,9 @@ int nbt_node_prepend_child(nbt_node_t *parent, nbt_node_t *child) {
     }
 
     child->parent = parent;
+    _children_insert(parent, child, 0);
+    _index_add(parent, child);
+    _touch(parent);
 
     return 0;
 }
@@ -419,28 +1800,28 @@ int nbt_node_insert_after(nbt_node_t *left, nbt_node_t *right) {
     ASSERT(right != NULL, return -1);
     ASSERT(left->parent != NULL, return -1);
 
-    if (left->parent->type == MCNBT_TAG_LIST) {
+    nbt_node_t *parent = left->parent;
+    if (parent->type == MCNBT_TAG_LIST) {
+        ASSERT(_children_reserve(parent, parent->child_count + 1) == 0, return -1);
         _strip_name(right);
+    } else {
+        _add_name(right);
     }
 
-    nbt_node_t *parent = left->parent;
-    if (parent->first_child == parent->last_child) {
-        parent->last_child = right;
-        right->prev_child = left;
-        left->next_child = right;
-        right->parent = parent;
+    right->next_child = left->next_child;
+    if (left->next_child != NULL) {
+        left->next_child->prev_child = right;
     } else {
-        nbt_node_t *next = left->next_child;
-
-        next->prev_child = right;
-        right->next_child = next;
-
-        left->next_child = right;
-        right->prev_child = left;
-
-        right->parent = parent;
+        parent->last_child = right;
     }
 
+    left->next_child = right;
+    right->prev_child = left;
+    right->parent = parent;
+    _children_insert(parent, right, parent->type == MCNBT_TAG_LIST ? _children_find(parent, left) + 1 : 0);
+    _index_add(parent, right);
+    _touch(parent);
+
     return 0;
 }
 
@@ -449,28 +1830,28 @@ int nbt_node_insert_before(nbt_node_t *right, nbt_node_t *left) {
     ASSERT(right != NULL, return -1);
     ASSERT(right->parent != NULL, return -1);
 
-    if (right->parent->type == MCNBT_TAG_LIST) {
+    nbt_node_t *parent = right->parent;
+    if (parent->type == MCNBT_TAG_LIST) {
+        ASSERT(_children_reserve(parent, parent->child_count + 1) == 0, return -1);
         _strip_name(left);
+    } else {
+        _add_name(left);
     }
 
-    nbt_node_t *parent = right->parent;
-    if (parent->first_child == parent->last_child) {
-        parent->first_child = left;
-        right->prev_child = left;
-        left->next_child = right;
-        left->parent = parent;
+    left->prev_child = right->prev_child;
+    if (right->prev_child != NULL) {
+        right->prev_child->next_child = left;
     } else {
-        nbt_node_t *prev = right->prev_child;
-
-        prev->next_child = left;
-        left->prev_child = prev;
-
-        right->prev_child = left;
-        left->next_child = right;
-
-        left->parent = parent;
+        parent->first_child = left;
     }
 
+    right->prev_child = left;
+    left->next_child = right;
+    left->parent = parent;
+    _children_insert(parent, left, parent->type == MCNBT_TAG_LIST ? _children_find(parent, right) : 0);
+    _index_add(parent, left);
+    _touch(parent);
+
     return 0;
 }
 
@@ -478,6 +1859,13 @@ int nbt_node_unlink(nbt_node_t *node) {
     ASSERT(node != NULL, return -1);
     nbt_node_t *parent = node->parent;
 
+    /* before the node leaves, so that it takes an encoding of its own along */
+    if (parent != NULL) {
+        _touch(parent);
+        _index_remove(parent, node);
+        _children_remove(parent, node);
+    }
+
     if (node->prev_child != NULL) {
         node->prev_child->next_child = node->next_child;
     }
@@ -503,25 +1891,72 @@ int nbt_node_unlink(nbt_node_t *node) {
 }
 
 int nbt_node_replace(nbt_node_t *old, nbt_node_t *new) {
-    if (nbt_node_insert_before(old, new) != 0) {
-        return -1;
+    nbt_node_t *parent;
+    int same_name;
+
+    ASSERT(old != NULL, return -1);
+    ASSERT(new != NULL, return -1);
+    ASSERT(old->parent != NULL, return -1);
+    ASSERT(old != new, return 0);
+
+    parent = old->parent;
+    if (parent->type == MCNBT_TAG_LIST) {
+        _strip_name(new);
+    } else {
+        _add_name(new);
+    }
+
+    /* before the node leaves, so that it takes an encoding of its own along */
+    _touch(parent);
+
+    same_name = _name_eq(old, new->name, new->name_len);
+    if (same_name) {
+        _index_replace(parent, old, new);
+    } else {
+        _index_remove(parent, old);
+    }
+
+    new->prev_child = old->prev_child;
+    new->next_child = old->next_child;
+    if (old->prev_child != NULL) {
+        old->prev_child->next_child = new;
+    } else {
+        parent->first_child = new;
+    }
+    if (old->next_child != NULL) {
+        old->next_child->prev_child = new;
+    } else {
+        parent->last_child = new;
     }
+    new->parent = parent;
 
-    nbt_node_unlink(old);
+    if (parent->type == MCNBT_TAG_LIST) {
+        parent->children[_children_find(parent, old)] = new;
+    }
+
+    old->prev_child = NULL;
+    old->next_child = NULL;
+    old->parent = NULL;
+
+    if (!same_name) {
+        _index_add(parent, new);
+    }
     return 0;
 }
 
 size_t nbt_node_get_len(nbt_node_t *node) {
     ASSERT(node != NULL, return -1);
-    size_t ret = 0;
+
+    /* a deferred list knows its length from its header */
+    if (node->type == MCNBT_TAG_LIST && DEFERRED(node)) {
+        return _nbt_be32(node->src->data + node->src_pos + 1);
+    }
 
     switch (node->type) {
         case MCNBT_TAG_COMPOUND:
         case MCNBT_TAG_LIST:
-            for (nbt_node_t *n = node->first_child; n; n = n->next_child) {
-                ret++;
-            }
-            return ret;
+            LOAD(node);
+            return (node->flags & NODE_PACKED) ? node->len : node->child_count;
         case MCNBT_TAG_STRING:
         case MCNBT_TAG_BYTE_ARRAY:
         default:
@@ -533,5 +1968,6 @@ int nbt_node_set_len(nbt_node_t *node, size_t len) {
     ASSERT(node != NULL, return -1);
     ASSERT(node->type == MCNBT_TAG_BYTE_ARRAY || node->type == MCNBT_TAG_STRING, return -1);
     node->len = len;
+    _touch(node);
     return 0;
 }
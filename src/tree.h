@@ -20,9 +20,56 @@
 #define LIBMCNBT_TREE_H
 
 #include "mcnbt.h"
+#include "scan.h"
 
 int nbt_node_set_len(nbt_node_t *node, size_t len);
 
-nbt_node_t *_nbt_parse(void *data, size_t size, nbt_node_t *root, int *pos);
+#define NBT_CREATE_BORROW 0x1
+
+/* buffer shared by the deferred subtrees of a lazily parsed tree */
+typedef struct _nbt_source_t {
+    const unsigned char *data;
+    size_t size;
+    nbt_arena_t *arena;
+    int create;
+    size_t refs;
+} _nbt_source_t;
+
+/* payload buffer shared by equal nodes, see nbt_dedup_tree() */
+typedef struct _nbt_shared_t {
+    size_t refs;
+    size_t size;
+
+    /* right after two size_t, aligned for every array element type */
+    unsigned char data[];
+} _nbt_shared_t;
+
+nbt_node_t *_nbt_node_create(nbt_arena_t *arena, nbt_tag_type_t type, const char *name, size_t name_len,
+                             const void *data, size_t data_size, int flags);
+
+int _nbt_node_reserve_tree(nbt_arena_t *arena, const _nbt_scan_t *stats);
+void _nbt_node_set_lazy(nbt_node_t *node, _nbt_source_t *src, size_t pos, size_t len);
+int _nbt_node_materialize(nbt_node_t *node);
+int _nbt_node_get_raw(nbt_node_t *node, const unsigned char **data, size_t *len);
+void _nbt_node_set_encoded(nbt_node_t *node, _nbt_source_t *src, size_t pos, size_t len);
+void _nbt_node_drop_encoded(nbt_node_t *node);
+int _nbt_node_get_hash(nbt_node_t *node, uint64_t *hash);
+void _nbt_node_set_hash(nbt_node_t *node, uint64_t hash);
+uint64_t _nbt_hash_payload(const void *data, size_t len);
+nbt_arena_t *_nbt_node_get_arena(nbt_node_t *node);
+nbt_node_t *_nbt_node_find_child_len(nbt_node_t *node, const char *name, size_t len);
+void *_nbt_node_pack(nbt_node_t *node, size_t count);
+const void *_nbt_node_get_packed(nbt_node_t *node, size_t *count);
+void *_nbt_node_get_buffer(nbt_node_t *node);
+const void *_nbt_node_get_payload(nbt_node_t *node, size_t *size);
+_nbt_shared_t *_nbt_node_share_data(nbt_node_t *node);
+size_t _nbt_node_adopt_data(nbt_node_t *node, _nbt_shared_t *block);
+void _nbt_shared_unref(_nbt_shared_t *block);
+
+nbt_node_t *_nbt_parse(void *data, size_t size, nbt_arena_t *arena, int flags);
+nbt_node_t *_nbt_parse_value(const void *data, size_t size, nbt_tag_type_t type, const char *name, size_t name_len,
+                             nbt_arena_t *arena);
+int _nbt_parse_children(nbt_node_t *node, _nbt_source_t *src, size_t pos, size_t len);
+void _nbt_source_unref(_nbt_source_t *src);
 
 #endif
@@ -16,25 +16,151 @@
  *  License along with this library; if not see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
 #include "util.h"
 
+#if defined(__GNUC__) || defined(__clang__)
+#define THREAD_LOCAL __thread
+#define STAT_ADD(r, n) __atomic_add_fetch(&(r), n, __ATOMIC_RELAXED)
+#define STAT_LOAD(r) __atomic_load_n(&(r), __ATOMIC_RELAXED)
+#define STAT_STORE(r, v) __atomic_store_n(&(r), v, __ATOMIC_RELAXED)
+#else
+#define THREAD_LOCAL
+#define STAT_ADD(r, n) ((r) += (n))
+#define STAT_LOAD(r) (r)
+#define STAT_STORE(r, v) ((r) = (v))
+#endif
+
+/* all NULL for libc */
+static nbt_allocator_t _allocator;
+
+/* off by default, since every thread would contend on the same counters */
+static int _counting;
+static nbt_alloc_stats_t _stats;
+static THREAD_LOCAL int _category = MCNBT_ALLOC_TREE;
+
 void _mcnbt_alloc_fail(size_t size) {
     fprintf(stderr, "allocation failure: could not allocate %zu bytes\n", size);
 }
 
-/** Concatenates memory to a certain position
- * @param dest Destination pointer
- * @param src Source pointer
- * @param n Number of bytes to copy
- * @param pos Starting position in dest
- * @return Destination pointer
- */
-void *_mcnbt_memcat(void *dest, const void *src, size_t n, int pos) {
-    void *start_ptr = dest + pos;
-    memcpy(start_ptr, src, n);
-    return dest;
-}
\ No newline at end of file
+static void _count(size_t size) {
+    if (STAT_LOAD(_counting)) {
+        STAT_ADD(_stats.calls[_category], 1);
+        STAT_ADD(_stats.bytes[_category], size);
+    }
+}
+
+void *_nbt_malloc(const nbt_allocator_t *allocator, size_t size) {
+    if (allocator == NULL) {
+        allocator = &_allocator;
+    }
+
+    _count(size);
+    return allocator->malloc != NULL ? allocator->malloc(allocator->userdata, size) : malloc(size);
+}
+
+void *_nbt_calloc(const nbt_allocator_t *allocator, size_t n, size_t size) {
+    void *ret;
+
+    if (allocator == NULL) {
+        allocator = &_allocator;
+    }
+
+    if (allocator->malloc == NULL) {
+        _count(n * size);
+        return calloc(n, size);
+    }
+    if (allocator->calloc != NULL) {
+        _count(n * size);
+        return allocator->calloc(allocator->userdata, n, size);
+    }
+
+    ASSERT(size == 0 || n <= SIZE_MAX / size, return NULL);
+    ret = _nbt_malloc(allocator, n * size);
+    if (ret != NULL) {
+        memset(ret, 0, n * size);
+    }
+    return ret;
+}
+
+void *_nbt_realloc(const nbt_allocator_t *allocator, void *p, size_t size) {
+    if (allocator == NULL) {
+        allocator = &_allocator;
+    }
+
+    _count(size);
+    return allocator->malloc != NULL ? allocator->realloc(allocator->userdata, p, size) : realloc(p, size);
+}
+
+void _nbt_free(const nbt_allocator_t *allocator, void *p) {
+    if (allocator == NULL) {
+        allocator = &_allocator;
+    }
+
+    if (allocator->malloc != NULL) {
+        if (p != NULL) {
+            allocator->free(allocator->userdata, p);
+        }
+    } else {
+        free(p);
+    }
+}
+
+void *_nbt_zalloc(void *opaque, unsigned int items, unsigned int size) {
+    (void) opaque;
+    return _nbt_calloc(NULL, items, size);
+}
+
+void _nbt_zfree(void *opaque, void *p) {
+    (void) opaque;
+    _nbt_free(NULL, p);
+}
+
+int _nbt_alloc_enter(int category) {
+    int prev = _category;
+    _category = category;
+    return prev;
+}
+
+void _nbt_alloc_leave(int prev) {
+    _category = prev;
+}
+
+int nbt_set_allocator(const nbt_allocator_t *allocator) {
+    if (allocator == NULL) {
+        memset(&_allocator, 0, sizeof(_allocator));
+        return 0;
+    }
+
+    ASSERT(allocator->malloc != NULL && allocator->realloc != NULL && allocator->free != NULL, return -1);
+    _allocator = *allocator;
+    return 0;
+}
+
+void nbt_free(void *ptr) {
+    _nbt_free(NULL, ptr);
+}
+
+void nbt_alloc_stats_enable(int enable) {
+    STAT_STORE(_counting, enable != 0);
+}
+
+void nbt_alloc_stats_get(nbt_alloc_stats_t *stats) {
+    ASSERT(stats != NULL, return);
+
+    for (int i = 0; i < MCNBT_ALLOC_CATEGORIES; i++) {
+        stats->calls[i] = STAT_LOAD(_stats.calls[i]);
+        stats->bytes[i] = STAT_LOAD(_stats.bytes[i]);
+    }
+}
+
+void nbt_alloc_stats_reset(void) {
+    for (int i = 0; i < MCNBT_ALLOC_CATEGORIES; i++) {
+        STAT_STORE(_stats.calls[i], 0);
+        STAT_STORE(_stats.bytes[i], 0);
+    }
+}
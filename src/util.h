@@ -19,18 +19,43 @@
 #ifndef LIBMCNBT_UTIL_H
 #define LIBMCNBT_UTIL_H
 
-#define MAX_BUFFER 524288
+#include <stddef.h>
+
+#include "mcnbt.h"
 
 void _mcnbt_alloc_fail(size_t size);
 
-#define MALLOC(p, s, action) do { p = malloc(s); if (p == NULL) { _mcnbt_alloc_fail(s); action; } } while(0)
-#define CALLOC(p, l, s, action) do { p = calloc(l, s); if(p == NULL) { _mcnbt_alloc_fail(l * s); action; } } while(0)
+/* allocator NULL means the one set with nbt_set_allocator() */
+void *_nbt_malloc(const nbt_allocator_t *allocator, size_t size);
+void *_nbt_calloc(const nbt_allocator_t *allocator, size_t n, size_t size);
+void *_nbt_realloc(const nbt_allocator_t *allocator, void *p, size_t size);
+void _nbt_free(const nbt_allocator_t *allocator, void *p);
+
+/* zlib's alloc_func and free_func, so compression goes through the same allocator */
+void *_nbt_zalloc(void *opaque, unsigned int items, unsigned int size);
+void _nbt_zfree(void *opaque, void *p);
+
+/* Attributes allocations on the calling thread to a MCNBT_ALLOC_* category
+ * until _nbt_alloc_leave() is handed the returned previous category. */
+int _nbt_alloc_enter(int category);
+void _nbt_alloc_leave(int prev);
+
+#define MALLOC(p, s, action) do { p = _nbt_malloc(NULL, s); if (p == NULL) { _mcnbt_alloc_fail(s); action; } } while(0)
+#define CALLOC(p, l, s, action) do { p = _nbt_calloc(NULL, l, s); if(p == NULL) { _mcnbt_alloc_fail(l * s); action; } } while(0)
+#define REALLOC(p, s, action) do { void *_tmp = _nbt_realloc(NULL, p, s); if (_tmp == NULL) { _mcnbt_alloc_fail(s); action; } else { p = _tmp; } } while(0)
 
-#define FREE(p) do { free(p); p = NULL; } while(0)
+#define FREE(p) do { _nbt_free(NULL, p); p = NULL; } while(0)
 
 #define ASSERT(cond, action) do { if(!(cond)) { action; } } while(0)
 
-void *_mcnbt_memcat(void *dest, const void *src, size_t n, int pos);
+/* reference counts on buffers that clones share between threads; REF_DEC yields the new count */
+#if defined(__GNUC__) || defined(__clang__)
+#define REF_INC(r) __atomic_add_fetch(&(r), 1, __ATOMIC_RELAXED)
+#define REF_DEC(r) __atomic_sub_fetch(&(r), 1, __ATOMIC_ACQ_REL)
+#else
+#define REF_INC(r) (++(r))
+#define REF_DEC(r) (--(r))
+#endif
 
 
 #endif //LIBMCNBT_UTIL_H
@@ -0,0 +1,168 @@
+/*
+ *  writer.c
+ *
+ *  Copyright (c) 2018 Mark Weiman <mark.weiman@markzz.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "mcnbt.h"
+#include "stream.h"
+#include "util.h"
+
+#define WRITE_BUFFER 65536
+
+typedef struct _nbt_writer_t {
+    /* first, so the serializer's flush can get back to the writer */
+    _nbt_out_t out;
+
+    nbt_write_fn write;
+    void *userdata;
+    int compression;
+    z_stream z;
+
+    unsigned char buf[WRITE_BUFFER];
+    unsigned char zbuf[WRITE_BUFFER];
+} _nbt_writer_t;
+
+static int _deflate(_nbt_writer_t *w, int flush) {
+    size_t n;
+    int r;
+
+    /* a full output buffer means deflate may have more to give */
+    do {
+        w->z.next_out = w->zbuf;
+        w->z.avail_out = WRITE_BUFFER;
+        r = deflate(&w->z, flush);
+        ASSERT(r != Z_STREAM_ERROR, return -1);
+
+        n = WRITE_BUFFER - w->z.avail_out;
+        if (n > 0) {
+            ASSERT(w->write(w->userdata, w->zbuf, n) == 0, return -1);
+        }
+    } while (w->z.avail_out == 0);
+
+    return 0;
+}
+
+static int _flush(_nbt_out_t *out) {
+    _nbt_writer_t *w = (_nbt_writer_t *) out;
+    size_t n = (size_t) (out->pos - out->start);
+
+    out->pos = out->start;
+    if (n == 0) {
+        return 0;
+    }
+
+    if (w->compression == MCNBT_COMPRESS_NONE) {
+        return w->write(w->userdata, out->start, n);
+    }
+
+    w->z.next_in = out->start;
+    w->z.avail_in = (uInt) n;
+    return _deflate(w, Z_NO_FLUSH);
+}
+
+static int _write_sink(nbt_node_t *tree, nbt_write_fn write, void *userdata, int compression) {
+    _nbt_writer_t *w;
+    int ret;
+    ASSERT(tree != NULL, return -1);
+    ASSERT(write != NULL, return -1);
+    ASSERT(compression == MCNBT_COMPRESS_NONE || compression == MCNBT_COMPRESS_GZIP ||
+           compression == MCNBT_COMPRESS_ZLIB, return -1);
+
+    if (nbt_node_get_type(tree) != MCNBT_TAG_COMPOUND) {
+        fprintf(stderr, "root node must be compound\n");
+        return -1;
+    }
+
+    MALLOC(w, sizeof(_nbt_writer_t), return -1);
+    w->write = write;
+    w->userdata = userdata;
+    w->compression = compression;
+    w->out.start = w->buf;
+    w->out.pos = w->buf;
+    w->out.end = w->buf + WRITE_BUFFER;
+    w->out.flush = _flush;
+
+    if (compression != MCNBT_COMPRESS_NONE) {
+        memset(&w->z, 0, sizeof(w->z));
+        w->z.zalloc = _nbt_zalloc;
+        w->z.zfree = _nbt_zfree;
+
+        /* 16 on top of the window bits asks zlib for a gzip wrapper */
+        ret = deflateInit2(&w->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                           compression == MCNBT_COMPRESS_GZIP ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY);
+        ASSERT(ret == Z_OK, FREE(w); return -1);
+    }
+
+    ret = _nbt_serialize_out(tree, &w->out);
+    if (ret == 0) {
+        ret = _flush(&w->out);
+    }
+    if (ret == 0 && compression != MCNBT_COMPRESS_NONE) {
+        w->z.avail_in = 0;
+        ret = _deflate(w, Z_FINISH);
+    }
+
+    if (compression != MCNBT_COMPRESS_NONE) {
+        deflateEnd(&w->z);
+    }
+    FREE(w);
+    return ret;
+}
+
+int nbt_write_sink(nbt_node_t *tree, nbt_write_fn write, void *userdata, int compression) {
+    int scope = _nbt_alloc_enter(MCNBT_ALLOC_SERIALIZE);
+    int ret = _write_sink(tree, write, userdata, compression);
+    _nbt_alloc_leave(scope);
+    return ret;
+}
+
+static int _write_fd(void *userdata, const void *buf, size_t len) {
+    int fd = *((int *) userdata);
+    const char *p = buf;
+    ssize_t r;
+
+    while (len > 0) {
+        r = write(fd, p, len);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        ASSERT(r > 0, return -1);
+        p += r;
+        len -= (size_t) r;
+    }
+    return 0;
+}
+
+static int _write_file(void *userdata, const void *buf, size_t len) {
+    return fwrite(buf, 1, len, (FILE *) userdata) == len ? 0 : -1;
+}
+
+int nbt_write_fd(nbt_node_t *tree, int fd, int compression) {
+    ASSERT(fd >= 0, return -1);
+    return nbt_write_sink(tree, _write_fd, &fd, compression);
+}
+
+int nbt_write_file(nbt_node_t *tree, FILE *file, int compression) {
+    ASSERT(file != NULL, return -1);
+    return nbt_write_sink(tree, _write_file, file, compression);
+}